@@ -5,54 +5,128 @@
 
 BufferManager::BufferManager(UVulkanRenderDevice* renderer) : renderer(renderer)
 {
-	CreateSceneVertexBuffer();
-	CreateSceneIndexBuffer();
+	SceneFrames.resize(renderer->Commands->GetFramesInFlight());
+	for (auto& frame : SceneFrames)
+		frame.Pages.push_back(CreateScenePage(NewSceneVertexPageSize, NewSceneIndexPageSize));
+
 	CreateUploadBuffer();
+	SetFrame(renderer->Commands->GetFrameIndex());
 }
 
 BufferManager::~BufferManager()
 {
-	if (SceneVertices) { SceneVertexBuffer->Unmap(); SceneVertices = nullptr; }
-	if (SceneIndexes) { SceneIndexBuffer->Unmap(); SceneIndexes = nullptr; }
+	for (auto& frame : SceneFrames)
+	{
+		for (auto& page : frame.Pages)
+		{
+			page.VertexBuffer->Unmap();
+			page.IndexBuffer->Unmap();
+		}
+	}
 	if (UploadData) { UploadBuffer->Unmap(); UploadData = nullptr; }
 }
 
-void BufferManager::CreateSceneVertexBuffer()
+void BufferManager::SetFrame(int index)
+{
+	CurrentSceneFrame = index;
+	auto& frame = SceneFrames[index];
+
+	// The GPU may still be using the old pages, but the delete list is the
+	// one of this frame context, so they live until its last use is done.
+	if (frame.Pages.size() > 1)
+	{
+		size_t vertexBytes = std::max(NewSceneVertexPageSize, (size_t)SceneVertexHighWater * 5 / 4);
+		size_t indexes = std::max(NewSceneIndexPageSize, (size_t)SceneIndexHighWater * 5 / 4);
+		NewSceneVertexPageSize = (vertexBytes + 0xfffff) & ~(size_t)0xfffff;
+		NewSceneIndexPageSize = (indexes + 0xfffff) & ~(size_t)0xfffff;
+		debugf(TEXT("Vulkan: Growing scene pages to %d MB of vertices, %d indices"), (int)(NewSceneVertexPageSize >> 20), (int)NewSceneIndexPageSize);
+
+		for (auto& page : frame.Pages)
+			DestroyScenePage(page);
+		frame.Pages.clear();
+		frame.Pages.push_back(CreateScenePage(NewSceneVertexPageSize, NewSceneIndexPageSize));
+	}
+
+	frame.CurrentPage = 0;
+	frame.UsedVertexBytes = 0;
+	frame.UsedIndexes = 0;
+	SelectScenePage(frame.Pages[0]);
+}
+
+void BufferManager::NextScenePage(size_t usedVertexBytes, size_t usedIndexes, size_t minVertexBytes, size_t minIndexes)
+{
+	auto& frame = SceneFrames[CurrentSceneFrame];
+	frame.UsedVertexBytes += usedVertexBytes;
+	frame.UsedIndexes += usedIndexes;
+
+	frame.CurrentPage++;
+	if (frame.CurrentPage == frame.Pages.size() || frame.Pages[frame.CurrentPage].VertexSize < minVertexBytes || frame.Pages[frame.CurrentPage].IndexSize < minIndexes)
+	{
+		ScenePage page = CreateScenePage(std::max(NewSceneVertexPageSize, minVertexBytes), std::max(NewSceneIndexPageSize, minIndexes));
+		frame.Pages.insert(frame.Pages.begin() + frame.CurrentPage, std::move(page));
+	}
+	SelectScenePage(frame.Pages[frame.CurrentPage]);
+}
+
+void BufferManager::EndSceneFrame(size_t usedVertexBytes, size_t usedIndexes)
+{
+	auto& frame = SceneFrames[CurrentSceneFrame];
+	frame.UsedVertexBytes += usedVertexBytes;
+	frame.UsedIndexes += usedIndexes;
+	SceneVertexHighWater = std::max((size_t)SceneVertexHighWater, frame.UsedVertexBytes);
+	SceneIndexHighWater = std::max((size_t)SceneIndexHighWater, frame.UsedIndexes);
+}
+
+void BufferManager::SelectScenePage(ScenePage& page)
+{
+	SceneVertexBuffer = page.VertexBuffer.get();
+	SceneIndexBuffer = page.IndexBuffer.get();
+	SceneVertices = page.Vertices;
+	SceneIndexes = page.Indexes;
+	SceneVertexPageSize = page.VertexSize;
+	SceneIndexPageSize = page.IndexSize;
+}
+
+BufferManager::ScenePage BufferManager::CreateScenePage(size_t vertexBytes, size_t indexes)
 {
-	size_t size = sizeof(SceneVertex) * SceneVertexBufferSize;
+	ScenePage page;
+	page.VertexSize = vertexBytes;
+	page.IndexSize = indexes;
 
-	SceneVertexBuffer = BufferBuilder()
+	page.VertexBuffer = BufferBuilder()
 		.Usage(
 			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
 			VMA_MEMORY_USAGE_UNKNOWN, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT)
 		.MemoryType(
 			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
-		.Size(size)
+		.Size(vertexBytes)
 		.DebugName("SceneVertexBuffer")
 		.Create(renderer->Device.get());
+	page.Vertices = (uint8_t*)page.VertexBuffer->Map(0, vertexBytes);
 
-	assert(!SceneVertices);
-	SceneVertices = (SceneVertex*)SceneVertexBuffer->Map(0, size);
-}
-
-void BufferManager::CreateSceneIndexBuffer()
-{
-	size_t size = sizeof(uint32_t) * SceneIndexBufferSize;
-
-	SceneIndexBuffer = BufferBuilder()
+	page.IndexBuffer = BufferBuilder()
 		.Usage(
 			VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
 			VMA_MEMORY_USAGE_UNKNOWN, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT)
 		.MemoryType(
 			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
-		.Size(size)
+		.Size(indexes * sizeof(uint32_t))
 		.DebugName("SceneIndexBuffer")
 		.Create(renderer->Device.get());
+	page.Indexes = (uint32_t*)page.IndexBuffer->Map(0, indexes * sizeof(uint32_t));
 
-	assert(!SceneIndexes);
-	SceneIndexes = (uint32_t*)SceneIndexBuffer->Map(0, size);
+	return page;
+}
+
+void BufferManager::DestroyScenePage(ScenePage& page)
+{
+	page.VertexBuffer->Unmap();
+	page.IndexBuffer->Unmap();
+	auto& deletes = renderer->Commands->GetFrameDeleteList();
+	deletes.buffers.push_back(std::move(page.VertexBuffer));
+	deletes.buffers.push_back(std::move(page.IndexBuffer));
 }
 
 void BufferManager::CreateUploadBuffer()
@@ -71,3 +145,18 @@ void BufferManager::CreateUploadBuffer()
 	assert(!UploadData);
 	UploadData = (uint8_t*)UploadBuffer->Map(0, UploadBufferSize);
 }
+
+void BufferManager::GrowUploadBuffer(VkDeviceSize minSize)
+{
+	// doubling keeps the size a multiple of any alignment the ring uses
+	VkDeviceSize newSize = UploadBufferSize;
+	while (newSize < minSize)
+		newSize *= 2;
+
+	UploadBuffer->Unmap();
+	UploadData = nullptr;
+	renderer->Commands->GetFrameDeleteList().buffers.push_back(std::move(UploadBuffer));
+
+	UploadBufferSize = newSize;
+	CreateUploadBuffer();
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ShaderManager.h"
+#include <atomic>
 
 class UVulkanRenderDevice;
 struct SceneVertex;
@@ -11,23 +12,79 @@ public:
 	BufferManager(UVulkanRenderDevice* renderer);
 	~BufferManager();
 
-	std::unique_ptr<VulkanBuffer> SceneVertexBuffer;
-	std::unique_ptr<VulkanBuffer> SceneIndexBuffer;
 	std::unique_ptr<VulkanBuffer> UploadBuffer;
 
-	SceneVertex* SceneVertices = nullptr;
+	// The current page of the current frame's scene vertex & index buffers,
+	// which is where the frame's vertices & indices go. The vertex formats
+	// differ in size (see SceneVertexFormat), so the vertices are just bytes
+	// here, and the vertex page size is in bytes, the index one in indices.
+	VulkanBuffer* SceneVertexBuffer = nullptr;
+	VulkanBuffer* SceneIndexBuffer = nullptr;
+	uint8_t* SceneVertices = nullptr;
 	uint32_t* SceneIndexes = nullptr;
+	size_t SceneVertexPageSize = 0;
+	size_t SceneIndexPageSize = 0;
 	uint8_t* UploadData = nullptr;
 
-	static const int SceneVertexBufferSize = 1 * 1024 * 1024;
-	static const int SceneIndexBufferSize = 1 * 1024 * 1024;
+	static const int DefaultSceneVertexPageSize = 16 * 1024 * 1024;
+	static const int DefaultSceneIndexPageSize = 1 * 1024 * 1024;
 
-	static const int UploadBufferSize = 64 * 1024 * 1024;
+	// Each frame in flight has pages of its own. A frame starts out on its
+	// first page and moves on to the next one when that is full, adding a
+	// page if there is none left. If a frame needed more than one page, its
+	// pages get replaced with a single one big enough for the high water
+	// mark the next time the frame context comes round.
+	void SetFrame(int index);
+
+	// The used sizes are those of the current page. The next page gets at
+	// least the min sizes.
+	void NextScenePage(size_t usedVertexBytes, size_t usedIndexes, size_t minVertexBytes, size_t minIndexes);
+	void EndSceneFrame(size_t usedVertexBytes, size_t usedIndexes);
+
+	// The most that a single frame has used so far
+	std::atomic<size_t> SceneVertexHighWater = 0;
+	std::atomic<size_t> SceneIndexHighWater = 0;
+
+	// The upload buffer is where UploadManager's ring lives. It starts out
+	// at the default size and only ever grows, see GrowUploadBuffer.
+	static const int DefaultUploadBufferSize = 64 * 1024 * 1024;
+	VkDeviceSize UploadBufferSize = DefaultUploadBufferSize;
+
+	// Replaces the upload buffer with one of at least minSize bytes. The
+	// old one gets deleted once the GPU is done with the current frame.
+	void GrowUploadBuffer(VkDeviceSize minSize);
 
 private:
-	void CreateSceneVertexBuffer();
-	void CreateSceneIndexBuffer();
+	struct ScenePage
+	{
+		std::unique_ptr<VulkanBuffer> VertexBuffer;
+		std::unique_ptr<VulkanBuffer> IndexBuffer;
+		uint8_t* Vertices = nullptr;
+		uint32_t* Indexes = nullptr;
+		size_t VertexSize = 0;
+		size_t IndexSize = 0;
+	};
+
+	struct SceneFrame
+	{
+		std::vector<ScenePage> Pages;
+		size_t CurrentPage = 0;
+		// by the pages before the current one
+		size_t UsedVertexBytes = 0;
+		size_t UsedIndexes = 0;
+	};
+
+	ScenePage CreateScenePage(size_t vertexBytes, size_t indexes);
+	void DestroyScenePage(ScenePage& page);
+	void SelectScenePage(ScenePage& page);
 	void CreateUploadBuffer();
 
 	UVulkanRenderDevice* renderer = nullptr;
+
+	std::vector<SceneFrame> SceneFrames;
+	int CurrentSceneFrame = 0;
+
+	// what new pages get at least, grows with the high water marks
+	size_t NewSceneVertexPageSize = DefaultSceneVertexPageSize;
+	size_t NewSceneIndexPageSize = DefaultSceneIndexPageSize;
 };
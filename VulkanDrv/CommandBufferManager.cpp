@@ -3,22 +3,32 @@
 #include "CommandBufferManager.h"
 #include "UVulkanRenderDevice.h"
 
-CommandBufferManager::CommandBufferManager(UVulkanRenderDevice* renderer) : renderer(renderer)
+CommandBufferManager::CommandBufferManager(UVulkanRenderDevice* renderer, int framesInFlight) : renderer(renderer), FramesInFlight(framesInFlight)
 {
 	SwapChain = VulkanSwapChainBuilder()
 		.Create(renderer->Device.get());
 
-	ImageAvailableSemaphore = SemaphoreBuilder()
-		.DebugName("ImageAvailableSemaphore")
-		.Create(renderer->Device.get());
+	Graphics.Create(renderer->Device.get(), renderer->Device.get()->GraphicsQueue, "GraphicsTimeline");
+	Transfer.Create(renderer->Device.get(), renderer->Device.get()->TransferQueue, "TransferTimeline");
+	Compute.Create(renderer->Device.get(), renderer->Device.get()->ComputeQueue, "ComputeTimeline");
 
-	RenderFinishedSemaphore = SemaphoreBuilder()
-		.DebugName("RenderFinishedSemaphore")
-		.Create(renderer->Device.get());
+	for (int i = 0; i < FramesInFlight; i++)
+	{
+		ImageAvailableSemaphores[i] = SemaphoreBuilder()
+			.DebugName("ImageAvailableSemaphore")
+			.Create(renderer->Device.get());
 
-	RenderFinishedFence = FenceBuilder()
-		.DebugName("RenderFinishedFence")
-		.Create(renderer->Device.get());
+		Frames[i].RenderFinishedSemaphore = SemaphoreBuilder()
+			.DebugName("RenderFinishedSemaphore")
+			.Create(renderer->Device.get());
+
+		Frames[i].CommandPool = CommandPoolBuilder()
+			.QueueFamily(renderer->Device.get()->GraphicsFamily)
+			.DebugName("FrameCommandPool")
+			.Create(renderer->Device.get());
+		Frames[i].DrawCommands = Frames[i].CommandPool->createBuffer();
+		Frames[i].UploadCommands = Frames[i].CommandPool->createBuffer();
+	}
 
 	TransferSemaphore.reset(new VulkanSemaphore(renderer->Device.get()));
 
@@ -27,23 +37,49 @@ CommandBufferManager::CommandBufferManager(UVulkanRenderDevice* renderer) : rend
 		.DebugName("CommandPool")
 		.Create(renderer->Device.get());
 
-	FrameDeleteList = std::make_unique<DeleteList>();
+	TransferCommandPool = CommandPoolBuilder()
+		.QueueFamily(renderer->Device.get()->TransferFamily)
+		.DebugName("TransferCommandPool")
+		.Create(renderer->Device.get());
+
+	ComputeCommandPool = CommandPoolBuilder()
+		.QueueFamily(renderer->Device.get()->ComputeFamily)
+		.DebugName("ComputeCommandPool")
+		.Create(renderer->Device.get());
 }
 
 CommandBufferManager::~CommandBufferManager()
 {
-	DeleteFrameObjects();
+	Transfer.WaitIdle();
+	Compute.WaitIdle();
+	DeleteAllFrameObjects();
+}
+
+bool CommandBufferManager::HasTransferQueue() const
+{
+	return renderer->Device->TransferFamily != renderer->Device->GraphicsFamily;
+}
+
+bool CommandBufferManager::HasComputeQueue() const
+{
+	return renderer->Device->ComputeFamily != renderer->Device->GraphicsFamily;
 }
 
 void CommandBufferManager::SubmitCommands(bool present, int presentWidth, int presentHeight, bool presentFullscreen)
 {
-	if (DrawCommands)
-		DrawCommands->end();
+	auto& frame = Frames[CurrentFrame];
 
+	// the uploads were recorded for the draws, so they go first
 	QueueSubmit submit;
-	if (DrawCommands)
+	if (frame.UploadRecording)
+	{
+		frame.UploadCommands->end();
+		submit.AddCommandBuffer(frame.UploadCommands.get());
+	}
+	if (frame.DrawRecording)
 	{
-		submit.AddCommandBuffer(DrawCommands.get());
+		frame.DrawCommands->end();
+		submit.AddCommandBuffer(frame.DrawCommands.get());
 	}
 	//if (TransferCommands)
 	//{
@@ -51,37 +87,125 @@ void CommandBufferManager::SubmitCommands(bool present, int presentWidth, int pr
 	//}
 	if (present && PresentImageIndex != -1)
 	{
-		submit.AddWait(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, ImageAvailableSemaphore.get());
-		submit.AddSignal(RenderFinishedSemaphore.get());
+		submit.AddWait(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, ImageAvailableSemaphore);
+		submit.AddSignal(frame.RenderFinishedSemaphore.get());
 	}
-	submit.Execute(renderer->Device.get(), renderer->Device.get()->GraphicsQueue, RenderFinishedFence.get());
+	frame.SubmitValue = Graphics.Submit(submit);
+	frame.Submitted = true;
+	frame.DrawRecording = false;
+	frame.UploadRecording = false;
 
 	if (present && PresentImageIndex != -1)
 	{
-		SwapChain->QueuePresent(PresentImageIndex, RenderFinishedSemaphore.get());
+		SwapChain->QueuePresent(PresentImageIndex, frame.RenderFinishedSemaphore.get());
 	}
 
-	vkWaitForFences(renderer->Device.get()->device, 1, &RenderFinishedFence->fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
-	vkResetFences(renderer->Device.get()->device, 1, &RenderFinishedFence->fence);
-
-	DrawCommands.reset();
-	//TransferCommands.reset();
-	DeleteFrameObjects();
+	// Don't wait for the GPU here, the next frame gets recorded into the
+	// next frame context and only waits for that one's previous use.
+	CurrentFrame = (CurrentFrame + 1) % FramesInFlight;
 }
 
 VulkanCommandBuffer* CommandBufferManager::GetDrawCommands()
 {
-	if (!DrawCommands)
+	auto& frame = Frames[CurrentFrame];
+	if (frame.Submitted)
+		BeginFrame();
+	if (!frame.DrawRecording)
+	{
+		frame.DrawCommands->begin();
+		frame.DrawRecording = true;
+	}
+	return frame.DrawCommands.get();
+}
+
+// Transfers the current frame's draws depend on. These get submitted
+// right before the draw commands, in the same batch.
+VulkanCommandBuffer* CommandBufferManager::GetUploadCommands()
+{
+	auto& frame = Frames[CurrentFrame];
+	if (frame.Submitted)
+		BeginFrame();
+	if (!frame.UploadRecording)
+	{
+		frame.UploadCommands->begin();
+		frame.UploadRecording = true;
+	}
+	return frame.UploadCommands.get();
+}
+
+// For drawing within renderPass, to be executed from the draw commands.
+// Safe to call from several threads at once, as long as each passes its
+// own thread index (see WorkerPool::Run).
+VulkanCommandBuffer* CommandBufferManager::BeginSecondaryCommands(int thread, VulkanRenderPass* renderPass, VulkanFramebuffer* framebuffer)
+{
+	auto& commands = Frames[CurrentFrame].Threads[thread];
+	if (!commands.CommandPool)
 	{
-		DrawCommands = CommandPool->createBuffer();
-		DrawCommands->begin();
+		commands.CommandPool = CommandPoolBuilder()
+			.QueueFamily(renderer->Device.get()->GraphicsFamily)
+			.DebugName("ThreadCommandPool")
+			.Create(renderer->Device.get());
 	}
-	return DrawCommands.get();
+	if (commands.Used == commands.Buffers.size())
+		commands.Buffers.push_back(commands.CommandPool->createBuffer(VK_COMMAND_BUFFER_LEVEL_SECONDARY));
+
+	VkCommandBufferInheritanceInfo inheritance = {};
+	inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritance.renderPass = renderPass->renderPass;
+	inheritance.subpass = 0;
+	inheritance.framebuffer = framebuffer->framebuffer;
+
+	auto buffer = commands.Buffers[commands.Used++].get();
+	buffer->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT, &inheritance);
+	return buffer;
 }
 
-void CommandBufferManager::DeleteFrameObjects()
+// Waits until the GPU is done with the current frame context, i.e. with
+// the frame submitted FramesInFlight submits ago, so that its resources
+// can be reused.
+void CommandBufferManager::BeginFrame()
 {
-	FrameDeleteList = std::make_unique<DeleteList>();
+	WaitForFrame(CurrentFrame);
+}
+
+void CommandBufferManager::WaitForFrame(int index)
+{
+	auto& frame = Frames[index];
+	if (!frame.Submitted)
+		return;
+
+	Graphics.Wait(frame.SubmitValue);
+	frame.CommandPool->reset();
+	for (auto& commands : frame.Threads)
+	{
+		if (commands.CommandPool)
+		{
+			commands.CommandPool->reset();
+			commands.Used = 0;
+		}
+	}
+	DeleteFrameObjects(index);
+	frame.Submitted = false;
+}
+
+// For when something that all the frames might be using is about to be
+// destroyed, e.g. the swap chain or the scene textures.
+void CommandBufferManager::WaitForAllFrames()
+{
+	for (int i = 0; i < FramesInFlight; i++)
+		WaitForFrame(i);
+}
+
+void CommandBufferManager::DeleteAllFrameObjects()
+{
+	WaitForAllFrames();
+	for (int i = 0; i < FramesInFlight; i++)
+		DeleteFrameObjects(i);
+}
+
+void CommandBufferManager::DeleteFrameObjects(int index)
+{
+	Frames[index].Deletes.clear();
 }
 
 void CommandBufferManager::AcquirePresentImage(int presentWidth, int presentHeight, bool presentFullscreen)
@@ -89,6 +213,7 @@ void CommandBufferManager::AcquirePresentImage(int presentWidth, int presentHeig
 	if (SwapChain->Lost() || SwapChain->Width() != presentWidth || SwapChain->Height() != presentHeight || UsingVsync != renderer->UseVSync || UsingHdr != renderer->Hdr)
 	{
 		try {
+			WaitForAllFrames();
 			UsingVsync = renderer->UseVSync;
 			UsingHdr = renderer->Hdr;
 			renderer->Framebuffers->DestroySwapChainFramebuffers();
@@ -100,10 +225,59 @@ void CommandBufferManager::AcquirePresentImage(int presentWidth, int presentHeig
 		}
 	}
 
-	PresentImageIndex = SwapChain->AcquireImage(ImageAvailableSemaphore.get());
+	ImageAvailableSemaphore = ImageAvailableSemaphores[AcquireIndex].get();
+	AcquireIndex = (AcquireIndex + 1) % FramesInFlight;
+	PresentImageIndex = SwapChain->AcquireImage(ImageAvailableSemaphore);
 }
 
 std::unique_ptr<VulkanCommandBuffer> CommandBufferManager::CreateCommandBuffer()
 {
 	return CommandPool->createBuffer();
+}
+
+// Submit these with Transfer.Submit / Compute.Submit
+std::unique_ptr<VulkanCommandBuffer> CommandBufferManager::CreateTransferCommandBuffer()
+{
+	return TransferCommandPool->createBuffer();
+}
+
+std::unique_ptr<VulkanCommandBuffer> CommandBufferManager::CreateComputeCommandBuffer()
+{
+	return ComputeCommandPool->createBuffer();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+void CommandBufferManager::QueueTimeline::Create(VulkanDevice* device, VkQueue queue, const char* debugName)
+{
+	Device = device;
+	Queue = queue;
+	Semaphore = SemaphoreBuilder()
+		.Timeline(0)
+		.DebugName(debugName)
+		.Create(device);
+}
+
+uint64_t CommandBufferManager::QueueTimeline::Submit(QueueSubmit& submit)
+{
+	uint64_t value = LastSubmitted + 1;
+	submit.AddSignal(Semaphore.get(), value);
+	submit.Execute(Device, Queue);
+	LastSubmitted = value;
+	return value;
+}
+
+bool CommandBufferManager::QueueTimeline::IsDone(uint64_t value)
+{
+	if (value > LastCompleted)
+		LastCompleted = Semaphore->GetValue();
+	return value <= LastCompleted;
+}
+
+void CommandBufferManager::QueueTimeline::Wait(uint64_t value)
+{
+	if (value <= LastCompleted)
+		return;
+	Semaphore->Wait(value);
+	LastCompleted = value;
 }
\ No newline at end of file
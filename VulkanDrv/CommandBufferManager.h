@@ -5,26 +5,95 @@ class UVulkanRenderDevice;
 class CommandBufferManager
 {
 public:
-	CommandBufferManager(UVulkanRenderDevice* renderer);
+	CommandBufferManager(UVulkanRenderDevice* renderer, int framesInFlight);
 	~CommandBufferManager();
 
+	static constexpr int MaxFramesInFlight = 3;
+	static constexpr int MaxRecordingThreads = 8;
+
+	// A queue and a timeline semaphore that every submit to it signals
+	// with the next value. Whoever needs to know when a submit is done
+	// keeps its value around, there are no fences.
+	class QueueTimeline
+	{
+	public:
+		void Create(VulkanDevice* device, VkQueue queue, const char* debugName);
+
+		// Adds the signal to submit, executes it and returns the value
+		// that the semaphore reaches once the GPU is done with it.
+		uint64_t Submit(QueueSubmit& submit);
+
+		bool IsDone(uint64_t value);
+		void Wait(uint64_t value);
+		void WaitIdle() { Wait(LastSubmitted); }
+
+		VulkanSemaphore* GetSemaphore() { return Semaphore.get(); }
+		uint64_t GetLastSubmitted() const { return LastSubmitted; }
+
+	private:
+		VulkanDevice* Device = nullptr;
+		VkQueue Queue = VK_NULL_HANDLE;
+		std::unique_ptr<VulkanSemaphore> Semaphore;
+		uint64_t LastSubmitted = 0;
+		uint64_t LastCompleted = 0; // as far as we know
+	};
+
+	// Transfer and Compute are the dedicated queues if the device has
+	// them, otherwise they submit to the graphics queue. Resources used
+	// across queue families need ownership transfers (a release barrier on
+	// one queue, an acquire on the other) unless created concurrent.
+	QueueTimeline Graphics;
+	QueueTimeline Transfer;
+	QueueTimeline Compute;
+
+	bool HasTransferQueue() const;
+	bool HasComputeQueue() const;
+
 	//void WaitForTransfer();
 	void SubmitCommands(bool present, int presentWidth, int presentHeight, bool presentFullscreen);
 	//VulkanCommandBuffer* GetTransferCommands();
 	VulkanCommandBuffer* GetDrawCommands();
+	VulkanCommandBuffer* GetUploadCommands();
+	VulkanCommandBuffer* BeginSecondaryCommands(int thread, VulkanRenderPass* renderPass, VulkanFramebuffer* framebuffer);
 	void CreateSwapChain(int presentWidth, int presentHeight, bool presentFullscreen);
 	void AcquirePresentImage(int presentWidth, int presentHeight, bool presentFullscreen);
-	void DeleteFrameObjects();
+	void BeginFrame();
+	void WaitForAllFrames();
+
+	// For shutting down: deletes what is left in the delete lists while
+	// the managers that created those objects are still around.
+	void DeleteAllFrameObjects();
 	std::unique_ptr<VulkanCommandBuffer> CreateCommandBuffer();
+	std::unique_ptr<VulkanCommandBuffer> CreateTransferCommandBuffer();
+	std::unique_ptr<VulkanCommandBuffer> CreateComputeCommandBuffer();
+
+	// Index of the frame context that's currently being recorded. Anything
+	// the CPU writes & the GPU reads during a frame has to be kept once
+	// per frame context, see UVulkanRenderDevice::LastScene::per_frame.
+	int GetFrameIndex() const { return CurrentFrame; }
+	int GetFramesInFlight() const { return FramesInFlight; }
 
 	struct DeleteList
 	{
+		std::vector<std::unique_ptr<VulkanFramebuffer>> framebuffers;
 		std::vector<std::unique_ptr<VulkanImage>> images;
 		std::vector<std::unique_ptr<VulkanImageView>> imageViews;
 		std::vector<std::unique_ptr<VulkanBuffer>> buffers;
 		std::vector<std::unique_ptr<VulkanDescriptorSet>> descriptors;
+
+		void clear()
+		{
+			framebuffers.clear();
+			images.clear();
+			imageViews.clear();
+			buffers.clear();
+			descriptors.clear();
+		}
 	};
-	std::unique_ptr<DeleteList> FrameDeleteList;
+
+	// Whatever goes in here gets deleted once the GPU is done with the
+	// current frame, i.e. once the frame context comes round again.
+	DeleteList& GetFrameDeleteList() { return Frames[CurrentFrame].Deletes; }
 
 	std::shared_ptr<VulkanSwapChain> SwapChain;
 	int PresentImageIndex = -1;
@@ -32,13 +101,52 @@ public:
 	BITFIELD UsingHdr = 0;
 
 private:
+	void WaitForFrame(int index);
+	void DeleteFrameObjects(int index);
+
 	UVulkanRenderDevice* renderer = nullptr;
 
-	std::unique_ptr<VulkanSemaphore> ImageAvailableSemaphore;
-	std::unique_ptr<VulkanSemaphore> RenderFinishedSemaphore;
+	// Everything a submitted frame needs until the GPU is done with it.
+	// A frame context gets reused only after the graphics timeline has
+	// reached its SubmitValue, so the CPU can record up to FramesInFlight
+	// frames ahead of the GPU. The command buffers are allocated once and
+	// recycled by resetting the whole pool at that point.
+	struct FrameContext
+	{
+		std::unique_ptr<VulkanSemaphore> RenderFinishedSemaphore; // for presenting
+		std::unique_ptr<VulkanCommandPool> CommandPool;
+		std::unique_ptr<VulkanCommandBuffer> DrawCommands;
+		std::unique_ptr<VulkanCommandBuffer> UploadCommands;
+		bool DrawRecording = false;
+		bool UploadRecording = false;
+		DeleteList Deletes;
+		bool Submitted = false;
+		uint64_t SubmitValue = 0;
+
+		// Secondary command buffers recorded on worker threads. Each
+		// thread has its own pool, as pools can't be used concurrently.
+		struct ThreadCommands
+		{
+			std::unique_ptr<VulkanCommandPool> CommandPool;
+			std::vector<std::unique_ptr<VulkanCommandBuffer>> Buffers;
+			size_t Used = 0;
+		};
+		ThreadCommands Threads[MaxRecordingThreads];
+	};
+	FrameContext Frames[MaxFramesInFlight];
+	int FramesInFlight = 2;
+	int CurrentFrame = 0;
+
+	// Flush can submit in between acquiring an image and presenting it, so
+	// these go round separately from the frame contexts. Each acquire ends
+	// with a submit, hence one per frame context is enough.
+	std::unique_ptr<VulkanSemaphore> ImageAvailableSemaphores[MaxFramesInFlight];
+	VulkanSemaphore* ImageAvailableSemaphore = nullptr;
+	int AcquireIndex = 0;
+
 	std::unique_ptr<VulkanSemaphore> TransferSemaphore;
-	std::unique_ptr<VulkanFence> RenderFinishedFence;
 	std::unique_ptr<VulkanCommandPool> CommandPool;
-	std::unique_ptr<VulkanCommandBuffer> DrawCommands;
+	std::unique_ptr<VulkanCommandPool> TransferCommandPool;
+	std::unique_ptr<VulkanCommandPool> ComputeCommandPool;
 	//std::unique_ptr<VulkanCommandBuffer> TransferCommands;
 };
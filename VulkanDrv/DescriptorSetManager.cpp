@@ -8,6 +8,7 @@ DescriptorSetManager::DescriptorSetManager(UVulkanRenderDevice* renderer) : rend
 {
 	debugf(TEXT("CreateBindlessTextureSet"));
 	CreateBindlessTextureSet();
+	CreateTileLayerLayout();
 }
 
 DescriptorSetManager::~DescriptorSetManager()
@@ -16,11 +17,13 @@ DescriptorSetManager::~DescriptorSetManager()
 
 void DescriptorSetManager::CreateBindlessTextureSet()
 {
+	// a new set & a meshlet set per frame in flight
+	int frames = renderer->Commands->GetFramesInFlight();
 	Textures.NewPool = DescriptorPoolBuilder()
-		.AddPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 7 * 2 + 4 * 2)
-		.AddPoolSize(VK_DESCRIPTOR_TYPE_SAMPLER, 1 * 2 + 1 * 2)
-		.AddPoolSize(VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, MaxBindlessTextures * 2 + MaxBindlessTextures * 2)
-		.MaxSets(4)
+		.AddPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, (8 + 9) * frames)
+		.AddPoolSize(VK_DESCRIPTOR_TYPE_SAMPLER, (1 + 1) * frames)
+		.AddPoolSize(VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, (MaxBindlessTextures + MaxBindlessTextures) * frames)
+		.MaxSets(2 * frames)
 		.DebugName("NewPool")
 		.Create(renderer->Device.get());
 
@@ -44,29 +47,68 @@ void DescriptorSetManager::CreateBindlessTextureSet()
 		// textures
 		.AddBinding(8, VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, MaxBindlessTextures, VK_SHADER_STAGE_FRAGMENT_BIT,
 			VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT | VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT)
+		// instance buffer
+		.AddBinding(9, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT)
 		.DebugName("NewLayout")
 		.Create(renderer->Device.get());
 
-	Textures.NewSet[false] = Textures.NewPool->allocate(Textures.NewLayout.get(), MaxBindlessTextures);
-	Textures.NewSet[true] = Textures.NewPool->allocate(Textures.NewLayout.get(), MaxBindlessTextures);
+	for (int i = 0; i < frames; i++)
+		Textures.NewSet[i] = Textures.NewPool->allocate(Textures.NewLayout.get(), MaxBindlessTextures);
 
-	Textures.MeshLayout = DescriptorSetLayoutBuilder()
+	// the task & mesh stages can only be named if the device has them
+	VkShaderStageFlags meshletStages = VK_SHADER_STAGE_VERTEX_BIT;
+	if (renderer->SupportsMeshShaders)
+		meshletStages |= VK_SHADER_STAGE_TASK_BIT_NV | VK_SHADER_STAGE_MESH_BIT_NV;
+
+	DescriptorSetLayoutBuilder meshLayoutBuilder;
+	meshLayoutBuilder
 		// meshlet buffer
-		.AddBinding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT)
+		.AddBinding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, meshletStages)
 		// vertex buffer
-		.AddBinding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT)
+		.AddBinding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, meshletStages)
 		// meshlet vertex index buffer
-		.AddBinding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT)
+		.AddBinding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, meshletStages)
 		// meshlet local index buffer
-		.AddBinding(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT)
+		.AddBinding(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, meshletStages)
 		// sampler
 		.AddBinding(4, VK_DESCRIPTOR_TYPE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT)
 		// textures
 		.AddBinding(5, VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, MaxBindlessTextures, VK_SHADER_STAGE_FRAGMENT_BIT,
 			VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT | VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT)
-		.DebugName("MeshLayout")
+		// meshlet triangle index buffer
+		.AddBinding(6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT)
+		// object buffer
+		.AddBinding(7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, meshletStages)
+		// instance buffer
+		.AddBinding(8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT)
+		.DebugName("MeshLayout");
+	if (renderer->SupportsMeshShaders) {
+		meshLayoutBuilder
+			// meshlet bounds buffer
+			.AddBinding(9, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_TASK_BIT_NV)
+			// task chunk buffer
+			.AddBinding(10, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_TASK_BIT_NV);
+	}
+	Textures.MeshLayout = meshLayoutBuilder.Create(renderer->Device.get());
+
+	for (int i = 0; i < frames; i++)
+		Textures.MeshletSet[i] = Textures.NewPool->allocate(Textures.MeshLayout.get(), MaxBindlessTextures);
+}
+
+void DescriptorSetManager::CreateTileLayerLayout()
+{
+	// The sets of evicted layers only get freed once the GPU is done with
+	// them, hence room for more than TileLayerCache::MaxLayers.
+	int sets = TileLayerCache::MaxLayers * (CommandBufferManager::MaxFramesInFlight + 1);
+	TileLayers.Pool = DescriptorPoolBuilder()
+		.Flags(VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT)
+		.AddPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, sets)
+		.MaxSets(sets)
+		.DebugName("TileLayerPool")
 		.Create(renderer->Device.get());
 
-	Textures.MeshletSet[false] = Textures.NewPool->allocate(Textures.MeshLayout.get(), MaxBindlessTextures);
-	Textures.MeshletSet[true] = Textures.NewPool->allocate(Textures.MeshLayout.get(), MaxBindlessTextures);
+	TileLayers.Layout = DescriptorSetLayoutBuilder()
+		.AddBinding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT)
+		.DebugName("TileLayerLayout")
+		.Create(renderer->Device.get());
 }
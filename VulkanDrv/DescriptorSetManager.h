@@ -1,6 +1,7 @@
 #pragma once
 
 #include "SceneTextures.h"
+#include "CommandBufferManager.h"
 #include <unordered_map>
 
 class UVulkanRenderDevice;
@@ -54,11 +55,17 @@ public:
 
 	VulkanDescriptorSetLayout* GetNewLayout() { return Textures.NewLayout.get(); }
 	VulkanDescriptorSetLayout* GetMeshLayout() { return Textures.MeshLayout.get(); }
-	VulkanDescriptorSet* GetNewSet(bool odd_even) { return Textures.NewSet[odd_even].get(); }
-	VulkanDescriptorSet* GetMeshletSet(bool odd_even) { return Textures.MeshletSet[odd_even].get(); }
+	VulkanDescriptorSet* GetNewSet(int frame) { return Textures.NewSet[frame].get(); }
+	VulkanDescriptorSet* GetMeshletSet(int frame) { return Textures.MeshletSet[frame].get(); }
+
+	// One per cached tile layer, see TileLayerCache. Null if the pool is
+	// out of sets.
+	VulkanDescriptorSetLayout* GetTileLayerLayout() { return TileLayers.Layout.get(); }
+	std::unique_ptr<VulkanDescriptorSet> AllocateTileLayerSet() { return TileLayers.Pool->tryAllocate(TileLayers.Layout.get()); }
 
 private:
 	void CreateBindlessTextureSet();
+	void CreateTileLayerLayout();
 
 	UVulkanRenderDevice* renderer = nullptr;
 
@@ -66,8 +73,14 @@ private:
 	{
 		std::unique_ptr<VulkanDescriptorPool> NewPool;
 		std::unique_ptr<VulkanDescriptorSetLayout> NewLayout;
-		std::unique_ptr<VulkanDescriptorSet> NewSet[2];
+		std::unique_ptr<VulkanDescriptorSet> NewSet[CommandBufferManager::MaxFramesInFlight];
 		std::unique_ptr<VulkanDescriptorSetLayout> MeshLayout;
-		std::unique_ptr<VulkanDescriptorSet> MeshletSet[2];
+		std::unique_ptr<VulkanDescriptorSet> MeshletSet[CommandBufferManager::MaxFramesInFlight];
 	} Textures;
+
+	struct
+	{
+		std::unique_ptr<VulkanDescriptorPool> Pool;
+		std::unique_ptr<VulkanDescriptorSetLayout> Layout;
+	} TileLayers;
 };
@@ -28,9 +28,31 @@ std::string FileResource::readAllText(const std::string& filename)
 				mat4 objectToProjection;
 				vec4 nearClip;
 				uint uHitIndex;
-				uint padding1, padding2, padding3;
+				float tileZ;
+				vec2 lineHalfWidth;
+				vec4 tileTransform;
 			};
 
+			#if defined(THICK_LINE)
+			layout(location = 0) in vec3 aFrom;
+			layout(location = 1) in vec3 aTo;
+			layout(location = 6) in vec4 aColor;
+			#elif defined(TILE_INSTANCE)
+			layout(location = 0) in vec4 aRect;
+			layout(location = 2) in vec4 aTexRect;
+			layout(location = 6) in vec4 aColor;
+			layout(location = 7) in uint aTextureIndex;
+			#elif defined(TILE_VERTEX)
+			layout(location = 1) in vec3 aPosition;
+			layout(location = 2) in vec2 aTexCoord;
+			layout(location = 6) in vec4 aColor;
+			#elif defined(GOURAUD_VERTEX)
+			layout(location = 0) in uint aFlags;
+			layout(location = 1) in vec3 aPosition;
+			layout(location = 2) in vec2 aTexCoord;
+			layout(location = 3) in vec4 aFog;
+			layout(location = 6) in vec4 aColor;
+			#else
 			layout(location = 0) in uint aFlags;
 			layout(location = 1) in vec3 aPosition;
 			layout(location = 2) in vec2 aTexCoord;
@@ -41,6 +63,7 @@ std::string FileResource::readAllText(const std::string& filename)
 			#if defined(BINDLESS_TEXTURES)
 			layout(location = 7) in ivec4 aTextureBinds;
 			#endif
+			#endif
 
 			layout(location = 0) flat out uint flags;
 			layout(location = 1) out vec2 texCoord;
@@ -53,20 +76,91 @@ std::string FileResource::readAllText(const std::string& filename)
 			layout(location = 7) flat out ivec4 textureBinds;
 			#endif
 
+			#if defined(TILE_INSTANCE) || defined(THICK_LINE)
+			// the two triangles of the tile, in the corner order DrawTile used to have
+			const vec2 tileCorners[6] = vec2[](vec2(0.0, 0.0), vec2(1.0, 0.0), vec2(1.0, 1.0), vec2(0.0, 0.0), vec2(1.0, 1.0), vec2(0.0, 1.0));
+			#endif
+
+			#if defined(THICK_LINE)
+			// Lines get widened on screen, so an end behind the camera would
+			// flip the direction. Such an end is moved along the line to where
+			// it's just in front instead.
+			const float lineMinW = 0.001;
+			#endif
+
 			void main()
 			{
-				gl_Position = objectToProjection * vec4(aPosition, 1.0);
-				gl_ClipDistance[0] = dot(nearClip, vec4(aPosition, 1.0));
+				#if defined(TILE_INSTANCE)
+				vec2 corner = tileCorners[gl_VertexIndex];
+				vec2 screenPos = mix(aRect.xy, aRect.zw, corner);
+				vec3 position = vec3(tileTransform.xy * tileZ * (screenPos - tileTransform.zw), tileZ);
+				vec2 uv = mix(aTexRect.xy, aTexRect.zw, corner);
+				#elif defined(THICK_LINE)
+				// corner.x goes along the line, corner.y across it
+				vec2 corner = tileCorners[gl_VertexIndex];
+				float fromW = (objectToProjection * vec4(aFrom, 1.0)).w;
+				float toW = (objectToProjection * vec4(aTo, 1.0)).w;
+				bool behind = fromW < lineMinW && toW < lineMinW;
+				float t0 = !behind && fromW < lineMinW ? (lineMinW - fromW) / (toW - fromW) : 0.0;
+				float t1 = !behind && toW < lineMinW ? (lineMinW - fromW) / (toW - fromW) : 1.0;
+				vec4 clipFrom = objectToProjection * vec4(mix(aFrom, aTo, t0), 1.0);
+				vec4 clipTo = objectToProjection * vec4(mix(aFrom, aTo, t1), 1.0);
+
+				// in units of the half width, which makes it square pixels again
+				vec2 dir = (clipTo.xy / clipTo.w - clipFrom.xy / clipFrom.w) / lineHalfWidth;
+				vec2 normal = dot(dir, dir) > 0.0 ? normalize(vec2(-dir.y, dir.x)) : vec2(0.0, 1.0);
+				vec2 clipOffset = normal * lineHalfWidth * (corner.y * 2.0 - 1.0);
+				if (behind)
+					clipOffset = vec2(0.0);
+
+				vec3 position = mix(aFrom, aTo, mix(t0, t1, corner.x));
+				vec2 uv = vec2(0.0);
+				#else
+				vec3 position = aPosition;
+				vec2 uv = aTexCoord;
+				#endif
+
+				gl_Position = objectToProjection * vec4(position, 1.0);
+				#if defined(THICK_LINE)
+				gl_Position.xy += clipOffset * gl_Position.w;
+				#endif
+				gl_ClipDistance[0] = dot(nearClip, vec4(position, 1.0));
+				hitIndex = uHitIndex;
+				color = aColor;
+				texCoord = uv;
+				#if defined(TILE_INSTANCE)
+				flags = 0u;
+				texCoord2 = vec2(0.0);
+				texCoord3 = vec2(0.0);
+				texCoord4 = vec2(0.0);
+				#if defined(BINDLESS_TEXTURES)
+				textureBinds = ivec4(int(aTextureIndex), 0, 0, 0);
+				#endif
+				#elif defined(TILE_VERTEX) || defined(THICK_LINE)
+				flags = 0u;
+				texCoord2 = vec2(0.0);
+				texCoord3 = vec2(0.0);
+				texCoord4 = vec2(0.0);
+				#if defined(BINDLESS_TEXTURES)
+				textureBinds = ivec4(1);
+				#endif
+				#elif defined(GOURAUD_VERTEX)
+				flags = aFlags;
+				texCoord2 = aFog.xy;
+				texCoord3 = aFog.zw;
+				texCoord4 = vec2(0.0);
+				#if defined(BINDLESS_TEXTURES)
+				textureBinds = ivec4(0);
+				#endif
+				#else
 				flags = aFlags;
-				texCoord = aTexCoord;
 				texCoord2 = aTexCoord2;
 				texCoord3 = aTexCoord3;
 				texCoord4 = aTexCoord4;
-				color = aColor;
-				hitIndex = uHitIndex;
 				#if defined(BINDLESS_TEXTURES)
 				textureBinds = aTextureBinds;
 				#endif
+				#endif
 			}
 		)";
 	}
@@ -96,6 +190,12 @@ std::string FileResource::readAllText(const std::string& filename)
 			layout(location = 0) out vec4 outColor;
 			//layout(location = 1) out uint outHitIndex;
 
+			// Pipelines for draws where all vertices have the same flags get
+			// them as a constant, which leaves only the branches they take.
+			// The uber variant goes by the flags of each fragment instead.
+			layout(constant_id = 0) const bool uberShader = true;
+			layout(constant_id = 1) const uint specializedFlags = 0u;
+
 			vec4 darkClamp(vec4 c)
 			{
 				// Make all textures a little darker as some of the textures (i.e coronas) never become completely black as they should have
@@ -121,34 +221,36 @@ std::string FileResource::readAllText(const std::string& filename)
 
 			void main()
 			{
-				float actorXBlending = (flags & 32) != 0 ? 1.5 : 1.0;
-				float oneXBlending = (flags & 64) != 0 ? 1.0 : 2.0;
+				uint materialFlags = uberShader ? flags : specializedFlags;
+
+				float actorXBlending = (materialFlags & 32) != 0 ? 1.5 : 1.0;
+				float oneXBlending = (materialFlags & 64) != 0 ? 1.0 : 2.0;
 
 				outColor = darkClamp(textureTex(texCoord)) * color * actorXBlending;
 
-				if ((flags & 2) != 0) // Macro texture
+				if ((materialFlags & 2) != 0) // Macro texture
 				{
 					outColor *= darkClamp(textureMacro(texCoord3));
 				}
 
-				if ((flags & 1) != 0) // Lightmap
+				if ((materialFlags & 1) != 0) // Lightmap
 				{
 					outColor.rgb *= clamp(textureLightmap(texCoord2).rgb, 0.0, 1.0) * oneXBlending * 1.8;
 				}
 
-				if ((flags & 4) != 0) // Detail texture
+				if ((materialFlags & 4) != 0) // Detail texture
 				{
 					float fadedistance = 380.0f;
 					float a = clamp(2.0f - (1.0f / gl_FragCoord.w) / fadedistance, 0.0f, 1.0f);
 					vec4 detailColor = (textureDetail(texCoord4) - 0.5) * 0.8 + 1.0;
 					outColor.rgb = mix(outColor.rgb, outColor.rgb * detailColor.rgb, a);
 				}
-				else if ((flags & 8) != 0) // Fog map
+				else if ((materialFlags & 8) != 0) // Fog map
 				{
 					vec4 fogcolor = textureDetail(texCoord4);
 					outColor.rgb = fogcolor.rgb + outColor.rgb * (1.0 - fogcolor.a);
 				}
-				else if ((flags & 16) != 0) // Fog color
+				else if ((materialFlags & 16) != 0) // Fog color
 				{
 					vec4 fogcolor = vec4(texCoord2, texCoord3);
 					outColor.rgb = fogcolor.rgb + outColor.rgb * (1.0 - fogcolor.a);
@@ -159,7 +261,7 @@ std::string FileResource::readAllText(const std::string& filename)
 				#endif
 
 				// Clamp if it isn't a lightmap texture (we want lightmap textures to go overbright so the HDR mode can pick it up)
-				if ((flags & 1) == 0)
+				if ((materialFlags & 1) == 0)
 					outColor = clamp(outColor, 0.0, 1.0);
 
 				// reinhard tone mapping
@@ -9,6 +9,10 @@ FramebufferManager::FramebufferManager(UVulkanRenderDevice* renderer) : renderer
 
 void FramebufferManager::CreateSwapChainFramebuffers()
 {
+	// their framebuffers & pipelines go with the render passes
+	if (renderer->TileLayers)
+		renderer->TileLayers->Clear();
+
 	renderer->RenderPasses->CreateRenderPass();
 	renderer->RenderPasses->CreatePipelines();
 
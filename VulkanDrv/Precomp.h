@@ -24,6 +24,7 @@
 #include <map>
 #include <unordered_map>
 #include <optional>
+#include <limits>
 #pragma pack(pop)
 
 #define UTGLR_NO_APP_MALLOC
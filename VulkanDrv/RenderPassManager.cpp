@@ -2,14 +2,99 @@
 #include "Precomp.h"
 #include "RenderPassManager.h"
 #include "UVulkanRenderDevice.h"
+#include "UTF16.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 
 RenderPassManager::RenderPassManager(UVulkanRenderDevice* renderer) : renderer(renderer)
 {
 	CreateSceneBindlessPipelineLayout();
+	CreatePipelineCache();
+	LoadPipelineStateLog();
 }
 
 RenderPassManager::~RenderPassManager()
 {
+	StopPrewarm();
+	SavePipelineCache();
+}
+
+// One file per device, driver & driver version, in the current directory
+// (System). The driver checks the data too, but not every driver does it
+// well, so a file of another driver never even gets loaded.
+std::string RenderPassManager::GetPipelineCacheFilename() const
+{
+	const auto& props = renderer->Device->PhysicalDevice.Properties.Properties;
+
+	static const char* hexdigits = "0123456789abcdef";
+	std::string uuid;
+	for (int i = 0; i < VK_UUID_SIZE; i++)
+	{
+		uuid.push_back(hexdigits[props.pipelineCacheUUID[i] >> 4]);
+		uuid.push_back(hexdigits[props.pipelineCacheUUID[i] & 15]);
+	}
+
+	char driverVersion[16];
+	snprintf(driverVersion, sizeof(driverVersion), "%08x", props.driverVersion);
+	return "VkPipelineCache-" + uuid + "-" + driverVersion + ".bin";
+}
+
+void RenderPassManager::CreatePipelineCache()
+{
+	std::string filename = GetPipelineCacheFilename();
+	std::vector<uint8_t> data;
+
+	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	if (file)
+	{
+		data.resize((size_t)file.tellg());
+		file.seekg(0);
+		if (!file.read((char*)data.data(), data.size()))
+			data.clear();
+	}
+
+	PipelineCacheBuilder builder;
+	if (!data.empty())
+		builder.InitialData(data.data(), data.size());
+	PipelineCache = builder.DebugName("PipelineCache").Create(renderer->Device.get());
+
+	PipelineCacheWarm = !data.empty();
+	debugf(TEXT("Vulkan: Pipeline cache %s: %d KB"), to_utf16(filename).c_str(), (int)(data.size() / 1024));
+}
+
+void RenderPassManager::SavePipelineCache()
+{
+	SavePipelineStateLog();
+
+	if (!PipelineCache)
+		return;
+
+	try
+	{
+		std::vector<uint8_t> data = PipelineCache->GetCacheData();
+		if (data.empty())
+			return;
+
+		// written next to it first, so that a crash can't leave half a cache behind
+		std::string filename = GetPipelineCacheFilename();
+		std::string tempFilename = filename + ".tmp";
+		{
+			std::ofstream file(tempFilename, std::ios::binary | std::ios::trunc);
+			if (!file.write((const char*)data.data(), data.size()))
+			{
+				debugf(TEXT("Vulkan: Could not write %s"), to_utf16(tempFilename).c_str());
+				return;
+			}
+		}
+		std::remove(filename.c_str());
+		if (std::rename(tempFilename.c_str(), filename.c_str()) != 0)
+			debugf(TEXT("Vulkan: Could not rename %s"), to_utf16(tempFilename).c_str());
+	}
+	catch (const std::exception& e)
+	{
+		debugf(TEXT("Vulkan: Could not save the pipeline cache: %s"), to_utf16(e.what()).c_str());
+	}
 }
 
 void RenderPassManager::CreateSceneBindlessPipelineLayout()
@@ -20,6 +105,12 @@ void RenderPassManager::CreateSceneBindlessPipelineLayout()
 		.DebugName("SceneBindlessPipelineLayout")
 		.Create(renderer->Device.get());
 
+	Scene.TileLayerPipelineLayout = PipelineLayoutBuilder()
+		.AddSetLayout(renderer->DescriptorSets->GetTileLayerLayout())
+		.AddPushConstantRange(VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(TileLayerPushConstants))
+		.DebugName("TileLayerPipelineLayout")
+		.Create(renderer->Device.get());
+
 	Scene.NewPipelineLayout = PipelineLayoutBuilder()
 		.AddSetLayout(renderer->DescriptorSets->GetNewLayout())
 		.AddPushConstantRange(VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(NewScenePushConstants))
@@ -31,6 +122,15 @@ void RenderPassManager::CreateSceneBindlessPipelineLayout()
 		.AddPushConstantRange(VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(NewScenePushConstants))
 		.DebugName("MeshPipelineLayout")
 		.Create(renderer->Device.get());
+
+	if (renderer->SupportsMeshShaders)
+	{
+		Scene.MeshShaderPipelineLayout = PipelineLayoutBuilder()
+			.AddSetLayout(renderer->DescriptorSets->GetMeshLayout())
+			.AddPushConstantRange(VK_SHADER_STAGE_TASK_BIT_NV | VK_SHADER_STAGE_MESH_BIT_NV, 0, sizeof(NewScenePushConstants))
+			.DebugName("MeshShaderPipelineLayout")
+			.Create(renderer->Device.get());
+	}
 }
 
 void RenderPassManager::BeginScene(VulkanCommandBuffer* cmdbuffer, float r, float g, float b, float a)
@@ -45,12 +145,21 @@ void RenderPassManager::BeginScene(VulkanCommandBuffer* cmdbuffer, float r, floa
 		.Execute(cmdbuffer);
 }
 
+void RenderPassManager::ResumeScene(VulkanCommandBuffer* cmdbuffer, VkSubpassContents contents)
+{
+	RenderPassBegin()
+		.RenderPass(Scene.ResumeRenderPass.get())
+		.Framebuffer(renderer->Framebuffers->GetSwapChainFramebuffer())
+		.RenderArea(0, 0, renderer->Textures->Scene->Width, renderer->Textures->Scene->Height)
+		.Execute(cmdbuffer, contents);
+}
+
 void RenderPassManager::EndScene(VulkanCommandBuffer* cmdbuffer)
 {
 	cmdbuffer->endRenderPass();
 }
 
-VulkanPipeline* RenderPassManager::GetPipeline(DWORD PolyFlags)
+uint32_t RenderPassManager::GetPipelineKey(DWORD PolyFlags, SceneVertexFormat format, uint32_t materialFlags)
 {
 	// Adjust PolyFlags according to Unreal's precedence rules.
 	if (!(PolyFlags & (PF_Translucent | PF_Modulated)))
@@ -89,219 +198,636 @@ VulkanPipeline* RenderPassManager::GetPipeline(DWORD PolyFlags)
 		index |= 16;
 	}
 
-	return Scene.Pipeline[index].get();
+	if (!renderer->VkSpecializedShaders)
+		materialFlags = AnyMaterialFlags;
+
+	return GetScenePipelineKey(index, format, materialFlags);
+}
+
+VulkanPipeline* RenderPassManager::GetTileLayerPipeline(VulkanPipeline* tilePipeline)
+{
+	std::unique_lock<std::mutex> lock(ScenePipelineMutex);
+	auto it = ScenePipelineKeys.find(tilePipeline);
+	if (it == ScenePipelineKeys.end() || GetScenePipelineFormat(it->second) != SceneVertexTileInstance)
+		return nullptr;
+	return Scene.TileLayerPipeline[it->second & 31].get();
+}
+
+uint32_t RenderPassManager::GetEndFlashPipelineKey()
+{
+	return GetScenePipelineKey(2, SceneVertexFull, renderer->VkSpecializedShaders ? 0 : AnyMaterialFlags);
+}
+
+VulkanPipeline* RenderPassManager::GetScenePipeline(uint32_t key, bool used)
+{
+	// Held until the pipeline is in the map, so that CreateRenderPass can
+	// wait for compiles that use the old render pass.
+	std::shared_lock<std::shared_mutex> compileLock(ScenePipelineCompileMutex);
+
+	ScenePipelineTarget target;
+	{
+		std::unique_lock<std::mutex> lock(ScenePipelineMutex);
+		if (used)
+			UsedScenePipelineKeys.insert(key);
+		auto it = ScenePipelines.find(key);
+		if (it != ScenePipelines.end())
+			return it->second.get();
+		target = Target;
+	}
+	if (!target.RenderPass)
+		return nullptr;
+
+	// Compiled without holding the lock, so that lookups of the pipelines
+	// that are there already don't have to wait for it.
+	std::unique_ptr<VulkanPipeline> pipeline;
+	std::string error;
+	try
+	{
+		pipeline = CreateScenePipeline(key, target);
+	}
+	catch (const std::exception& e)
+	{
+		// the pre-warm thread can't log, so it leaves it to the first use
+		if (!used)
+			return nullptr;
+		error = e.what();
+	}
+	catch (...)
+	{
+		if (!used)
+			return nullptr;
+		error = "unknown error";
+	}
+
+	std::unique_lock<std::mutex> lock(ScenePipelineMutex);
+	if (target.Generation != Target.Generation)
+	{
+		// made for a render pass that is gone by now
+		lock.unlock();
+		compileLock.unlock();
+		pipeline.reset();
+		return GetScenePipeline(key, used);
+	}
+
+	// The pre-warm thread and a first use may both have created it, in
+	// which case the second one is dropped again. A failed one stays null,
+	// so that it isn't tried again on every draw.
+	auto result = ScenePipelines.emplace(key, std::move(pipeline));
+	if (!result.second)
+		return result.first->second.get();
+	if (result.first->second)
+		ScenePipelineKeys[result.first->second.get()] = key;
+	else
+		debugf(TEXT("Vulkan: Could not create scene pipeline %08x (PolyFlags index %d, vertex format %d, material flags %02x): %s"), key, (int)(key & 31), (int)GetScenePipelineFormat(key), key >> 16, to_utf16(error).c_str());
+	return result.first->second.get();
+}
+
+VulkanPipeline* RenderPassManager::GetScenePipeline(uint32_t key)
+{
+	// A specialized variant that didn't compile falls back to the uber one.
+	// If that doesn't exist either, the draws using it get skipped.
+	VulkanPipeline* pipeline = GetScenePipeline(key, true);
+	if (!pipeline && (key >> 16) != AnyMaterialFlags)
+		pipeline = GetScenePipeline((key & 0xffff) | (AnyMaterialFlags << 16), true);
+	return pipeline;
+}
+
+static void AddSceneVertexLayout(GraphicsPipelineBuilder& builder, SceneVertexFormat format, bool textureBinds)
+{
+	switch (format)
+	{
+	case SceneVertexFull:
+		builder.AddVertexBufferBinding(0, sizeof(SceneVertex));
+		builder.AddVertexAttribute(0, 0, VK_FORMAT_R32_UINT, offsetof(SceneVertex, Flags));
+		builder.AddVertexAttribute(1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(SceneVertex, Position));
+		builder.AddVertexAttribute(2, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord));
+		builder.AddVertexAttribute(3, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord2));
+		builder.AddVertexAttribute(4, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord3));
+		builder.AddVertexAttribute(5, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord4));
+		builder.AddVertexAttribute(6, 0, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(SceneVertex, Color));
+		if (textureBinds)
+			builder.AddVertexAttribute(7, 0, VK_FORMAT_R32G32B32A32_SINT, offsetof(SceneVertex, TextureBinds));
+		break;
+	case SceneVertexGouraud:
+		builder.AddVertexBufferBinding(0, sizeof(SceneGouraudVertex));
+		builder.AddVertexAttribute(0, 0, VK_FORMAT_R32_UINT, offsetof(SceneGouraudVertex, Flags));
+		builder.AddVertexAttribute(1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(SceneGouraudVertex, Position));
+		builder.AddVertexAttribute(2, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneGouraudVertex, TexCoord));
+		builder.AddVertexAttribute(3, 0, VK_FORMAT_R8G8B8A8_UNORM, offsetof(SceneGouraudVertex, Fog));
+		builder.AddVertexAttribute(6, 0, VK_FORMAT_R8G8B8A8_UNORM, offsetof(SceneGouraudVertex, Color));
+		break;
+	case SceneVertexTile:
+		builder.AddVertexBufferBinding(0, sizeof(SceneTileVertex));
+		builder.AddVertexAttribute(1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(SceneTileVertex, Position));
+		builder.AddVertexAttribute(2, 0, VK_FORMAT_R16G16_SFLOAT, offsetof(SceneTileVertex, TexCoord));
+		builder.AddVertexAttribute(6, 0, VK_FORMAT_R8G8B8A8_UNORM, offsetof(SceneTileVertex, Color));
+		break;
+	case SceneVertexTileInstance:
+		builder.AddVertexBufferBinding(0, sizeof(SceneTileInstance), VK_VERTEX_INPUT_RATE_INSTANCE);
+		builder.AddVertexAttribute(0, 0, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(SceneTileInstance, Rect));
+		builder.AddVertexAttribute(2, 0, VK_FORMAT_R16G16B16A16_SFLOAT, offsetof(SceneTileInstance, TexCoords));
+		builder.AddVertexAttribute(6, 0, VK_FORMAT_R8G8B8A8_UNORM, offsetof(SceneTileInstance, Color));
+		builder.AddVertexAttribute(7, 0, VK_FORMAT_R32_UINT, offsetof(SceneTileInstance, TextureIndex));
+		break;
+	case SceneVertexLineInstance:
+		builder.AddVertexBufferBinding(0, sizeof(SceneLineInstance), VK_VERTEX_INPUT_RATE_INSTANCE);
+		builder.AddVertexAttribute(0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(SceneLineInstance, From));
+		builder.AddVertexAttribute(1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(SceneLineInstance, To));
+		builder.AddVertexAttribute(6, 0, VK_FORMAT_R8G8B8A8_UNORM, offsetof(SceneLineInstance, Color));
+		break;
+	}
 }
 
-VulkanPipeline* RenderPassManager::GetEndFlashPipeline()
+// Only reads what CreatePipelines put into the target and what lives as
+// long as this does, as it also runs on the pre-warm thread.
+std::unique_ptr<VulkanPipeline> RenderPassManager::CreateScenePipeline(uint32_t key, const ScenePipelineTarget& target)
 {
-	return Scene.Pipeline[2].get();
+	SceneVertexFormat format = GetScenePipelineFormat(key);
+	int i = key & 31;
+	uint32_t materialFlags = key >> 16;
+
+	GraphicsPipelineBuilder builder;
+	builder.Cache(PipelineCache.get());
+	builder.AddVertexShader(renderer->Shaders->SceneBindless.VertexShader[format].get());
+	builder.Viewport(0.0f, 0.0f, (float)target.Width, (float)target.Height);
+	builder.Scissor(0, 0, target.Width, target.Height);
+	builder.Topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+	builder.Cull(VK_CULL_MODE_NONE, VK_FRONT_FACE_CLOCKWISE);
+	AddSceneVertexLayout(builder, format, true);
+	builder.AddDynamicState(VK_DYNAMIC_STATE_VIEWPORT);
+	builder.Layout(Scene.BindlessPipelineLayout.get());
+	builder.RenderPass(target.RenderPass);
+
+	// Avoid clipping the weapon. The UE1 engine clips the geometry anyway.
+	if (renderer->Device.get()->EnabledFeatures.Features.depthClamp)
+		builder.DepthClampEnable(true);
+
+	ColorBlendAttachmentBuilder colorblend;
+	switch (i & 3)
+	{
+	case 0: // PF_Translucent
+		colorblend.BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE_MINUS_SRC_COLOR);
+		builder.DepthBias(true, -1.0f, 0.0f, -1.0f);
+		break;
+	case 1: // PF_Modulated
+		colorblend.BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_DST_COLOR, VK_BLEND_FACTOR_SRC_COLOR);
+		builder.DepthBias(true, -1.0f, 0.0f, -1.0f);
+		break;
+	case 2: // PF_Highlighted
+		colorblend.BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA);
+		builder.DepthBias(true, -1.0f, 0.0f, -1.0f);
+		break;
+	case 3:
+		colorblend.BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ZERO); // Hmm, is it faster to keep the blend mode enabled or to toggle it?
+		break;
+	}
+
+	if (i & 4) // PF_Invisible
+	{
+		colorblend.ColorWriteMask(0);
+	}
+
+	if (i & 8) // PF_Occlude
+	{
+		builder.DepthStencilEnable(true, true, false);
+	}
+	else
+	{
+		builder.DepthStencilEnable(true, false, false);
+	}
+
+	if (i & 16) // PF_Masked
+		builder.AddFragmentShader(renderer->Shaders->SceneBindless.FragmentShaderAlphaTest.get());
+	else
+		builder.AddFragmentShader(renderer->Shaders->SceneBindless.FragmentShader.get());
+
+	// see uberShader & specializedFlags in Scene.frag
+	if (materialFlags != AnyMaterialFlags)
+	{
+		builder.AddSpecializationConstant(0, VK_FALSE);
+		builder.AddSpecializationConstant(1, materialFlags);
+	}
+
+	builder.AddColorBlendAttachment(colorblend.Create());
+	//builder.AddColorBlendAttachment(ColorBlendAttachmentBuilder().Create());
+
+	builder.RasterizationSamples(target.Samples);
+	builder.DebugName("SceneBindlessPipeline");
+
+	return builder.Create(renderer->Device.get());
 }
 
 void RenderPassManager::CreatePipelines()
 {
-	VulkanShader* vertShader = renderer->Shaders->SceneBindless.VertexShader.get();
+	auto startTime = std::chrono::steady_clock::now();
+
+	// The scene pipelines get created again as they get used, or by the
+	// pre-warm thread started at the end.
+	StopPrewarm();
+	{
+		std::unique_lock<std::mutex> lock(ScenePipelineMutex);
+		ScenePipelines.clear();
+		ScenePipelineKeys.clear();
+		Target.RenderPass = Scene.RenderPass.get();
+		Target.Width = renderer->Textures->Scene->Width;
+		Target.Height = renderer->Textures->Scene->Height;
+		Target.Samples = renderer->Textures->Scene->SceneSamples;
+		Target.Generation++;
+	}
+
+	// Each job creates one pipeline and stores it in a slot of its own, so
+	// they can run in any order and on any thread. The pipeline cache is
+	// internally synchronized, so they all share it.
+	std::vector<PipelineJob> jobs;
+
 	VulkanShader* fragShader = renderer->Shaders->SceneBindless.FragmentShader.get();
-	VulkanShader* fragShaderAlphaTest = renderer->Shaders->SceneBindless.FragmentShaderAlphaTest.get();
 	VulkanPipelineLayout* layout = Scene.BindlessPipelineLayout.get();
 
 	for (int type = 1; type < 2; type++)
 	{
-		for (int i = 0; i < 32; i++)
+		// Line pipeline
+		for (int i = 0; i < 2; i++)
+		{
+			jobs.push_back({ L"Oopsie - line pipeline", [=]() {
+				GraphicsPipelineBuilder builder;
+				builder.Cache(PipelineCache.get());
+				builder.AddVertexShader(renderer->Shaders->SceneBindless.VertexShader[SceneVertexTile].get());
+				builder.Viewport(0.0f, 0.0f, (float)renderer->Textures->Scene->Width, (float)renderer->Textures->Scene->Height);
+				builder.Scissor(0, 0, renderer->Textures->Scene->Width, renderer->Textures->Scene->Height);
+				builder.Topology(VK_PRIMITIVE_TOPOLOGY_LINE_LIST);
+				builder.Cull(VK_CULL_MODE_NONE, VK_FRONT_FACE_CLOCKWISE);
+				AddSceneVertexLayout(builder, SceneVertexTile, type == 1);
+				builder.AddDynamicState(VK_DYNAMIC_STATE_VIEWPORT);
+				builder.Layout(layout);
+				builder.RenderPass(Scene.RenderPass.get());
+
+				builder.AddColorBlendAttachment(ColorBlendAttachmentBuilder().BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA).Create());
+				//builder.AddColorBlendAttachment(ColorBlendAttachmentBuilder().Create());
+
+				builder.DepthStencilEnable(i == 1, false, false);
+				builder.AddFragmentShader(fragShader);
+
+				builder.RasterizationSamples(renderer->Textures->Scene->SceneSamples);
+				builder.DebugName("LinePipeline");
+
+				Scene.LinePipeline[i] = builder.Create(renderer->Device.get());
+			} });
+		}
+
+		// Thick line pipeline, same as the line one but with quads
+		for (int i = 0; i < 2; i++)
 		{
+			jobs.push_back({ L"Oopsie - thick line pipeline", [=]() {
+				GraphicsPipelineBuilder builder;
+				builder.Cache(PipelineCache.get());
+				builder.AddVertexShader(renderer->Shaders->SceneBindless.VertexShader[SceneVertexLineInstance].get());
+				builder.Viewport(0.0f, 0.0f, (float)renderer->Textures->Scene->Width, (float)renderer->Textures->Scene->Height);
+				builder.Scissor(0, 0, renderer->Textures->Scene->Width, renderer->Textures->Scene->Height);
+				builder.Topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+				builder.Cull(VK_CULL_MODE_NONE, VK_FRONT_FACE_CLOCKWISE);
+				AddSceneVertexLayout(builder, SceneVertexLineInstance, type == 1);
+				builder.AddDynamicState(VK_DYNAMIC_STATE_VIEWPORT);
+				builder.Layout(layout);
+				builder.RenderPass(Scene.RenderPass.get());
+
+				builder.AddColorBlendAttachment(ColorBlendAttachmentBuilder().BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA).Create());
+
+				builder.DepthStencilEnable(i == 1, false, false);
+				builder.AddFragmentShader(fragShader);
+
+				builder.RasterizationSamples(renderer->Textures->Scene->SceneSamples);
+				builder.DebugName("ThickLinePipeline");
+
+				Scene.ThickLinePipeline[i] = builder.Create(renderer->Device.get());
+			} });
+		}
+
+		// Point pipeline
+		for (int i = 0; i < 2; i++)
+		{
+			jobs.push_back({ L"Oopsie - point pipeline", [=]() {
+				GraphicsPipelineBuilder builder;
+				builder.Cache(PipelineCache.get());
+				builder.AddVertexShader(renderer->Shaders->SceneBindless.VertexShader[SceneVertexTile].get());
+				builder.AddFragmentShader(fragShader);
+				builder.Viewport(0.0f, 0.0f, (float)renderer->Textures->Scene->Width, (float)renderer->Textures->Scene->Height);
+				builder.Scissor(0, 0, renderer->Textures->Scene->Width, renderer->Textures->Scene->Height);
+				builder.Topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+				builder.Cull(VK_CULL_MODE_NONE, VK_FRONT_FACE_CLOCKWISE);
+				AddSceneVertexLayout(builder, SceneVertexTile, type == 1);
+				builder.AddDynamicState(VK_DYNAMIC_STATE_VIEWPORT);
+				builder.Layout(layout);
+				builder.RenderPass(Scene.RenderPass.get());
+
+				builder.AddColorBlendAttachment(ColorBlendAttachmentBuilder().BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA).Create());
+				//builder.AddColorBlendAttachment(ColorBlendAttachmentBuilder().Create());
+
+				builder.DepthStencilEnable(false, false, false);
+				builder.RasterizationSamples(renderer->Textures->Scene->SceneSamples);
+				builder.DebugName("PointPipeline");
+
+				Scene.PointPipeline[i] = builder.Create(renderer->Device.get());
+			} });
+		}
+	}
+
+	AddTileLayerPipelineJobs(jobs);
+
+	for (int i = 0; i < DrawBucketCount; i++)
+	{
+		jobs.push_back({ L"Oopsie - new scene pipeline", [=]() {
 			GraphicsPipelineBuilder builder;
-			builder.AddVertexShader(vertShader);
+			builder.Cache(PipelineCache.get());
+			builder.AddVertexShader(renderer->Shaders->NewScene.VertexShader.get());
 			builder.Viewport(0.0f, 0.0f, (float)renderer->Textures->Scene->Width, (float)renderer->Textures->Scene->Height);
 			builder.Scissor(0, 0, renderer->Textures->Scene->Width, renderer->Textures->Scene->Height);
 			builder.Topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
 			builder.Cull(VK_CULL_MODE_NONE, VK_FRONT_FACE_CLOCKWISE);
-			builder.AddVertexBufferBinding(0, sizeof(SceneVertex));
-			builder.AddVertexAttribute(0, 0, VK_FORMAT_R32_UINT, offsetof(SceneVertex, Flags));
-			builder.AddVertexAttribute(1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(SceneVertex, Position));
-			builder.AddVertexAttribute(2, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord));
-			builder.AddVertexAttribute(3, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord2));
-			builder.AddVertexAttribute(4, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord3));
-			builder.AddVertexAttribute(5, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord4));
-			builder.AddVertexAttribute(6, 0, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(SceneVertex, Color));
-			if (type == 1)
-				builder.AddVertexAttribute(7, 0, VK_FORMAT_R32G32B32A32_SINT, offsetof(SceneVertex, TextureBinds));
 			builder.AddDynamicState(VK_DYNAMIC_STATE_VIEWPORT);
-			builder.Layout(layout);
+			builder.Layout(Scene.NewPipelineLayout.get());
 			builder.RenderPass(Scene.RenderPass.get());
 
-			// Avoid clipping the weapon. The UE1 engine clips the geometry anyway.
-			if (renderer->Device.get()->EnabledFeatures.Features.depthClamp)
-				builder.DepthClampEnable(true);
+			// Only the masked bucket discards, everything else keeps early depth testing.
+			if (i == DrawBucketMasked)
+				builder.AddFragmentShader(renderer->Shaders->NewScene.FragmentShaderAlphaTest.get());
+			else
+				builder.AddFragmentShader(renderer->Shaders->NewScene.FragmentShader.get());
 
 			ColorBlendAttachmentBuilder colorblend;
-			switch (i & 3)
+			switch (i)
 			{
-			case 0: // PF_Translucent
+			case DrawBucketOpaque:
+			case DrawBucketMasked:
+				colorblend.BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ZERO);
+				builder.DepthStencilEnable(true, true, false);
+				break;
+			case DrawBucketTranslucent:
 				colorblend.BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE_MINUS_SRC_COLOR);
-				builder.DepthBias(true, -1.0f, 0.0f, -1.0f);
+				builder.DepthStencilEnable(true, false, false);
 				break;
-			case 1: // PF_Modulated
+			case DrawBucketModulated:
 				colorblend.BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_DST_COLOR, VK_BLEND_FACTOR_SRC_COLOR);
-				builder.DepthBias(true, -1.0f, 0.0f, -1.0f);
-				break;
-			case 2: // PF_Highlighted
-				colorblend.BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA);
-				builder.DepthBias(true, -1.0f, 0.0f, -1.0f);
-				break;
-			case 3:
-				colorblend.BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ZERO); // Hmm, is it faster to keep the blend mode enabled or to toggle it?
+				builder.DepthStencilEnable(true, false, false);
 				break;
 			}
+			builder.AddColorBlendAttachment(colorblend.Create());
+			builder.DebugName("NewScenePipeline");
 
-			if (i & 4) // PF_Invisible
-			{
-				colorblend.ColorWriteMask(0);
-			}
+			Scene.NewPipeline[i] = builder.Create(renderer->Device.get());
+		} });
+	}
 
-			if (i & 8) // PF_Occlude
-			{
-				builder.DepthStencilEnable(true, true, false);
-			}
-			else
-			{
-				builder.DepthStencilEnable(true, false, false);
-			}
+	jobs.push_back({ nullptr, [=]() {
+		Scene.MeshletPipeline = GraphicsPipelineBuilder()
+			.Cache(PipelineCache.get())
+			.AddVertexShader(renderer->Shaders->MeshScene.VertexShader.get())
+			.AddFragmentShader(renderer->Shaders->MeshScene.FragmentShader.get())
+			.Viewport(0.0f, 0.0f, (float)renderer->Textures->Scene->Width, (float)renderer->Textures->Scene->Height)
+			.Scissor(0, 0, renderer->Textures->Scene->Width, renderer->Textures->Scene->Height)
+			.Topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST)
+			.Cull(VK_CULL_MODE_BACK_BIT, VK_FRONT_FACE_COUNTER_CLOCKWISE)
+			.Layout(Scene.MeshletPipelineLayout.get())
+			.RenderPass(Scene.RenderPass.get())
+			.AddColorBlendAttachment(ColorBlendAttachmentBuilder().BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_SRC_ALPHA, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA).Create())
+			.DepthStencilEnable(true, true, false)
+			.Create(renderer->Device.get());
+	} });
+
+	if (renderer->SupportsMeshShaders)
+	{
+		// same state as MeshletPipeline, the input assembly gets ignored
+		jobs.push_back({ nullptr, [=]() {
+			Scene.MeshShaderPipeline = GraphicsPipelineBuilder()
+				.Cache(PipelineCache.get())
+				.AddTaskShader(renderer->Shaders->MeshScene.TaskShader.get())
+				.AddMeshShader(renderer->Shaders->MeshScene.MeshShader.get())
+				.AddFragmentShader(renderer->Shaders->MeshScene.FragmentShader.get())
+				.Viewport(0.0f, 0.0f, (float)renderer->Textures->Scene->Width, (float)renderer->Textures->Scene->Height)
+				.Scissor(0, 0, renderer->Textures->Scene->Width, renderer->Textures->Scene->Height)
+				.Cull(VK_CULL_MODE_BACK_BIT, VK_FRONT_FACE_COUNTER_CLOCKWISE)
+				.Layout(Scene.MeshShaderPipelineLayout.get())
+				.RenderPass(Scene.RenderPass.get())
+				.AddColorBlendAttachment(ColorBlendAttachmentBuilder().BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_SRC_ALPHA, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA).Create())
+				.DepthStencilEnable(true, true, false)
+				.DebugName("MeshShaderPipeline")
+				.Create(renderer->Device.get());
+		} });
+	}
 
-			if (i & 16) // PF_Masked
-				builder.AddFragmentShader(fragShaderAlphaTest);
-			else
-				builder.AddFragmentShader(fragShader);
+	// The log isn't meant to be written from the workers, so failures only
+	// get noted there. Jobs without a message rethrow on this thread.
+	std::vector<char> failed(jobs.size());
+	auto runJob = [&](int index, int thread) {
+		try {
+			jobs[index].Create();
+		}
+		catch (...) {
+			if (!jobs[index].FailureMessage)
+				throw;
+			failed[index] = 1;
+		}
+	};
 
-			builder.AddColorBlendAttachment(colorblend.Create());
-			//builder.AddColorBlendAttachment(ColorBlendAttachmentBuilder().Create());
+	int numThreads = 1;
+	if (renderer->VkParallelPipelines && renderer->Workers)
+	{
+		numThreads = renderer->Workers->GetNumThreads();
+		renderer->Workers->Run((int)jobs.size(), runJob);
+	}
+	else
+	{
+		for (int i = 0; i < (int)jobs.size(); i++)
+			runJob(i, 0);
+	}
 
-			builder.RasterizationSamples(renderer->Textures->Scene->SceneSamples);
-			builder.DebugName("SceneBindlessPipeline");
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		if (failed[i])
+			debugf(TEXT("%s"), jobs[i].FailureMessage);
+	}
 
-			try {
-				Scene.Pipeline[i] = builder.Create(renderer->Device.get());
-			}
-			catch (...) {
-				debugf(L"Oopsie - scene pipeline");
-			}
-		}
+	// Cold is what every run had before there was a pipeline cache file.
+	// Once they have been created they're in the cache either way. Toggle
+	// VkParallelPipelines to compare against creating them one by one.
+	int ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+	debugf(TEXT("Vulkan: Created %d pipelines in %d ms on %d thread(s) with a %s pipeline cache"), (int)jobs.size(), ms, numThreads, PipelineCacheWarm ? TEXT("warm") : TEXT("cold"));
+	PipelineCacheWarm = true;
 
-		// Line pipeline
-		for (int i = 0; i < 2; i++)
+	StartPrewarm();
+}
+
+// What the last run used, and what this one has used so far if this is a
+// swap chain recreation, as those would otherwise all be created again on
+// first use within the next frame.
+void RenderPassManager::StartPrewarm()
+{
+	std::vector<uint32_t> keys;
+	{
+		std::unique_lock<std::mutex> lock(ScenePipelineMutex);
+		std::set<uint32_t> prewarmKeys = LoggedScenePipelineKeys;
+		prewarmKeys.insert(UsedScenePipelineKeys.begin(), UsedScenePipelineKeys.end());
+		keys.assign(prewarmKeys.begin(), prewarmKeys.end());
+	}
+	if (keys.empty())
+		return;
+
+	debugf(TEXT("Vulkan: Pre-warming %d scene pipelines"), (int)keys.size());
+	StopPrewarmFlag = false;
+	PrewarmThread = std::thread([this, keys]() {
+		for (uint32_t key : keys)
 		{
-			GraphicsPipelineBuilder builder;
-			builder.AddVertexShader(vertShader);
-			builder.Viewport(0.0f, 0.0f, (float)renderer->Textures->Scene->Width, (float)renderer->Textures->Scene->Height);
-			builder.Scissor(0, 0, renderer->Textures->Scene->Width, renderer->Textures->Scene->Height);
-			builder.Topology(VK_PRIMITIVE_TOPOLOGY_LINE_LIST);
-			builder.Cull(VK_CULL_MODE_NONE, VK_FRONT_FACE_CLOCKWISE);
-			builder.AddVertexBufferBinding(0, sizeof(SceneVertex));
-			builder.AddVertexAttribute(0, 0, VK_FORMAT_R32_UINT, offsetof(SceneVertex, Flags));
-			builder.AddVertexAttribute(1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(SceneVertex, Position));
-			builder.AddVertexAttribute(2, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord));
-			builder.AddVertexAttribute(3, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord2));
-			builder.AddVertexAttribute(4, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord3));
-			builder.AddVertexAttribute(5, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord4));
-			builder.AddVertexAttribute(6, 0, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(SceneVertex, Color));
-			if (type == 1)
-				builder.AddVertexAttribute(7, 0, VK_FORMAT_R32G32B32A32_SINT, offsetof(SceneVertex, TextureBinds));
-			builder.AddDynamicState(VK_DYNAMIC_STATE_VIEWPORT);
-			builder.Layout(layout);
-			builder.RenderPass(Scene.RenderPass.get());
+			if (StopPrewarmFlag)
+				break;
+			GetScenePipeline(key, false);
+		}
+	});
+}
 
-			builder.AddColorBlendAttachment(ColorBlendAttachmentBuilder().BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA).Create());
-			//builder.AddColorBlendAttachment(ColorBlendAttachmentBuilder().Create());
+void RenderPassManager::StopPrewarm()
+{
+	if (PrewarmThread.joinable())
+	{
+		StopPrewarmFlag = true;
+		PrewarmThread.join();
+	}
+}
 
-			builder.DepthStencilEnable(i == 1, false, false);
-			builder.AddFragmentShader(fragShader);
+static const char* PipelineStateLogFilename = "VkPipelineStates.bin";
+static const uint32_t PipelineStateLogVersion = 2;
 
-			builder.RasterizationSamples(renderer->Textures->Scene->SceneSamples);
-			builder.DebugName("LinePipeline");
+void RenderPassManager::LoadPipelineStateLog()
+{
+	std::ifstream file(PipelineStateLogFilename, std::ios::binary);
+	if (!file)
+		return;
+
+	char magic[4] = {};
+	uint32_t version = 0, count = 0;
+	file.read(magic, 4);
+	file.read((char*)&version, sizeof(uint32_t));
+	file.read((char*)&count, sizeof(uint32_t));
+	if (!file || memcmp(magic, "VKPS", 4) != 0 || version != PipelineStateLogVersion)
+		return;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t key = 0;
+		if (!file.read((char*)&key, sizeof(uint32_t)))
+			break;
+
+		// from a version with other formats, or just garbage
+		SceneVertexFormat format = GetScenePipelineFormat(key);
+		uint32_t materialFlags = key >> 16;
+		if ((key & 0xe0) != 0 || format >= SceneVertexFormatCount || format == SceneVertexLineInstance || (materialFlags > 0x7f && materialFlags != AnyMaterialFlags))
+			continue;
+		LoggedScenePipelineKeys.insert(key);
+	}
+}
 
-			try {
-				Scene.LinePipeline[i] = builder.Create(renderer->Device.get());
-			}
-			catch (...) {
-				debugf(L"Oopsie - line pipeline");
-			}
-		}
+// Only what this run has used, like the SPIR-V cache.
+void RenderPassManager::SavePipelineStateLog()
+{
+	std::set<uint32_t> keys;
+	{
+		std::unique_lock<std::mutex> lock(ScenePipelineMutex);
+		if (UsedScenePipelineKeys.empty() || UsedScenePipelineKeys == LoggedScenePipelineKeys)
+			return;
+		keys = UsedScenePipelineKeys;
+	}
 
-		// Point pipeline
-		for (int i = 0; i < 2; i++)
+	std::string tempFilename = std::string(PipelineStateLogFilename) + ".tmp";
+	{
+		std::ofstream file(tempFilename, std::ios::binary | std::ios::trunc);
+		uint32_t count = (uint32_t)keys.size();
+		file.write("VKPS", 4);
+		file.write((const char*)&PipelineStateLogVersion, sizeof(uint32_t));
+		file.write((const char*)&count, sizeof(uint32_t));
+		for (uint32_t key : keys)
+			file.write((const char*)&key, sizeof(uint32_t));
+		if (!file)
 		{
+			debugf(TEXT("Vulkan: Could not write the pipeline state log"));
+			return;
+		}
+	}
+	std::remove(PipelineStateLogFilename);
+	if (std::rename(tempFilename.c_str(), PipelineStateLogFilename) != 0)
+	{
+		debugf(TEXT("Vulkan: Could not write the pipeline state log"));
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(ScenePipelineMutex);
+	LoggedScenePipelineKeys = keys;
+}
+
+// A layer holds what a run of tiles drew onto nothing, i.e. onto 0. Drawing
+// it with the tiles' blend mode only gives the same result if that blend
+// mode is associative: translucent (screen) and highlighted (premultiplied
+// alpha) are, and opaque & masked tiles leave alpha 1 where they drew, so
+// their layers can be drawn like highlighted ones. Modulated and invisible
+// tiles get no layer pipeline and thus don't get cached.
+void RenderPassManager::AddTileLayerPipelineJobs(std::vector<PipelineJob>& jobs)
+{
+	for (int i = 0; i < 32; i++)
+	{
+		Scene.TileLayerPipeline[i].reset();
+		if ((i & 3) == 1 || (i & 4))
+			continue;
+
+		jobs.push_back({ L"Oopsie - tile layer pipeline", [=]() {
 			GraphicsPipelineBuilder builder;
-			builder.AddVertexShader(vertShader);
-			builder.AddFragmentShader(fragShader);
+			builder.Cache(PipelineCache.get());
+			builder.AddVertexShader(renderer->Shaders->TileLayer.VertexShader.get());
+			builder.AddFragmentShader(renderer->Shaders->TileLayer.FragmentShader.get());
 			builder.Viewport(0.0f, 0.0f, (float)renderer->Textures->Scene->Width, (float)renderer->Textures->Scene->Height);
 			builder.Scissor(0, 0, renderer->Textures->Scene->Width, renderer->Textures->Scene->Height);
 			builder.Topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
 			builder.Cull(VK_CULL_MODE_NONE, VK_FRONT_FACE_CLOCKWISE);
-			builder.AddVertexBufferBinding(0, sizeof(SceneVertex));
-			builder.AddVertexAttribute(0, 0, VK_FORMAT_R32_UINT, offsetof(SceneVertex, Flags));
-			builder.AddVertexAttribute(1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(SceneVertex, Position));
-			builder.AddVertexAttribute(2, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord));
-			builder.AddVertexAttribute(3, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord2));
-			builder.AddVertexAttribute(4, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord3));
-			builder.AddVertexAttribute(5, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SceneVertex, TexCoord4));
-			builder.AddVertexAttribute(6, 0, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(SceneVertex, Color));
-			if (type == 1)
-				builder.AddVertexAttribute(7, 0, VK_FORMAT_R32G32B32A32_SINT, offsetof(SceneVertex, TextureBinds));
 			builder.AddDynamicState(VK_DYNAMIC_STATE_VIEWPORT);
-			builder.Layout(layout);
+			builder.Layout(Scene.TileLayerPipelineLayout.get());
 			builder.RenderPass(Scene.RenderPass.get());
 
-			builder.AddColorBlendAttachment(ColorBlendAttachmentBuilder().BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA).Create());
-			//builder.AddColorBlendAttachment(ColorBlendAttachmentBuilder().Create());
+			if (renderer->Device.get()->EnabledFeatures.Features.depthClamp)
+				builder.DepthClampEnable(true);
 
-			builder.DepthStencilEnable(false, false, false);
+			// same depth state as the tiles, the layer is drawn at their depth
+			ColorBlendAttachmentBuilder colorblend;
+			if ((i & 3) == 0) // PF_Translucent
+				colorblend.BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE_MINUS_SRC_COLOR);
+			else
+				colorblend.BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA);
+			if ((i & 3) != 3)
+				builder.DepthBias(true, -1.0f, 0.0f, -1.0f);
+			builder.DepthStencilEnable(true, (i & 8) != 0, false);
+
+			builder.AddColorBlendAttachment(colorblend.Create());
 			builder.RasterizationSamples(renderer->Textures->Scene->SceneSamples);
-			builder.DebugName("PointPipeline");
+			builder.DebugName("TileLayerPipeline");
 
-			try {
-				Scene.PointPipeline[i] = builder.Create(renderer->Device.get());
-			}
-			catch (...) {
-				debugf(L"Oopsie");
-			}
-		}
+			Scene.TileLayerPipeline[i] = builder.Create(renderer->Device.get());
+		} });
 	}
-
-	Scene.NewPipeline = GraphicsPipelineBuilder()
-		.AddVertexShader(renderer->Shaders->NewScene.VertexShader.get())
-		.AddFragmentShader(renderer->Shaders->NewScene.FragmentShader.get())
-		.Viewport(0.0f, 0.0f, (float)renderer->Textures->Scene->Width, (float)renderer->Textures->Scene->Height)
-		.Scissor(0, 0, renderer->Textures->Scene->Width, renderer->Textures->Scene->Height)
-		.Topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST)
-		.Cull(VK_CULL_MODE_NONE, VK_FRONT_FACE_CLOCKWISE)
-		.AddDynamicState(VK_DYNAMIC_STATE_VIEWPORT)
-		.Layout(Scene.NewPipelineLayout.get())
-		.RenderPass(Scene.RenderPass.get())
-		.AddColorBlendAttachment(ColorBlendAttachmentBuilder().BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_SRC_ALPHA, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA).Create())
-		//.AddColorBlendAttachment(ColorBlendAttachmentBuilder().Create())
-		.DepthStencilEnable(true, true, false)
-		.Create(renderer->Device.get());
-
-	Scene.MeshletPipeline = GraphicsPipelineBuilder()
-		.AddVertexShader(renderer->Shaders->MeshScene.VertexShader.get())
-		.AddFragmentShader(renderer->Shaders->MeshScene.FragmentShader.get())
-		.Viewport(0.0f, 0.0f, (float)renderer->Textures->Scene->Width, (float)renderer->Textures->Scene->Height)
-		.Scissor(0, 0, renderer->Textures->Scene->Width, renderer->Textures->Scene->Height)
-		.Topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST)
-		.Cull(VK_CULL_MODE_BACK_BIT, VK_FRONT_FACE_COUNTER_CLOCKWISE)
-		.Layout(Scene.MeshletPipelineLayout.get())
-		.RenderPass(Scene.RenderPass.get())
-		.AddColorBlendAttachment(ColorBlendAttachmentBuilder().BlendMode(VK_BLEND_OP_ADD, VK_BLEND_FACTOR_SRC_ALPHA, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA).Create())
-		.DepthStencilEnable(true, true, false)
-		.Create(renderer->Device.get());
 }
 
 void RenderPassManager::CreateRenderPass()
 {
+	// It creates pipelines for the old one, and so may a first use. Those
+	// that start from here on find no target, the others get waited for.
+	StopPrewarm();
+	{
+		std::unique_lock<std::mutex> lock(ScenePipelineMutex);
+		Target.RenderPass = nullptr;
+		Target.Generation++;
+	}
+	std::unique_lock<std::shared_mutex> compileLock(ScenePipelineCompileMutex);
+
 	Scene.RenderPass = RenderPassBuilder()
 		.AddAttachment(
 			renderer->Commands->SwapChain->Format().format,
 			renderer->Textures->Scene->SceneSamples,
 			VK_ATTACHMENT_LOAD_OP_CLEAR,
-			VK_ATTACHMENT_STORE_OP_DONT_CARE,
+			VK_ATTACHMENT_STORE_OP_STORE,
 			VK_IMAGE_LAYOUT_UNDEFINED,
 			VK_IMAGE_LAYOUT_PRESENT_SRC_KHR)
 		//.AddAttachment(
@@ -315,7 +841,7 @@ void RenderPassManager::CreateRenderPass()
 			VK_FORMAT_D32_SFLOAT,
 			renderer->Textures->Scene->SceneSamples,
 			VK_ATTACHMENT_LOAD_OP_CLEAR,
-			VK_ATTACHMENT_STORE_OP_DONT_CARE,
+			VK_ATTACHMENT_STORE_OP_STORE,
 			VK_ATTACHMENT_LOAD_OP_DONT_CARE,
 			VK_ATTACHMENT_STORE_OP_DONT_CARE,
 			VK_IMAGE_LAYOUT_UNDEFINED,
@@ -331,4 +857,64 @@ void RenderPassManager::CreateRenderPass()
 		.AddSubpassDepthStencilAttachmentRef(1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
 		.DebugName("SceneRenderPass")
 		.Create(renderer->Device.get());
+
+	// Compatible with SceneRenderPass, but picks up where it left off,
+	// so that the scene can be split into several passes. That's needed
+	// for drawing from secondary command buffers in between inline draws.
+	Scene.ResumeRenderPass = RenderPassBuilder()
+		.AddAttachment(
+			renderer->Commands->SwapChain->Format().format,
+			renderer->Textures->Scene->SceneSamples,
+			VK_ATTACHMENT_LOAD_OP_LOAD,
+			VK_ATTACHMENT_STORE_OP_STORE,
+			VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+			VK_IMAGE_LAYOUT_PRESENT_SRC_KHR)
+		.AddDepthStencilAttachment(
+			VK_FORMAT_D32_SFLOAT,
+			renderer->Textures->Scene->SceneSamples,
+			VK_ATTACHMENT_LOAD_OP_LOAD,
+			VK_ATTACHMENT_STORE_OP_STORE,
+			VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+			VK_ATTACHMENT_STORE_OP_DONT_CARE,
+			VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+			VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+		.AddExternalSubpassDependency(
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+			VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT)
+		.AddSubpass()
+		.AddSubpassColorAttachmentRef(0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL)
+		.AddSubpassDepthStencilAttachmentRef(1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+		.DebugName("SceneResumeRenderPass")
+		.Create(renderer->Device.get());
+
+	// TileLayerCache transitions the layer for sampling once it's drawn
+	Scene.TileLayerRenderPass = RenderPassBuilder()
+		.AddAttachment(
+			renderer->Commands->SwapChain->Format().format,
+			renderer->Textures->Scene->SceneSamples,
+			VK_ATTACHMENT_LOAD_OP_CLEAR,
+			VK_ATTACHMENT_STORE_OP_STORE,
+			VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL)
+		.AddDepthStencilAttachment(
+			VK_FORMAT_D32_SFLOAT,
+			renderer->Textures->Scene->SceneSamples,
+			VK_ATTACHMENT_LOAD_OP_CLEAR,
+			VK_ATTACHMENT_STORE_OP_DONT_CARE,
+			VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+			VK_ATTACHMENT_STORE_OP_DONT_CARE,
+			VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+		.AddExternalSubpassDependency(
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+			VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT)
+		.AddSubpass()
+		.AddSubpassColorAttachmentRef(0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL)
+		.AddSubpassDepthStencilAttachmentRef(1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+		.DebugName("TileLayerRenderPass")
+		.Create(renderer->Device.get());
 }
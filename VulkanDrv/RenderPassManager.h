@@ -1,7 +1,38 @@
 #pragma once
 
+#include "ShaderManager.h"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
 class UVulkanRenderDevice;
 
+// Buckets of the new scene path, in the order in which they get drawn.
+enum DrawBucket
+{
+	DrawBucketOpaque,
+	DrawBucketMasked,
+	DrawBucketTranslucent,
+	DrawBucketModulated,
+	DrawBucketCount
+};
+
+// Same precedence as GetPipeline.
+inline DrawBucket GetDrawBucket(DWORD PolyFlags)
+{
+	if (PolyFlags & PF_Translucent)
+		return DrawBucketTranslucent;
+	if (PolyFlags & PF_Modulated)
+		return DrawBucketModulated;
+	if (PolyFlags & PF_Masked)
+		return DrawBucketMasked;
+	return DrawBucketOpaque;
+}
+
 class RenderPassManager
 {
 public:
@@ -11,31 +42,124 @@ public:
 	void CreateRenderPass();
 	void CreatePipelines();
 
+	// Writes what the driver has compiled so far to disk, so that the next
+	// run gets the pipelines without compiling them again, along with the
+	// state log of which scene pipelines got used. Happens on exit and
+	// after each level load.
+	void SavePipelineCache();
+
 	void BeginScene(VulkanCommandBuffer* cmdbuffer, float r, float g, float b, float a);
+	void ResumeScene(VulkanCommandBuffer* cmdbuffer, VkSubpassContents contents);
 	void EndScene(VulkanCommandBuffer* cmdbuffer);
 
-	VulkanPipeline* GetPipeline(DWORD polyflags);
-	VulkanPipeline* GetEndFlashPipeline();
+	static const uint32_t AnyMaterialFlags = 0x80;
+
+	// Draws get recorded with the key of their scene pipeline and look the
+	// pipeline up when they get replayed, as the Lock before them may have
+	// recreated the pipelines. materialFlags are the Flags that all of the
+	// draw's vertices have, or AnyMaterialFlags if they differ. The
+	// pipeline's fragment shader gets specialized for them, unless
+	// VkSpecializedShaders is off.
+	uint32_t GetPipelineKey(DWORD polyflags, SceneVertexFormat format = SceneVertexFull, uint32_t materialFlags = AnyMaterialFlags);
+	uint32_t GetEndFlashPipelineKey();
+
+	// Scene pipelines get created on first use. Thread safe. Null if it
+	// couldn't be created.
+	VulkanPipeline* GetScenePipeline(uint32_t key);
 	VulkanPipeline* GetLinePipeline(bool occludeLines) { return Scene.LinePipeline[occludeLines].get(); }
 	VulkanPipeline* GetPointPipeline(bool occludeLines) { return Scene.PointPipeline[occludeLines].get(); }
+	VulkanPipeline* GetThickLinePipeline(bool occludeLines) { return Scene.ThickLinePipeline[occludeLines].get(); }
+	VulkanPipeline* GetNewPipeline(DrawBucket bucket) { return Scene.NewPipeline[bucket].get(); }
+
+	// What draws a cached layer of tiles that were drawn with tilePipeline
+	// (one of the SceneVertexTileInstance scene pipelines). Null if
+	// such tiles can't be cached, see TileLayerCache.
+	VulkanPipeline* GetTileLayerPipeline(VulkanPipeline* tilePipeline);
 
 	struct
 	{
 		std::unique_ptr<VulkanPipelineLayout> BindlessPipelineLayout;
 		std::unique_ptr<VulkanRenderPass> RenderPass;
-		std::unique_ptr<VulkanPipeline> Pipeline[32];
+		std::unique_ptr<VulkanRenderPass> ResumeRenderPass;
+		// these take SceneTileVertex
 		std::unique_ptr<VulkanPipeline> LinePipeline[2];
 		std::unique_ptr<VulkanPipeline> PointPipeline[2];
+		// and this SceneLineInstance, for lines wider than a pixel
+		std::unique_ptr<VulkanPipeline> ThickLinePipeline[2];
+
+		// Renders tiles into a layer image with the scene pipelines, so it
+		// has to be compatible with RenderPass.
+		std::unique_ptr<VulkanRenderPass> TileLayerRenderPass;
+		std::unique_ptr<VulkanPipelineLayout> TileLayerPipelineLayout;
+		std::unique_ptr<VulkanPipeline> TileLayerPipeline[32];
 
 		std::unique_ptr<VulkanPipelineLayout> NewPipelineLayout;
-		std::unique_ptr<VulkanPipeline> NewPipeline;
+		std::unique_ptr<VulkanPipeline> NewPipeline[DrawBucketCount];
 
 		std::unique_ptr<VulkanPipelineLayout> MeshletPipelineLayout;
 		std::unique_ptr<VulkanPipeline> MeshletPipeline;
+		// only with UVulkanRenderDevice::SupportsMeshShaders
+		std::unique_ptr<VulkanPipelineLayout> MeshShaderPipelineLayout;
+		std::unique_ptr<VulkanPipeline> MeshShaderPipeline;
 	} Scene;
 
 private:
+	struct PipelineJob
+	{
+		// What gets logged if it fails, leaving its pipeline null. Without
+		// one, the failure is fatal.
+		const TCHAR* FailureMessage;
+		std::function<void()> Create;
+	};
+
+	// What the scene pipelines get created for, as of CreatePipelines
+	struct ScenePipelineTarget
+	{
+		VulkanRenderPass* RenderPass = nullptr;
+		int Width = 0;
+		int Height = 0;
+		VkSampleCountFlagBits Samples = VK_SAMPLE_COUNT_1_BIT;
+		int Generation = 0;
+	};
+
+	// Everything a scene pipeline depends on besides its target: which of
+	// GetPipelineKey's 32 PolyFlags combinations (bits 0-4), the vertex format
+	// (bits 8-15) and the material flags (bits 16-23). Gets saved in the
+	// state log, so new state has to go into bits of its own.
+	static uint32_t GetScenePipelineKey(int index, SceneVertexFormat format, uint32_t materialFlags) { return (uint32_t)index | ((uint32_t)format << 8) | (materialFlags << 16); }
+	static SceneVertexFormat GetScenePipelineFormat(uint32_t key) { return (SceneVertexFormat)((key >> 8) & 0xff); }
+
+	// used is false for pre-warming, which doesn't count for the state log
+	VulkanPipeline* GetScenePipeline(uint32_t key, bool used);
+	std::unique_ptr<VulkanPipeline> CreateScenePipeline(uint32_t key, const ScenePipelineTarget& target);
+
+	// Creates the scene pipelines in the state log on a thread of its own,
+	// so that the first use finds them there already.
+	void StartPrewarm();
+	void StopPrewarm();
+	void LoadPipelineStateLog();
+	void SavePipelineStateLog();
+
 	void CreateSceneBindlessPipelineLayout();
+	void AddTileLayerPipelineJobs(std::vector<PipelineJob>& jobs);
+	void CreatePipelineCache();
+	std::string GetPipelineCacheFilename() const;
 
 	UVulkanRenderDevice* renderer = nullptr;
+
+	// All pipelines get created through this. It starts out with what the
+	// last run saved, as long as that was on the same device & driver.
+	std::unique_ptr<VulkanPipelineCache> PipelineCache;
+	bool PipelineCacheWarm = false;
+
+	std::mutex ScenePipelineMutex;
+	std::shared_mutex ScenePipelineCompileMutex;
+	std::unordered_map<uint32_t, std::unique_ptr<VulkanPipeline>> ScenePipelines;
+	std::unordered_map<VulkanPipeline*, uint32_t> ScenePipelineKeys;
+	ScenePipelineTarget Target;
+	std::set<uint32_t> UsedScenePipelineKeys;
+	std::set<uint32_t> LoggedScenePipelineKeys;
+
+	std::thread PrewarmThread;
+	std::atomic<bool> StopPrewarmFlag = false;
 };
@@ -0,0 +1,121 @@
+#include "Precomp.h"
+#include "RenderThread.h"
+
+void* CommandStream::Push(uint32_t type, size_t payloadSize)
+{
+	size_t size = (sizeof(Header) + payloadSize + alignof(Header) - 1) & ~(alignof(Header) - 1);
+	if (Used + size > Capacity)
+	{
+		size_t newCapacity = std::max<size_t>(Capacity * 2, 64 * 1024);
+		while (newCapacity < Used + size)
+			newCapacity *= 2;
+		std::unique_ptr<uint8_t[]> newData(new uint8_t[newCapacity]);
+		if (Used > 0)
+			memcpy(newData.get(), Data.get(), Used);
+		Data = std::move(newData);
+		Capacity = newCapacity;
+	}
+
+	auto header = new (Data.get() + Used) Header();
+	header->Type = type;
+	header->Size = (uint32_t)size;
+	Used += size;
+	return header + 1;
+}
+
+RenderThread::RenderThread(bool threaded, std::function<void(CommandStream&)> replay) : Replay(std::move(replay))
+{
+	if (threaded)
+		Thread = std::thread([this]() { ThreadMain(); });
+}
+
+RenderThread::~RenderThread()
+{
+	if (IsThreaded())
+	{
+		try
+		{
+			Sync();
+		}
+		catch (...)
+		{
+		}
+		// the render thread waits on the stream that would be kicked next
+		States[Recording].store(Stop, std::memory_order_release);
+		States[Recording].notify_one();
+		Thread.join();
+	}
+}
+
+void RenderThread::Kick()
+{
+	CommandStream& stream = Streams[Recording];
+	if (stream.IsEmpty())
+		return;
+
+	if (!IsThreaded())
+	{
+		try
+		{
+			Replay(stream);
+		}
+		catch (...)
+		{
+			stream.Clear();
+			throw;
+		}
+		stream.Clear();
+		return;
+	}
+
+	States[Recording].store(Ready, std::memory_order_release);
+	States[Recording].notify_one();
+	Recording ^= 1;
+	WaitUntilFree(Recording);
+}
+
+void RenderThread::Sync()
+{
+	Kick();
+	if (IsThreaded())
+		WaitUntilFree(Recording ^ 1);
+}
+
+void RenderThread::WaitUntilFree(int index)
+{
+	int state;
+	while ((state = States[index].load(std::memory_order_acquire)) != Free)
+		States[index].wait(state, std::memory_order_acquire);
+
+	if (Errors[index])
+	{
+		std::exception_ptr error = Errors[index];
+		Errors[index] = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+void RenderThread::ThreadMain()
+{
+	int replaying = 0;
+	while (true)
+	{
+		States[replaying].wait(Free, std::memory_order_acquire);
+		if (States[replaying].load(std::memory_order_acquire) == Stop)
+			break;
+
+		try
+		{
+			Replay(Streams[replaying]);
+		}
+		catch (...)
+		{
+			Errors[replaying] = std::current_exception();
+		}
+		Streams[replaying].Clear();
+
+		States[replaying].store(Free, std::memory_order_release);
+		States[replaying].notify_one();
+		replaying ^= 1;
+	}
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <new>
+#include <thread>
+
+// Commands recorded back to back into one growing block of memory. Each
+// one is a Header followed by its payload, padded so that the next header
+// is aligned again. Payloads have to be trivially copyable.
+class CommandStream
+{
+public:
+	struct alignas(8) Header
+	{
+		uint32_t Type;
+		uint32_t Size; // including the header & padding
+	};
+
+	// The payload stays valid until the next Push.
+	void* Push(uint32_t type, size_t payloadSize);
+
+	// extraSize bytes of variable sized data directly follow the T
+	template<typename T>
+	T* Push(uint32_t type, size_t extraSize = 0) { return new (Push(type, sizeof(T) + extraSize)) T(); }
+
+	const uint8_t* Begin() const { return Data.get(); }
+	const uint8_t* End() const { return Data.get() + Used; }
+	bool IsEmpty() const { return Used == 0; }
+	void Clear() { Used = 0; }
+
+private:
+	std::unique_ptr<uint8_t[]> Data;
+	size_t Capacity = 0;
+	size_t Used = 0;
+};
+
+// Replays command streams on a thread of its own, one stream behind the
+// thread that records them. There are two streams: one gets recorded while
+// the render thread replays the other, and they trade places through a
+// pair of atomics, no locks involved. Without a thread, streams get
+// replayed by whoever kicks them off.
+class RenderThread
+{
+public:
+	RenderThread(bool threaded, std::function<void(CommandStream&)> replay);
+	~RenderThread();
+
+	bool IsThreaded() const { return Thread.joinable(); }
+
+	// Where the commands go.
+	CommandStream& GetStream() { return Streams[Recording]; }
+
+	// Hands the stream over to the render thread and switches to the other
+	// one, waiting for its replay to finish first. If that replay threw,
+	// the exception gets rethrown here.
+	void Kick();
+
+	// Kicks and then waits until everything has been replayed. Afterwards
+	// the caller can touch whatever the replay touches, until the next Kick.
+	void Sync();
+
+private:
+	enum StreamState : int { Free, Ready, Stop };
+
+	void ThreadMain();
+	void WaitUntilFree(int index);
+
+	std::function<void(CommandStream&)> Replay;
+	CommandStream Streams[2];
+	std::atomic<int> States[2] = { Free, Free };
+	std::exception_ptr Errors[2];
+	int Recording = 0;
+	std::thread Thread;
+};
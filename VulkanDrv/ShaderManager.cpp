@@ -3,60 +3,74 @@
 #include "ShaderManager.h"
 #include "FileResource.h"
 #include "UVulkanRenderDevice.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 
 ShaderManager::ShaderManager(UVulkanRenderDevice* renderer) : renderer(renderer)
 {
+	auto startTime = std::chrono::steady_clock::now();
+
 	ShaderBuilder::Init();
+	LoadSpirvCache();
 
 	guard(ShaderManager::ShaderManager::vert);
-	NewScene.VertexShader = ShaderBuilder()
-		.Type(ShaderType::Vertex)
-		.AddSource("scene.vert", readShader(IDR_SCENE_VERT))
-		.DebugName("newVertexShader")
-		.Create("newVertexShader", renderer->Device.get());
+	NewScene.VertexShader = CreateShader(ShaderType::Vertex, "newVertexShader", "scene.vert", readShader(IDR_SCENE_VERT));
 	unguard;
 
 	guard(ShaderManager::ShaderManager::frag);
-	NewScene.FragmentShader = ShaderBuilder()
-		.Type(ShaderType::Fragment)
-		.AddSource("scene.frag", readShader(IDR_SCENE_FRAG))
-		.DebugName("newFragmentShader")
-		.Create("newFragmentShader", renderer->Device.get());
+	NewScene.FragmentShader = CreateShader(ShaderType::Fragment, "newFragmentShader", "scene.frag", readShader(IDR_SCENE_FRAG));
+	unguard;
+
+	guard(ShaderManager::ShaderManager::frag_alphatest);
+	NewScene.FragmentShaderAlphaTest = CreateShader(ShaderType::Fragment, "newFragmentShaderAlphaTest", "scene.frag", InsertDefines(readShader(IDR_SCENE_FRAG), "#define ALPHATEST"));
 	unguard;
 
 	guard(ShaderManager::ShaderManager::mesh_vert);
-	MeshScene.VertexShader = ShaderBuilder()
-		.Type(ShaderType::Vertex)
-		.AddSource("scene-mesh.vert", readShader(IDR_SCENE_MESH_VERT))
-		.DebugName("meshVertexShader")
-		.Create("meshVertexShader", renderer->Device.get());
+	MeshScene.VertexShader = CreateShader(ShaderType::Vertex, "meshVertexShader", "scene-mesh.vert", readShader(IDR_SCENE_MESH_VERT));
 	unguard;
 
 	guard(ShaderManager::ShaderManager::mesh_frag);
-	MeshScene.FragmentShader = ShaderBuilder()
-		.Type(ShaderType::Fragment)
-		.AddSource("scene-mesh.frag", readShader(IDR_SCENE_MESH_FRAG))
-		.DebugName("meshFragmentShader")
-		.Create("meshFragmentShader", renderer->Device.get());
+	MeshScene.FragmentShader = CreateShader(ShaderType::Fragment, "meshFragmentShader", "scene-mesh.frag", readShader(IDR_SCENE_MESH_FRAG));
+	unguard;
+
+	if (renderer->SupportsMeshShaders)
+	{
+		guard(ShaderManager::ShaderManager::mesh_task);
+		MeshScene.TaskShader = CreateShader(ShaderType::Task, "meshTaskShader", "scene-mesh.task", readShader(IDR_SCENE_MESH_TASK));
+		unguard;
+
+		guard(ShaderManager::ShaderManager::mesh_mesh);
+		MeshScene.MeshShader = CreateShader(ShaderType::Mesh, "meshMeshShader", "scene-mesh.mesh", readShader(IDR_SCENE_MESH_MESH));
+		unguard;
+	}
+
+	guard(ShaderManager::ShaderManager::tile_layer_vert);
+	TileLayer.VertexShader = CreateShader(ShaderType::Vertex, "tileLayerVertexShader", "tile-layer.vert", readShader(IDR_TILE_LAYER_VERT));
 	unguard;
 
-	SceneBindless.VertexShader = ShaderBuilder()
-		.Type(ShaderType::Vertex)
-		.AddSource("shaders/Scene.vert", LoadShaderCode("shaders/Scene.vert", "#extension GL_EXT_nonuniform_qualifier : enable\r\n#define BINDLESS_TEXTURES"))
-		.DebugName("vertexShader")
-		.Create("vertexShader", renderer->Device.get());
-
-	SceneBindless.FragmentShader = ShaderBuilder()
-		.Type(ShaderType::Fragment)
-		.AddSource("shaders/Scene.frag", LoadShaderCode("shaders/Scene.frag", "#extension GL_EXT_nonuniform_qualifier : enable\r\n#define BINDLESS_TEXTURES"))
-		.DebugName("fragmentShader")
-		.Create("fragmentShader", renderer->Device.get());
-
-	SceneBindless.FragmentShaderAlphaTest = ShaderBuilder()
-		.Type(ShaderType::Fragment)
-		.AddSource("shaders/Scene.frag", LoadShaderCode("shaders/Scene.frag", "#extension GL_EXT_nonuniform_qualifier : enable\r\n#define BINDLESS_TEXTURES\r\n#define ALPHATEST"))
-		.DebugName("fragmentShader")
-		.Create("fragmentShader", renderer->Device.get());
+	guard(ShaderManager::ShaderManager::tile_layer_frag);
+	TileLayer.FragmentShader = CreateShader(ShaderType::Fragment, "tileLayerFragmentShader", "tile-layer.frag", readShader(IDR_TILE_LAYER_FRAG));
+	unguard;
+
+	SceneBindless.VertexShader[SceneVertexFull] = CreateShader(ShaderType::Vertex, "vertexShader", "shaders/Scene.vert", LoadShaderCode("shaders/Scene.vert", "#extension GL_EXT_nonuniform_qualifier : enable\r\n#define BINDLESS_TEXTURES"));
+
+	SceneBindless.VertexShader[SceneVertexGouraud] = CreateShader(ShaderType::Vertex, "vertexShaderGouraud", "shaders/Scene.vert", LoadShaderCode("shaders/Scene.vert", "#extension GL_EXT_nonuniform_qualifier : enable\r\n#define BINDLESS_TEXTURES\r\n#define GOURAUD_VERTEX"));
+
+	SceneBindless.VertexShader[SceneVertexTile] = CreateShader(ShaderType::Vertex, "vertexShaderTile", "shaders/Scene.vert", LoadShaderCode("shaders/Scene.vert", "#extension GL_EXT_nonuniform_qualifier : enable\r\n#define BINDLESS_TEXTURES\r\n#define TILE_VERTEX"));
+
+	SceneBindless.VertexShader[SceneVertexTileInstance] = CreateShader(ShaderType::Vertex, "vertexShaderTileInstance", "shaders/Scene.vert", LoadShaderCode("shaders/Scene.vert", "#extension GL_EXT_nonuniform_qualifier : enable\r\n#define BINDLESS_TEXTURES\r\n#define TILE_INSTANCE"));
+
+	SceneBindless.VertexShader[SceneVertexLineInstance] = CreateShader(ShaderType::Vertex, "vertexShaderThickLine", "shaders/Scene.vert", LoadShaderCode("shaders/Scene.vert", "#extension GL_EXT_nonuniform_qualifier : enable\r\n#define BINDLESS_TEXTURES\r\n#define THICK_LINE"));
+
+	SceneBindless.FragmentShader = CreateShader(ShaderType::Fragment, "fragmentShader", "shaders/Scene.frag", LoadShaderCode("shaders/Scene.frag", "#extension GL_EXT_nonuniform_qualifier : enable\r\n#define BINDLESS_TEXTURES"));
+
+	SceneBindless.FragmentShaderAlphaTest = CreateShader(ShaderType::Fragment, "fragmentShader", "shaders/Scene.frag", LoadShaderCode("shaders/Scene.frag", "#extension GL_EXT_nonuniform_qualifier : enable\r\n#define BINDLESS_TEXTURES\r\n#define ALPHATEST"));
+
+	SaveSpirvCache();
+
+	int ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+	debugf(TEXT("Vulkan: Created the shaders in %d ms, %d from the SPIR-V cache, %d compiled"), ms, SpirvCacheHits, SpirvCacheMisses);
 }
 
 ShaderManager::~ShaderManager()
@@ -64,6 +78,118 @@ ShaderManager::~ShaderManager()
 	ShaderBuilder::Deinit();
 }
 
+std::unique_ptr<VulkanShader> ShaderManager::CreateShader(ShaderType type, const char* name, const std::string& filename, const std::string& code)
+{
+	VulkanDevice* device = renderer->Device.get();
+	uint32_t target = device->Instance->ApiVersion >= VK_API_VERSION_1_2 ? 1 : 0; // see ShaderBuilder::Compile
+
+	// FNV-1a, same as ObjectHasher
+	uint64_t key = 0xcbf29ce484222325ull;
+	auto hash = [&](const void* data, size_t size)
+	{
+		for (size_t i = 0; i < size; i++)
+		{
+			key ^= static_cast<const uint8_t*>(data)[i];
+			key *= 0x100000001b3ull;
+		}
+	};
+	hash(&type, sizeof(type));
+	hash(&target, sizeof(target));
+	hash(filename.data(), filename.size() + 1);
+	hash(code.data(), code.size());
+
+	ShaderBuilder builder;
+	builder.Type(type).AddSource(filename, code).DebugName(name);
+
+	auto& entry = SpirvCache[key];
+	if (entry.Code.empty())
+	{
+		entry.Code = builder.Compile(device);
+		SpirvCacheMisses++;
+	}
+	else
+	{
+		SpirvCacheHits++;
+	}
+	entry.Used = true;
+
+	return builder.Spirv(entry.Code).Create(name, device);
+}
+
+// The file is "VKSC", a version, the entry count and then for each entry
+// its key, its size in words & the words. A release can ship one, made by
+// a run of the same build, and then never runs glslang at all.
+static const char* SpirvCacheFilename = "VkShaderCache.bin";
+static const uint32_t SpirvCacheVersion = 1;
+
+void ShaderManager::LoadSpirvCache()
+{
+	std::ifstream file(SpirvCacheFilename, std::ios::binary);
+	if (!file)
+		return;
+
+	char magic[4] = {};
+	uint32_t version = 0, count = 0;
+	file.read(magic, 4);
+	file.read((char*)&version, sizeof(uint32_t));
+	file.read((char*)&count, sizeof(uint32_t));
+	if (!file || memcmp(magic, "VKSC", 4) != 0 || version != SpirvCacheVersion)
+		return;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint64_t key = 0;
+		uint32_t size = 0;
+		file.read((char*)&key, sizeof(uint64_t));
+		file.read((char*)&size, sizeof(uint32_t));
+		if (!file || size == 0 || size > 16 * 1024 * 1024)
+			break;
+
+		std::vector<uint32_t> code(size);
+		if (!file.read((char*)code.data(), size * sizeof(uint32_t)))
+			break;
+		SpirvCache[key].Code = std::move(code);
+	}
+}
+
+void ShaderManager::SaveSpirvCache()
+{
+	uint32_t count = 0;
+	for (auto& it : SpirvCache)
+	{
+		if (it.second.Used)
+			count++;
+	}
+	if (SpirvCacheMisses == 0 && count == SpirvCache.size())
+		return;
+
+	// written next to it first, like the pipeline cache
+	std::string tempFilename = std::string(SpirvCacheFilename) + ".tmp";
+	{
+		std::ofstream file(tempFilename, std::ios::binary | std::ios::trunc);
+		file.write("VKSC", 4);
+		file.write((const char*)&SpirvCacheVersion, sizeof(uint32_t));
+		file.write((const char*)&count, sizeof(uint32_t));
+		for (auto& it : SpirvCache)
+		{
+			if (!it.second.Used)
+				continue;
+			uint32_t size = (uint32_t)it.second.Code.size();
+			file.write((const char*)&it.first, sizeof(uint64_t));
+			file.write((const char*)&size, sizeof(uint32_t));
+			file.write((const char*)it.second.Code.data(), size * sizeof(uint32_t));
+		}
+		if (!file)
+		{
+			debugf(TEXT("Vulkan: Could not write the SPIR-V cache"));
+			return;
+		}
+	}
+	std::remove(SpirvCacheFilename);
+	if (std::rename(tempFilename.c_str(), SpirvCacheFilename) != 0)
+		debugf(TEXT("Vulkan: Could not write the SPIR-V cache"));
+}
+
 std::string ShaderManager::LoadShaderCode(const std::string& filename, const std::string& defines)
 {
 	const char* shaderversion = R"(
@@ -72,3 +198,12 @@ std::string ShaderManager::LoadShaderCode(const std::string& filename, const std
 	)";
 	return shaderversion + defines + "\r\n#line 1\r\n" + FileResource::readAllText(filename);
 }
+
+std::string ShaderManager::InsertDefines(const std::string& code, const std::string& defines)
+{
+	// defines have to go after the #version line, which has to come first
+	auto versionEnd = code.find('\n');
+	if (versionEnd == std::string::npos)
+		return code;
+	return code.substr(0, versionEnd + 1) + defines + "\n#line 2\n" + code.substr(versionEnd + 1);
+}
@@ -16,12 +16,99 @@ struct SceneVertex
 	ivec4 TextureBinds;
 };
 
+// Each legacy pipeline reads one of these formats. Everything but complex
+// surfaces gets by with a lot less than SceneVertex, see below.
+enum SceneVertexFormat
+{
+	SceneVertexFull,
+	SceneVertexGouraud,
+	SceneVertexTile,
+	SceneVertexTileInstance,
+	SceneVertexLineInstance,
+	SceneVertexFormatCount
+};
+
+// Gouraud polygons: the fog goes where SceneVertex has TexCoord2 & 3.
+// Colors are R8G8B8A8_UNORM.
+struct SceneGouraudVertex
+{
+	uint32_t Flags;
+	vec3 Position;
+	vec2 TexCoord;
+	uint32_t Color;
+	uint32_t Fog;
+};
+
+// Tiles, lines & points: no flags, a half float UV and an R8G8B8A8_UNORM color.
+struct SceneTileVertex
+{
+	vec3 Position;
+	uint16_t TexCoord[2];
+	uint32_t Color;
+};
+
+// DrawTile: one of these per tile rather than four vertices, the vertex
+// shader makes the quad out of gl_VertexIndex. Rect is X, Y, X + XL, Y + YL
+// in screen pixels and TexCoords is U, V, U + UL, V + VL as half floats.
+// The tile's Z and the screen to view transform are push constants (tileZ,
+// tileTransform), so only tiles at the same Z go into the same draw.
+struct SceneTileInstance
+{
+	vec4 Rect;
+	uint16_t TexCoords[4];
+	uint32_t Color;
+	uint32_t TextureIndex;
+};
+
+// Lines wider than a pixel: one of these per line, the vertex shader makes
+// a quad LineWidth pixels wide out of it. See THICK_LINE in Scene.vert.
+struct SceneLineInstance
+{
+	vec3 From;
+	vec3 To;
+	uint32_t Color;
+};
+
+static_assert(sizeof(SceneGouraudVertex) == 32, "SceneGouraudVertex should be 32 bytes");
+static_assert(sizeof(SceneTileVertex) == 20, "SceneTileVertex should be 20 bytes");
+static_assert(sizeof(SceneTileInstance) == 32, "SceneTileInstance should be 32 bytes");
+static_assert(sizeof(SceneLineInstance) == 28, "SceneLineInstance should be 28 bytes");
+
+template<typename T> struct SceneVertexFormatOf;
+template<> struct SceneVertexFormatOf<SceneVertex> { static const SceneVertexFormat Value = SceneVertexFull; };
+template<> struct SceneVertexFormatOf<SceneGouraudVertex> { static const SceneVertexFormat Value = SceneVertexGouraud; };
+template<> struct SceneVertexFormatOf<SceneTileVertex> { static const SceneVertexFormat Value = SceneVertexTile; };
+template<> struct SceneVertexFormatOf<SceneTileInstance> { static const SceneVertexFormat Value = SceneVertexTileInstance; };
+template<> struct SceneVertexFormatOf<SceneLineInstance> { static const SceneVertexFormat Value = SceneVertexLineInstance; };
+
+inline uint32_t GetSceneVertexStride(SceneVertexFormat format)
+{
+	switch (format)
+	{
+	default:
+	case SceneVertexFull: return sizeof(SceneVertex);
+	case SceneVertexGouraud: return sizeof(SceneGouraudVertex);
+	case SceneVertexTile: return sizeof(SceneTileVertex);
+	case SceneVertexTileInstance: return sizeof(SceneTileInstance);
+	case SceneVertexLineInstance: return sizeof(SceneLineInstance);
+	}
+}
+
 struct ScenePushConstants
 {
 	mat4 objectToProjection;
 	vec4 nearClip;
 	uint32_t hitIndex;
-	uint32_t padding1, padding2, padding3;
+	float tileZ;
+	vec2 lineHalfWidth; // LineWidth / viewport size, in clip space units
+	vec4 tileTransform; // RFX2, RFY2, FX2, FY2
+};
+
+struct TileLayerPushConstants
+{
+	vec4 rect;
+	float depth;
+	float padding1, padding2, padding3;
 };
 
 struct NewScenePushConstants
@@ -37,7 +124,7 @@ public:
 
 	struct SceneShaders
 	{
-		std::unique_ptr<VulkanShader> VertexShader;
+		std::unique_ptr<VulkanShader> VertexShader[SceneVertexFormatCount];
 		std::unique_ptr<VulkanShader> FragmentShader;
 		std::unique_ptr<VulkanShader> FragmentShaderAlphaTest;
 	} SceneBindless;
@@ -46,16 +133,48 @@ public:
 	{
 		std::unique_ptr<VulkanShader> VertexShader;
 		std::unique_ptr<VulkanShader> FragmentShader;
+		std::unique_ptr<VulkanShader> FragmentShaderAlphaTest;
 	} NewScene;
 
 	struct MeshSceneShaders
 	{
 		std::unique_ptr<VulkanShader> VertexShader;
 		std::unique_ptr<VulkanShader> FragmentShader;
+		// only with UVulkanRenderDevice::SupportsMeshShaders
+		std::unique_ptr<VulkanShader> TaskShader;
+		std::unique_ptr<VulkanShader> MeshShader;
 	} MeshScene;;
 
+	struct TileLayerShaders
+	{
+		std::unique_ptr<VulkanShader> VertexShader;
+		std::unique_ptr<VulkanShader> FragmentShader;
+	} TileLayer;
+
 	static std::string LoadShaderCode(const std::string& filename, const std::string& defines = {});
+	static std::string InsertDefines(const std::string& code, const std::string& defines);
 
 private:
+	// Compiles the code, unless the SPIR-V cache already has it
+	std::unique_ptr<VulkanShader> CreateShader(ShaderType type, const char* name, const std::string& filename, const std::string& code);
+
+	// The SPIR-V of earlier runs, keyed by a hash of the shader stage, the
+	// SPIR-V target and the complete code including the defines. Any
+	// change to a shader thus makes it a miss. Saving only keeps what this
+	// run used, so outdated entries don't pile up. This is what stands in
+	// for compiling the shaders at build time: the GLSL resources stay the
+	// source, and a cache shipped with a release skips glslang entirely.
+	void LoadSpirvCache();
+	void SaveSpirvCache();
+
+	struct CachedSpirv
+	{
+		std::vector<uint32_t> Code;
+		bool Used = false;
+	};
+	std::unordered_map<uint64_t, CachedSpirv> SpirvCache;
+	int SpirvCacheHits = 0;
+	int SpirvCacheMisses = 0;
+
 	UVulkanRenderDevice* renderer = nullptr;
 };
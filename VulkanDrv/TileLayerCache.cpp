@@ -0,0 +1,278 @@
+
+#include "Precomp.h"
+#include "TileLayerCache.h"
+#include "UVulkanRenderDevice.h"
+
+TileLayerCache::TileLayerCache(UVulkanRenderDevice* renderer) : renderer(renderer)
+{
+	// the layers are drawn 1:1 onto the pixels they were rendered from
+	Sampler = SamplerBuilder()
+		.MinFilter(VK_FILTER_NEAREST)
+		.MagFilter(VK_FILTER_NEAREST)
+		.MipmapMode(VK_SAMPLER_MIPMAP_MODE_NEAREST)
+		.AddressMode(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE)
+		.DebugName("TileLayerSampler")
+		.Create(renderer->Device.get());
+}
+
+TileLayerCache::~TileLayerCache()
+{
+}
+
+// FNV-1a, same as ObjectHasher
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+{
+	auto bytes = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+uint64_t TileLayerCache::BeginRunHash(VulkanPipeline* pipeline, const ScenePushConstants& pushconstants, const VkViewport& viewport)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	hash = hashBytes(hash, &pipeline, sizeof(pipeline));
+	hash = hashBytes(hash, &pushconstants, sizeof(ScenePushConstants));
+	hash = hashBytes(hash, &viewport, sizeof(VkViewport));
+	return hash;
+}
+
+uint64_t TileLayerCache::HashTile(uint64_t hash, const SceneTileInstance& tile)
+{
+	return hashBytes(hash, &tile, sizeof(SceneTileInstance));
+}
+
+bool TileLayerCache::Draw(VulkanCommandBuffer* cmdbuffer, const TileRun& run, const ScenePushConstants& pushconstants, const VkViewport& viewport)
+{
+	if (run.NumInstances < MinTiles || renderer->Textures->Scene->SceneSamples != VK_SAMPLE_COUNT_1_BIT)
+		return false;
+
+	VulkanPipeline* layerPipeline = renderer->RenderPasses->GetTileLayerPipeline(run.Pipeline);
+	if (!layerPipeline)
+		return false;
+
+	// Rendering into the layer has to stay within it, so runs that reach
+	// beyond the scene don't get one.
+	int x0 = (int)std::floor(viewport.x + run.Bounds.x);
+	int y0 = (int)std::floor(viewport.y + run.Bounds.y);
+	int x1 = (int)std::ceil(viewport.x + run.Bounds.z);
+	int y1 = (int)std::ceil(viewport.y + run.Bounds.w);
+	if (x0 < 0 || y0 < 0 || x1 > renderer->Textures->Scene->Width || y1 > renderer->Textures->Scene->Height || x1 <= x0 || y1 <= y0)
+		return false;
+
+	renderer->Stats.TileLayerRuns++;
+
+	Layer* layer = nullptr;
+	auto it = Layers.find(run.Hash);
+	if (it != Layers.end())
+	{
+		layer = &it->second;
+		renderer->Stats.TileLayerHits++;
+	}
+	else
+	{
+		auto candidate = Candidates.find(run.Hash);
+		if (candidate == Candidates.end() || candidate->second + 1 != Frame || NewLayers == MaxNewLayersPerFrame)
+		{
+			Candidates[run.Hash] = Frame;
+			return false;
+		}
+		Candidates.erase(candidate);
+
+		layer = CreateLayer(cmdbuffer, run, pushconstants, viewport, x0, y0, x1 - x0, y1 - y0);
+		if (!layer)
+			return false;
+		NewLayers++;
+		renderer->Stats.TileLayersCreated++;
+	}
+	layer->LastUsed = Frame;
+
+	// All tiles of a run are at the same Z, so the layer gets drawn at
+	// their depth, for the depth test and for PF_Occlude.
+	vec4 clipPos = pushconstants.objectToProjection * vec4(0.0f, 0.0f, pushconstants.tileZ, 1.0f);
+
+	TileLayerPushConstants constants = {};
+	constants.rect = vec4(
+		(layer->X - viewport.x) / viewport.width * 2.0f - 1.0f,
+		(layer->Y - viewport.y) / viewport.height * 2.0f - 1.0f,
+		(layer->X + layer->Width - viewport.x) / viewport.width * 2.0f - 1.0f,
+		(layer->Y + layer->Height - viewport.y) / viewport.height * 2.0f - 1.0f);
+	constants.depth = clipPos.w != 0.0f ? clipPos.z / clipPos.w : 0.0f;
+
+	auto layout = renderer->RenderPasses->Scene.TileLayerPipelineLayout.get();
+	cmdbuffer->bindPipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, layerPipeline);
+	cmdbuffer->bindDescriptorSet(VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, layer->DescriptorSet.get());
+	cmdbuffer->pushConstants(layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(TileLayerPushConstants), &constants);
+	cmdbuffer->draw(6, 1, 0, 0);
+	return true;
+}
+
+TileLayerCache::Layer* TileLayerCache::CreateLayer(VulkanCommandBuffer* cmdbuffer, const TileRun& run, const ScenePushConstants& pushconstants, const VkViewport& viewport, int x, int y, int width, int height)
+{
+	if (DepthBufferWidth != renderer->Textures->Scene->Width || DepthBufferHeight != renderer->Textures->Scene->Height)
+	{
+		Clear();
+		CreateDepthBuffer();
+	}
+
+	if ((int)Layers.size() == MaxLayers)
+	{
+		auto oldest = Layers.begin();
+		for (auto it = Layers.begin(); it != Layers.end(); ++it)
+		{
+			if (it->second.LastUsed < oldest->second.LastUsed)
+				oldest = it;
+		}
+		DestroyLayer(oldest->second);
+		Layers.erase(oldest);
+	}
+
+	Layer layer;
+	layer.DescriptorSet = renderer->DescriptorSets->AllocateTileLayerSet();
+	if (!layer.DescriptorSet)
+		return nullptr;
+
+	auto device = renderer->Device.get();
+	VkFormat format = renderer->Commands->SwapChain->Format().format;
+	layer.X = x;
+	layer.Y = y;
+	layer.Width = width;
+	layer.Height = height;
+
+	layer.Image = ImageBuilder()
+		.Size(width, height)
+		.Format(format)
+		.Usage(VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT)
+		.DebugName("TileLayer")
+		.Create(device);
+
+	layer.View = ImageViewBuilder()
+		.Image(layer.Image.get(), format)
+		.DebugName("TileLayerView")
+		.Create(device);
+
+	layer.Framebuffer = FramebufferBuilder()
+		.RenderPass(renderer->RenderPasses->Scene.TileLayerRenderPass.get())
+		.Size(width, height)
+		.AddAttachment(layer.View.get())
+		.AddAttachment(DepthBufferView.get())
+		.DebugName("TileLayerFramebuffer")
+		.Create(device);
+
+	WriteDescriptors()
+		.AddCombinedImageSampler(layer.DescriptorSet.get(), 0, layer.View.get(), Sampler.get(), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
+		.Execute(device);
+
+	// The run gets rendered into the layer in between two halves of the
+	// scene pass, with the same pipeline and with the viewport moved so
+	// that the layer's corner is at (0, 0).
+	renderer->RenderPasses->EndScene(cmdbuffer);
+
+	RenderPassBegin()
+		.RenderPass(renderer->RenderPasses->Scene.TileLayerRenderPass.get())
+		.Framebuffer(layer.Framebuffer.get())
+		.RenderArea(0, 0, width, height)
+		.AddClearColor(0.0f, 0.0f, 0.0f, 0.0f)
+		.AddClearDepthStencil(1.0f, 0)
+		.Execute(cmdbuffer);
+
+	VkViewport layerViewport = viewport;
+	layerViewport.x -= x;
+	layerViewport.y -= y;
+	cmdbuffer->setViewport(0, 1, &layerViewport);
+
+	auto sceneLayout = renderer->RenderPasses->Scene.BindlessPipelineLayout.get();
+	cmdbuffer->bindPipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, run.Pipeline);
+	cmdbuffer->pushConstants(sceneLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(ScenePushConstants), &pushconstants);
+	cmdbuffer->draw(6, run.NumInstances, 0, run.FirstInstance);
+	cmdbuffer->endRenderPass();
+
+	PipelineBarrier()
+		.AddImage(
+			layer.Image.get(),
+			VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+			VK_ACCESS_SHADER_READ_BIT)
+		.Execute(cmdbuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+
+	// the vertex & index buffer bindings survive this, the viewport doesn't
+	renderer->RenderPasses->ResumeScene(cmdbuffer, VK_SUBPASS_CONTENTS_INLINE);
+	cmdbuffer->setViewport(0, 1, &viewport);
+
+	return &(Layers[run.Hash] = std::move(layer));
+}
+
+void TileLayerCache::DestroyLayer(Layer& layer)
+{
+	// the GPU may still be drawing it
+	auto& deletes = renderer->Commands->GetFrameDeleteList();
+	deletes.framebuffers.push_back(std::move(layer.Framebuffer));
+	deletes.imageViews.push_back(std::move(layer.View));
+	deletes.images.push_back(std::move(layer.Image));
+	deletes.descriptors.push_back(std::move(layer.DescriptorSet));
+}
+
+void TileLayerCache::CreateDepthBuffer()
+{
+	if (DepthBuffer)
+	{
+		auto& deletes = renderer->Commands->GetFrameDeleteList();
+		deletes.imageViews.push_back(std::move(DepthBufferView));
+		deletes.images.push_back(std::move(DepthBuffer));
+	}
+
+	DepthBufferWidth = renderer->Textures->Scene->Width;
+	DepthBufferHeight = renderer->Textures->Scene->Height;
+
+	DepthBuffer = ImageBuilder()
+		.Size(DepthBufferWidth, DepthBufferHeight)
+		.Format(VK_FORMAT_D32_SFLOAT)
+		.Usage(VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT)
+		.DebugName("TileLayerDepthBuffer")
+		.Create(renderer->Device.get());
+
+	DepthBufferView = ImageViewBuilder()
+		.Image(DepthBuffer.get(), VK_FORMAT_D32_SFLOAT, VK_IMAGE_ASPECT_DEPTH_BIT)
+		.DebugName("TileLayerDepthBufferView")
+		.Create(renderer->Device.get());
+}
+
+void TileLayerCache::NextFrame()
+{
+	Frame++;
+	NewLayers = 0;
+
+	for (auto it = Layers.begin(); it != Layers.end();)
+	{
+		if (it->second.LastUsed + MaxUnusedFrames < Frame)
+		{
+			DestroyLayer(it->second);
+			it = Layers.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	// only what was drawn in the frame that just ended can still get a layer
+	for (auto it = Candidates.begin(); it != Candidates.end();)
+	{
+		if (it->second + 1 < Frame)
+			it = Candidates.erase(it);
+		else
+			++it;
+	}
+}
+
+void TileLayerCache::Clear()
+{
+	for (auto& it : Layers)
+		DestroyLayer(it.second);
+	Layers.clear();
+	Candidates.clear();
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "ShaderManager.h"
+#include <unordered_map>
+
+class UVulkanRenderDevice;
+
+// A run of tiles that DrawBatch is about to draw with one instanced draw
+struct TileRun
+{
+	VulkanPipeline* Pipeline = nullptr;
+	uint32_t FirstInstance = 0;
+	uint32_t NumInstances = 0;
+	uint64_t Hash = 0;
+	vec4 Bounds; // X0, Y0, X1, Y1 in pixels of the scene viewport
+};
+
+// Menus, the inventory, conversations and datacubes draw the same tiles
+// frame after frame. When a run of tiles is exactly the same as in the
+// frame before, this renders it once into an image of its own (a layer)
+// and from then on draws that image with a single quad for as long as the
+// run stays the same. Everything in here belongs to the replay.
+class TileLayerCache
+{
+public:
+	TileLayerCache(UVulkanRenderDevice* renderer);
+	~TileLayerCache();
+
+	static const int MaxLayers = 16;
+	// Runs with fewer tiles aren't worth a layer
+	static const uint32_t MinTiles = 16;
+	// Caps how many layers one frame renders
+	static const int MaxNewLayersPerFrame = 2;
+	// Layers that went unused for this many frames get dropped
+	static const int MaxUnusedFrames = 60;
+
+	// The hash of a run covers its pipeline, its transform & viewport and
+	// then each of its tiles. Anything that changes any of those makes it
+	// a different run, which won't find the old layer.
+	static uint64_t BeginRunHash(VulkanPipeline* pipeline, const ScenePushConstants& pushconstants, const VkViewport& viewport);
+	static uint64_t HashTile(uint64_t hash, const SceneTileInstance& tile);
+
+	// Draws the run from its layer, rendering the layer first if the run
+	// was also drawn the frame before. Returns false if the run has to be
+	// drawn as is.
+	bool Draw(VulkanCommandBuffer* cmdbuffer, const TileRun& run, const ScenePushConstants& pushconstants, const VkViewport& viewport);
+
+	// Once per presented frame
+	void NextFrame();
+
+	// Drops all layers, for when something that isn't part of the hash
+	// changed: texture contents, the swap chain or the scene size.
+	void Clear();
+
+private:
+	struct Layer
+	{
+		std::unique_ptr<VulkanImage> Image;
+		std::unique_ptr<VulkanImageView> View;
+		std::unique_ptr<VulkanFramebuffer> Framebuffer;
+		std::unique_ptr<VulkanDescriptorSet> DescriptorSet;
+		// where it goes, in framebuffer pixels
+		int X = 0;
+		int Y = 0;
+		int Width = 0;
+		int Height = 0;
+		uint64_t LastUsed = 0;
+	};
+
+	Layer* CreateLayer(VulkanCommandBuffer* cmdbuffer, const TileRun& run, const ScenePushConstants& pushconstants, const VkViewport& viewport, int x, int y, int width, int height);
+	void DestroyLayer(Layer& layer);
+	void CreateDepthBuffer();
+
+	UVulkanRenderDevice* renderer = nullptr;
+
+	std::unordered_map<uint64_t, Layer> Layers;
+	// runs without a layer, and the frame they were last drawn in
+	std::unordered_map<uint64_t, uint64_t> Candidates;
+	uint64_t Frame = 0;
+	int NewLayers = 0;
+
+	// Shared by all layers, as big as the scene
+	std::unique_ptr<VulkanImage> DepthBuffer;
+	std::unique_ptr<VulkanImageView> DepthBufferView;
+	int DepthBufferWidth = 0;
+	int DepthBufferHeight = 0;
+
+	std::unique_ptr<VulkanSampler> Sampler;
+};
@@ -3,7 +3,9 @@
 #include "UVulkanRenderDevice.h"
 #include "CachedTexture.h"
 #include "UTF16.h"
+#include "halffloat.h"
 #include "gltf.h"
+#include <emmintrin.h>
 
 IMPLEMENT_CLASS(UVulkanRenderDevice);
 
@@ -56,11 +58,18 @@ void UVulkanRenderDevice::StaticConstructor()
 	BloomAmount = 128;
 
 	LODBias = -0.5f;
+	LineWidth = 1.0f;
 	LightMode = 0;
 
 	VkDeviceIndex = 0;
+	VkFramesInFlight = 2;
 	VkDebug = 0;
 	VkExclusiveFullscreen = 0;
+	VkMeshShaders = 1;
+	VkParallelRecording = 1;
+	VkParallelPipelines = 1;
+	VkSpecializedShaders = 1;
+	VkRenderThread = 0;
 
 #if defined(OLDUNREAL469SDK)
 	new(GetClass(), TEXT("UseLightmapAtlas"), RF_Public) UBoolProperty(CPP_PROPERTY(UseLightmapAtlas), TEXT("Display"), CPF_Config);
@@ -81,6 +90,7 @@ void UVulkanRenderDevice::StaticConstructor()
 	new(GetClass(), TEXT("Bloom"), RF_Public) UBoolProperty(CPP_PROPERTY(Bloom), TEXT("Display"), CPF_Config);
 	new(GetClass(), TEXT("BloomAmount"), RF_Public) UByteProperty(CPP_PROPERTY(BloomAmount), TEXT("Display"), CPF_Config);
 	new(GetClass(), TEXT("LODBias"), RF_Public) UFloatProperty(CPP_PROPERTY(LODBias), TEXT("Display"), CPF_Config);
+	new(GetClass(), TEXT("LineWidth"), RF_Public) UFloatProperty(CPP_PROPERTY(LineWidth), TEXT("Display"), CPF_Config);
 
 	UEnum* AntialiasModes = new(GetClass(), TEXT("AntialiasModes"))UEnum(nullptr);
 	new(AntialiasModes->Names)FName(TEXT("Off"));
@@ -100,8 +110,14 @@ void UVulkanRenderDevice::StaticConstructor()
 	new(GetClass(), TEXT("LightMode"), RF_Public) UByteProperty(CPP_PROPERTY(LightMode), TEXT("Display"), CPF_Config, LightModes);
 
 	new(GetClass(), TEXT("VkDeviceIndex"), RF_Public) UIntProperty(CPP_PROPERTY(VkDeviceIndex), TEXT("Display"), CPF_Config);
+	new(GetClass(), TEXT("VkFramesInFlight"), RF_Public) UIntProperty(CPP_PROPERTY(VkFramesInFlight), TEXT("Display"), CPF_Config);
 	new(GetClass(), TEXT("VkDebug"), RF_Public) UBoolProperty(CPP_PROPERTY(VkDebug), TEXT("Display"), CPF_Config);
 	new(GetClass(), TEXT("VkExclusiveFullscreen"), RF_Public) UBoolProperty(CPP_PROPERTY(VkExclusiveFullscreen), TEXT("Display"), CPF_Config);
+	new(GetClass(), TEXT("VkMeshShaders"), RF_Public) UBoolProperty(CPP_PROPERTY(VkMeshShaders), TEXT("Display"), CPF_Config);
+	new(GetClass(), TEXT("VkParallelRecording"), RF_Public) UBoolProperty(CPP_PROPERTY(VkParallelRecording), TEXT("Display"), CPF_Config);
+	new(GetClass(), TEXT("VkParallelPipelines"), RF_Public) UBoolProperty(CPP_PROPERTY(VkParallelPipelines), TEXT("Display"), CPF_Config);
+	new(GetClass(), TEXT("VkSpecializedShaders"), RF_Public) UBoolProperty(CPP_PROPERTY(VkSpecializedShaders), TEXT("Display"), CPF_Config);
+	new(GetClass(), TEXT("VkRenderThread"), RF_Public) UBoolProperty(CPP_PROPERTY(VkRenderThread), TEXT("Display"), CPF_Config);
 
 	unguard;
 }
@@ -136,6 +152,8 @@ UBOOL UVulkanRenderDevice::Init(UViewport* InViewport, INT NewX, INT NewY, INT N
 		Device = VulkanDeviceBuilder()
 			.Surface(surface)
 			.OptionalDescriptorIndexing()
+			.OptionalMeshShader()
+			.OptionalTimelineSemaphore()
 			.RequireExtension(VK_KHR_SAMPLER_MIRROR_CLAMP_TO_EDGE_EXTENSION_NAME)
 			.RequireExtension(VK_KHR_8BIT_STORAGE_EXTENSION_NAME)
 			.SelectDevice(VkDeviceIndex)
@@ -152,8 +170,30 @@ UBOOL UVulkanRenderDevice::Init(UViewport* InViewport, INT NewX, INT NewY, INT N
 		if (!Device->EnabledFeatures._8BitStorage.storageBuffer8BitAccess)
 			throw std::runtime_error("8-bit storage not supported");
 
+		if (!Device->EnabledFeatures.TimelineSemaphore.timelineSemaphore)
+			throw std::runtime_error("Timeline semaphores not supported");
+
+		// the meshlets are built with at most 64 verts & 124 triangles,
+		// the task & mesh shaders both run 32 invocations per workgroup
+		auto& meshShaderProps = Device->PhysicalDevice.Properties.MeshShader;
+		SupportsMeshShaders = VkMeshShaders &&
+			Device->EnabledFeatures.MeshShader.taskShader &&
+			Device->EnabledFeatures.MeshShader.meshShader &&
+			meshShaderProps.maxMeshOutputVertices >= 64 &&
+			meshShaderProps.maxMeshOutputPrimitives >= 124 &&
+			meshShaderProps.maxTaskWorkGroupSize[0] >= 32 &&
+			meshShaderProps.maxMeshWorkGroupSize[0] >= 32 &&
+			meshShaderProps.maxTaskOutputCount >= 32;
+		debugf(TEXT("Vulkan: Drawing meshlets with %s"), SupportsMeshShaders ? TEXT("task & mesh shaders") : TEXT("vertex shaders"));
+
 		debugf(TEXT("CommandBufferManager"));
-		Commands.reset(new CommandBufferManager(this));
+		Commands.reset(new CommandBufferManager(this, Clamp(VkFramesInFlight, 1, CommandBufferManager::MaxFramesInFlight)));
+		debugf(TEXT("Vulkan: %d frames in flight"), Commands->GetFramesInFlight());
+		debugf(TEXT("Vulkan: Queue families: graphics %d, transfer %d%s, compute %d%s"),
+			Device->GraphicsFamily,
+			Device->TransferFamily, Commands->HasTransferQueue() ? TEXT(" (dedicated)") : TEXT(""),
+			Device->ComputeFamily, Commands->HasComputeQueue() ? TEXT(" (async)") : TEXT(""));
+		Workers.reset(new WorkerPool(Clamp((int)std::thread::hardware_concurrency(), 1, CommandBufferManager::MaxRecordingThreads)));
 		debugf(TEXT("SamplerManager"));
 		Samplers.reset(new SamplerManager(this));
 		debugf(TEXT("TextureManager"));
@@ -170,6 +210,10 @@ UBOOL UVulkanRenderDevice::Init(UViewport* InViewport, INT NewX, INT NewY, INT N
 		RenderPasses.reset(new RenderPassManager(this));
 		debugf(TEXT("FramebufferManager"));
 		Framebuffers.reset(new FramebufferManager(this));
+		debugf(TEXT("TileLayerCache"));
+		TileLayers.reset(new TileLayerCache(this));
+		RenderCommands.reset(new RenderThread(VkRenderThread, [this](CommandStream& stream) { ReplayCommands(stream); }));
+		debugf(TEXT("Vulkan: Replaying draw calls %s"), RenderCommands->IsThreaded() ? TEXT("on a render thread") : TEXT("at the end of the frame"));
 
 		const auto& props = Device->PhysicalDevice.Properties.Properties;
 
@@ -230,6 +274,9 @@ UBOOL UVulkanRenderDevice::SetRes(INT NewX, INT NewY, INT NewColorBytes, UBOOL F
 	if (NewX == 0 || NewY == 0)
 		return 1;
 
+	// the render thread might still be presenting to the old window
+	RenderCommands->Sync();
+
 	if (!Viewport->ResizeViewport(Fullscreen ? (BLIT_Fullscreen | BLIT_OpenGL) : (BLIT_HardwarePaint | BLIT_OpenGL), NewX, NewY, NewColorBytes))
 		return 0;
 
@@ -262,6 +309,9 @@ void UVulkanRenderDevice::Exit()
 {
 	guard(UVulkanRenderDevice::Exit);
 
+	// replays what's left, then stops the render thread
+	RenderCommands.reset();
+
 	if (Device) vkDeviceWaitIdle(Device->device);
 
 #ifdef USE_HORRIBLE_WIN32_MODE_SWITCHES
@@ -269,6 +319,9 @@ void UVulkanRenderDevice::Exit()
 #endif
 
 	last_scene.reset();
+	Workers.reset();
+	TileLayers.reset();
+	if (Commands) Commands->DeleteAllFrameObjects();
 	Framebuffers.reset();
 	RenderPasses.reset();
 	DescriptorSets.reset();
@@ -284,18 +337,161 @@ void UVulkanRenderDevice::Exit()
 	unguard;
 }
 
-void UVulkanRenderDevice::SubmitAndWait(bool present, int presentWidth, int presentHeight, bool presentFullscreen)
+// Doesn't wait for the GPU, the next frame goes into the next frame
+// context. Whatever records into it has to call Commands->BeginFrame
+// first (or get it called through Commands->GetDrawCommands).
+void UVulkanRenderDevice::SubmitFrame(bool present, int presentWidth, int presentHeight, bool presentFullscreen)
 {
-	if (Device) vkDeviceWaitIdle(Device->device);
 	//DescriptorSets->UpdateBindlessSet();
 
+	// the scene vertices were written with streaming stores, see WriteSceneVertices
+	_mm_sfence();
 	Commands->SubmitCommands(present, presentWidth, presentHeight, presentFullscreen);
+	Uploads->SubmittedFrame(Commands->Graphics.GetLastSubmitted());
+	Buffers->EndSceneFrame(SceneVertexPos, SceneIndexPos);
 
 	Batch.Pipeline = nullptr;
 	//Batch.DescriptorSet = nullptr;
 	Batch.SceneIndexStart = 0;
+	Batch.TileInstances = 0;
 	SceneVertexPos = 0;
 	SceneIndexPos = 0;
+	Buffers->SetFrame(Commands->GetFrameIndex());
+}
+
+// What the entry points below record into RenderCommands, see
+// ReplayCommands. Nothing in here may point at engine memory: the replay
+// can run a frame later, and by then the engine may have freed or reused
+// whatever FSceneNode, FTextureInfo or texture data it was called with.
+// So the commands carry copies of the few values they need, and the calls
+// that need the texture data itself (UpdateTextureRect, and Flush when
+// textures go away) sync with the render thread and do their work on the
+// game thread while the engine still vouches for that memory.
+enum class RenderCommand : uint32_t
+{
+	Lock,
+	Unlock,
+	Flush,
+	SetViewport,
+	SetTransform,
+	ClearZ,
+	DrawFans,
+	DrawLine,
+	DrawPoint,
+	DrawTile,
+};
+
+struct LockCommand
+{
+	FPlane ScreenClear;
+	int Width;
+	int Height;
+	bool Fullscreen;
+	float LineWidth;
+};
+
+struct UnlockCommand
+{
+	bool Present;
+	int Width;
+	int Height;
+	bool Fullscreen;
+};
+
+struct SetViewportCommand
+{
+	VkViewport Viewport;
+};
+
+struct SetTransformCommand
+{
+	mat4 ObjectToProjection;
+	vec4 NearClip;
+	vec4 TileTransform;
+};
+
+// triangle fans, followed by the vertices in the pipeline's format & then
+// the vertex count of each fan
+struct DrawFansCommand
+{
+	uint32_t PipelineKey;
+	SceneVertexFormat Format;
+	uint32_t NumVertices;
+	uint32_t NumFans;
+
+	uint8_t* Vertices() { return reinterpret_cast<uint8_t*>(this + 1); }
+	const uint8_t* Vertices() const { return reinterpret_cast<const uint8_t*>(this + 1); }
+	uint32_t* FanSizes() { return reinterpret_cast<uint32_t*>(Vertices() + NumVertices * GetSceneVertexStride(Format)); }
+	const uint32_t* FanSizes() const { return reinterpret_cast<const uint32_t*>(Vertices() + NumVertices * GetSceneVertexStride(Format)); }
+};
+
+// Lines & points go into LineBatch. Occlude is OccludeLines at the time.
+struct DrawLineCommand
+{
+	bool Occlude;
+	SceneTileVertex Vertices[2];
+};
+
+struct DrawPointCommand
+{
+	bool Occlude;
+	SceneTileVertex Vertices[4];
+};
+
+struct DrawTileCommand
+{
+	uint32_t PipelineKey;
+	float Z;
+	SceneTileInstance Tile;
+};
+
+static void pushCommand(RenderThread* thread, RenderCommand type)
+{
+	thread->GetStream().Push(static_cast<uint32_t>(type), 0);
+}
+
+template<typename T>
+static T* pushCommand(RenderThread* thread, RenderCommand type, size_t extraSize = 0)
+{
+	return thread->GetStream().Push<T>(static_cast<uint32_t>(type), extraSize);
+}
+
+// The vertex type has to match what the pipeline was created for.
+template<typename T>
+static DrawFansCommand* pushDrawFans(RenderThread* thread, uint32_t pipelineKey, uint32_t numVertices, uint32_t numFans)
+{
+	auto cmd = pushCommand<DrawFansCommand>(thread, RenderCommand::DrawFans, numVertices * sizeof(T) + numFans * sizeof(uint32_t));
+	cmd->PipelineKey = pipelineKey;
+	cmd->Format = SceneVertexFormatOf<T>::Value;
+	cmd->NumVertices = numVertices;
+	cmd->NumFans = numFans;
+	return cmd;
+}
+
+// returns where the fan's vertices go
+template<typename T>
+static T* pushDrawFan(RenderThread* thread, uint32_t pipelineKey, uint32_t numVertices)
+{
+	auto cmd = pushDrawFans<T>(thread, pipelineKey, numVertices, 1);
+	cmd->FanSizes()[0] = numVertices;
+	return reinterpret_cast<T*>(cmd->Vertices());
+}
+
+// R8G8B8A8_UNORM, as the compact vertices take it
+static uint32_t packColor(float r, float g, float b, float a)
+{
+	auto unorm = [](float v) { return (uint32_t)(Clamp(v, 0.0f, 1.0f) * 255.0f + 0.5f); };
+	return unorm(r) | (unorm(g) << 8) | (unorm(b) << 16) | (unorm(a) << 24);
+}
+
+static uint32_t packColor(const vec4& color)
+{
+	return packColor(color.r, color.g, color.b, color.a);
+}
+
+static SceneTileVertex tileVertex(const vec3& position, float u, float v, uint32_t color)
+{
+	return { position, { floatToHalf(u), floatToHalf(v) }, color };
 }
 
 #if defined(UNREALGOLD)
@@ -304,26 +500,19 @@ void UVulkanRenderDevice::Flush()
 {
 	guard(UVulkanRenderDevice::Flush);
 
-	if (IsLocked)
+	// The engine flushes when textures go away, nothing may be left that
+	// still draws with them. The stream doesn't exist yet during startup.
+	if (RenderCommands)
 	{
-		DrawBatch(Commands->GetDrawCommands());
-		RenderPasses->EndScene(Commands->GetDrawCommands());
-		SubmitAndWait(false, 0, 0, false);
+		if (IsLocked)
+			pushCommand(RenderCommands.get(), RenderCommand::Flush);
+		RenderCommands->Sync();
+	}
 
-		ClearTextureCache();
+	if (TileLayers)
+		TileLayers->Clear();
 
-		auto cmdbuffer = Commands->GetDrawCommands();
-		RenderPasses->BeginScene(cmdbuffer, 0.0f, 0.0f, 0.0f, 1.0f);
-
-		VkBuffer vertexBuffers[] = { Buffers->SceneVertexBuffer->buffer };
-		VkDeviceSize offsets[] = { 0 };
-		cmdbuffer->bindVertexBuffers(0, 1, vertexBuffers, offsets);
-		cmdbuffer->bindIndexBuffer(Buffers->SceneIndexBuffer->buffer, 0, VK_INDEX_TYPE_UINT32);
-	}
-	else
-	{
-		ClearTextureCache();
-	}
+	ClearTextureCache();
 
 	if (UsePrecache && !GIsEditor)
 		PrecacheOnFlip = 1;
@@ -338,26 +527,19 @@ void UVulkanRenderDevice::Flush(UBOOL AllowPrecache)
 	guard(UVulkanRenderDevice::Flush);
 	debugf(TEXT("Flush!"));
 
-	if (IsLocked)
+	// The engine flushes when textures go away, nothing may be left that
+	// still draws with them. The stream doesn't exist yet during startup.
+	if (RenderCommands)
 	{
-		DrawBatch(Commands->GetDrawCommands());
-		RenderPasses->EndScene(Commands->GetDrawCommands());
-		SubmitAndWait(false, 0, 0, false);
-
-		//ClearTextureCache();
+		if (IsLocked)
+			pushCommand(RenderCommands.get(), RenderCommand::Flush);
+		RenderCommands->Sync();
+	}
 
-		auto cmdbuffer = Commands->GetDrawCommands();
-		RenderPasses->BeginScene(cmdbuffer, 0.0f, 0.0f, 0.0f, 1.0f);
+	if (TileLayers)
+		TileLayers->Clear();
 
-		VkBuffer vertexBuffers[] = { Buffers->SceneVertexBuffer->buffer };
-		VkDeviceSize offsets[] = { 0 };
-		cmdbuffer->bindVertexBuffers(0, 1, vertexBuffers, offsets);
-		cmdbuffer->bindIndexBuffer(Buffers->SceneIndexBuffer->buffer, 0, VK_INDEX_TYPE_UINT32);
-	}
-	else
-	{
-		//ClearTextureCache();
-	}
+	//ClearTextureCache();
 
 	if (AllowPrecache && UsePrecache && !GIsEditor)
 		PrecacheOnFlip = 1;
@@ -455,6 +637,13 @@ UBOOL UVulkanRenderDevice::Exec(const TCHAR* Cmd, FOutputDevice& Ar)
 		Ar.Log(*Str.LeftChop(1));
 		return 1;
 	}
+	else if (ParseCommand(&Cmd, TEXT("VkLineStress")))
+	{
+		// VkLineStress [count], no count or 0 turns it off
+		LineStress = Max(appAtoi(Cmd), 0);
+		Ar.Log(FString::Printf(TEXT("Drawing %d extra lines each frame"), LineStress));
+		return 1;
+	}
 	else if (ParseCommand(&Cmd, TEXT("GetVkDevices")))
 	{
 		std::vector<VulkanCompatibleDevice> supportedDevices = VulkanDeviceBuilder()
@@ -484,7 +673,6 @@ UBOOL UVulkanRenderDevice::Exec(const TCHAR* Cmd, FOutputDevice& Ar)
 void UVulkanRenderDevice::Lock(FPlane InFlashScale, FPlane InFlashFog, FPlane ScreenClear, DWORD RenderLockFlags, BYTE* InHitData, INT* InHitSize)
 {
 	guard(UVulkanRenderDevice::Lock);
-	vkDeviceWaitIdle(Device->device);
 	//debugf(TEXT("Lock!"));
 
 	//HitData = InHitData;
@@ -493,20 +681,38 @@ void UVulkanRenderDevice::Lock(FPlane InFlashScale, FPlane InFlashFog, FPlane Sc
 	FlashScale = InFlashScale;
 	FlashFog = InFlashFog;
 
+	auto cmd = pushCommand<LockCommand>(RenderCommands.get(), RenderCommand::Lock);
+	cmd->ScreenClear = ScreenClear;
+	cmd->Width = Viewport->SizeX;
+	cmd->Height = Viewport->SizeY;
+	cmd->Fullscreen = Viewport->IsFullscreen();
+	cmd->LineWidth = LineWidth;
+
+	IsLocked = true;
+
+	unguard;
+}
+
+void UVulkanRenderDevice::LockScene(const FPlane& screenClear, int width, int height, bool fullscreen)
+{
+	// only waits for the frame that last used this frame context
+	Commands->BeginFrame();
+
 	pushconstants.hitIndex = 0;
 	//ForceHitIndex = -1;
 
 	try
 	{
 		// If frame textures no longer match the window or user settings, recreate them along with the swap chain
-		if (!Textures->Scene || Textures->Scene->Width != Viewport->SizeX || Textures->Scene->Height != Viewport->SizeY || Textures->Scene->Multisample != GetSettingsMultisample())
+		if (!Textures->Scene || Textures->Scene->Width != width || Textures->Scene->Height != height || Textures->Scene->Multisample != GetSettingsMultisample())
 		{
-			debugf(TEXT("need to recreate frame texture & swap chain, width: %d, height: %d"), Viewport->SizeX, Viewport->SizeY);
+			debugf(TEXT("need to recreate frame texture & swap chain, width: %d, height: %d"), width, height);
 			//Framebuffers->DestroySceneFramebuffer();
 			debugf(TEXT("Reset scene texture"));
+			Commands->WaitForAllFrames();
 			Textures->Scene.reset();
 			debugf(TEXT("Set scene texture"));
-			Textures->Scene.reset(new SceneTextures(this, Viewport->SizeX, Viewport->SizeY, GetSettingsMultisample()));
+			Textures->Scene.reset(new SceneTextures(this, width, height, GetSettingsMultisample()));
 			//debugf(TEXT("CreateRenderPass"));
 			//RenderPasses->CreateRenderPass();
 			//debugf(TEXT("CreatePipelines"));
@@ -536,15 +742,10 @@ void UVulkanRenderDevice::Lock(FPlane InFlashScale, FPlane InFlashFog, FPlane Sc
 			//.Execute(Commands->GetDrawCommands(), VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
 
 		auto cmdbuffer = Commands->GetDrawCommands();
-		Commands->AcquirePresentImage(Viewport->SizeX, Viewport->SizeY, Viewport->IsFullscreen());
-		RenderPasses->BeginScene(cmdbuffer, ScreenClear.X, ScreenClear.Y, ScreenClear.Z, ScreenClear.W);
-
-		VkBuffer vertexBuffers[] = { Buffers->SceneVertexBuffer->buffer };
-		VkDeviceSize offsets[] = { 0 };
-		cmdbuffer->bindVertexBuffers(0, 1, vertexBuffers, offsets);
-		cmdbuffer->bindIndexBuffer(Buffers->SceneIndexBuffer->buffer, 0, VK_INDEX_TYPE_UINT32);
+		Commands->AcquirePresentImage(width, height, fullscreen);
+		RenderPasses->BeginScene(cmdbuffer, screenClear.X, screenClear.Y, screenClear.Z, screenClear.W);
 
-		IsLocked = true;
+		BindSceneBuffers(cmdbuffer);
 	}
 	catch (const std::exception& e)
 	{
@@ -552,8 +753,6 @@ void UVulkanRenderDevice::Lock(FPlane InFlashScale, FPlane InFlashFog, FPlane Sc
 		MessageBoxA(0, e.what(), "Vulkan Error", MB_OK);
 		exit(0);
 	}
-
-	unguard;
 }
 
 void UVulkanRenderDevice::DrawStats(FSceneNode* Frame)
@@ -561,7 +760,14 @@ void UVulkanRenderDevice::DrawStats(FSceneNode* Frame)
 	Super::DrawStats(Frame);
 
 #if defined(OLDUNREAL469SDK)
-	GRender->ShowStat(CurrentFrame, TEXT("Vulkan: Draw calls: %d, Complex surfaces: %d, Gouraud polygons: %d, Tiles: %d; Uploads: %d, Rect Uploads: %d\r\n"), Stats.DrawCalls, Stats.ComplexSurfaces, Stats.GouraudPolygons, Stats.Tiles, Stats.Uploads, Stats.RectUploads);
+	GRender->ShowStat(CurrentFrame, TEXT("Vulkan: Draw calls: %d, Complex surfaces: %d, Gouraud polygons: %d, Tiles: %d; Uploads: %d, Rect Uploads: %d\r\n"), Stats.DrawCalls.load(), Stats.ComplexSurfaces, Stats.GouraudPolygons, Stats.Tiles, Stats.Uploads, Stats.RectUploads);
+	GRender->ShowStat(CurrentFrame, TEXT("Vulkan: Objects: %d, Dirty objects: %d; Actors: %d, Baked actors: %d\r\n"), Stats.Objects, Stats.DirtyObjects, Stats.Actors, Stats.BakedActors);
+	GRender->ShowStat(CurrentFrame, TEXT("Vulkan: Object draws: %d for %d instances\r\n"), Stats.ObjectDraws, Stats.ObjectInstances);
+	GRender->ShowStat(CurrentFrame, TEXT("Vulkan: Scene page switches: %d; High water: %d KB of vertices, %d indices\r\n"), Stats.ScenePageSwitches.load(), (int)(Buffers->SceneVertexHighWater / 1024), (int)Buffers->SceneIndexHighWater);
+	GRender->ShowStat(CurrentFrame, TEXT("Vulkan: Tiles: %d in %d draws\r\n"), Stats.Tiles, Stats.TileDraws.load());
+	int tileLayerRuns = Stats.TileLayerRuns.load();
+	GRender->ShowStat(CurrentFrame, TEXT("Vulkan: Tile layers: %d of %d cacheable runs hit (%d%%), %d new\r\n"), Stats.TileLayerHits.load(), tileLayerRuns, tileLayerRuns ? Stats.TileLayerHits.load() * 100 / tileLayerRuns : 0, Stats.TileLayersCreated.load());
+	GRender->ShowStat(CurrentFrame, TEXT("Vulkan: Lines: %d, Points: %d in %d draws\r\n"), Stats.Lines, Stats.Points, Stats.LineDraws.load());
 #endif
 
 	Stats.DrawCalls = 0;
@@ -570,6 +776,20 @@ void UVulkanRenderDevice::DrawStats(FSceneNode* Frame)
 	Stats.Tiles = 0;
 	Stats.Uploads = 0;
 	Stats.RectUploads = 0;
+	Stats.Objects = 0;
+	Stats.DirtyObjects = 0;
+	Stats.Actors = 0;
+	Stats.BakedActors = 0;
+	Stats.ObjectDraws = 0;
+	Stats.ObjectInstances = 0;
+	Stats.ScenePageSwitches = 0;
+	Stats.TileDraws = 0;
+	Stats.TileLayerRuns = 0;
+	Stats.TileLayerHits = 0;
+	Stats.TileLayersCreated = 0;
+	Stats.Lines = 0;
+	Stats.Points = 0;
+	Stats.LineDraws = 0;
 }
 
 void UVulkanRenderDevice::Unlock(UBOOL Blit)
@@ -578,10 +798,15 @@ void UVulkanRenderDevice::Unlock(UBOOL Blit)
 
 	try
 	{
-		DrawBatch(Commands->GetDrawCommands());
-		RenderPasses->EndScene(Commands->GetDrawCommands());
-		SubmitAndWait(Blit ? true : false, Viewport->SizeX, Viewport->SizeY, Viewport->IsFullscreen());
+		auto cmd = pushCommand<UnlockCommand>(RenderCommands.get(), RenderCommand::Unlock);
+		cmd->Present = Blit ? true : false;
+		cmd->Width = Viewport->SizeX;
+		cmd->Height = Viewport->SizeY;
+		cmd->Fullscreen = Viewport->IsFullscreen();
 		IsLocked = false;
+
+		// the render thread gets to this frame while the game ticks the next one
+		RenderCommands->Kick();
 	}
 	catch (std::exception& e)
 	{
@@ -595,6 +820,14 @@ void UVulkanRenderDevice::Unlock(UBOOL Blit)
 	unguard;
 }
 
+void UVulkanRenderDevice::UnlockScene(bool present, int width, int height, bool fullscreen)
+{
+	DrawLineBatch(Commands->GetDrawCommands());
+	RenderPasses->EndScene(Commands->GetDrawCommands());
+	SubmitFrame(present, width, height, fullscreen);
+	TileLayers->NextFrame();
+}
+
 #if defined(OLDUNREAL469SDK)
 
 UBOOL UVulkanRenderDevice::SupportsTextureFormat(ETextureFormat Format)
@@ -610,8 +843,13 @@ void UVulkanRenderDevice::UpdateTextureRect(FTextureInfo& Info, INT U, INT V, IN
 {
 	guardSlow(UVulkanRenderDevice::UpdateTextureRect);
 
+	// Info's texture data is only good for the duration of this call
+	RenderCommands->Sync();
 	Textures->UpdateTextureRect(&Info, U, V, UL, VL);
 
+	// the cached tile layers may show the old texels
+	TileLayers->Clear();
+
 	unguardSlow;
 }
 
@@ -630,14 +868,306 @@ void UVulkanRenderDevice::DrawBatch(VulkanCommandBuffer* cmdbuffer)
 		Batch.SceneIndexStart = SceneIndexPos;
 		Stats.DrawCalls++;
 	}
+
+	if (Batch.TileInstances > 0)
+	{
+		TileRun run;
+		run.Pipeline = Batch.Pipeline;
+		run.FirstInstance = Batch.TileInstanceStart;
+		run.NumInstances = Batch.TileInstances;
+		run.Hash = Batch.TileHash;
+		run.Bounds = Batch.TileBounds;
+		if (!TileLayers->Draw(cmdbuffer, run, pushconstants, SceneViewport))
+		{
+			auto layout = RenderPasses->Scene.BindlessPipelineLayout.get();
+			cmdbuffer->bindPipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, Batch.Pipeline);
+			cmdbuffer->pushConstants(layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(ScenePushConstants), &pushconstants);
+			cmdbuffer->draw(6, Batch.TileInstances, 0, Batch.TileInstanceStart);
+		}
+		Batch.TileInstances = 0;
+		Stats.DrawCalls++;
+		Stats.TileDraws++;
+	}
+}
+
+// Runs on the render thread if there is one, hence no guards in here and
+// in what it calls.
+void UVulkanRenderDevice::ReplayCommands(CommandStream& stream)
+{
+	for (const uint8_t* pos = stream.Begin(); pos != stream.End();)
+	{
+		auto header = reinterpret_cast<const CommandStream::Header*>(pos);
+		const void* payload = header + 1;
+		switch (static_cast<RenderCommand>(header->Type))
+		{
+		case RenderCommand::Lock:
+		{
+			auto cmd = static_cast<const LockCommand*>(payload);
+			LineBatch.Width = cmd->LineWidth;
+			LockScene(cmd->ScreenClear, cmd->Width, cmd->Height, cmd->Fullscreen);
+			break;
+		}
+		case RenderCommand::Unlock:
+		{
+			auto cmd = static_cast<const UnlockCommand*>(payload);
+			UnlockScene(cmd->Present, cmd->Width, cmd->Height, cmd->Fullscreen);
+			break;
+		}
+		case RenderCommand::Flush:
+			RestartScene();
+			break;
+		case RenderCommand::SetViewport:
+		{
+			auto cmd = static_cast<const SetViewportCommand*>(payload);
+			auto commands = Commands->GetDrawCommands();
+			DrawLineBatch(commands);
+			commands->setViewport(0, 1, &cmd->Viewport);
+			SceneViewport = cmd->Viewport;
+			pushconstants.lineHalfWidth = vec2(LineBatch.Width / cmd->Viewport.width, LineBatch.Width / cmd->Viewport.height);
+			break;
+		}
+		case RenderCommand::SetTransform:
+		{
+			auto cmd = static_cast<const SetTransformCommand*>(payload);
+			DrawLineBatch(Commands->GetDrawCommands());
+			pushconstants.objectToProjection = cmd->ObjectToProjection;
+			pushconstants.nearClip = cmd->NearClip;
+			pushconstants.tileTransform = cmd->TileTransform;
+			break;
+		}
+		case RenderCommand::ClearZ:
+		{
+			DrawLineBatch(Commands->GetDrawCommands());
+
+			VkClearAttachment attachment = {};
+			VkClearRect rect = {};
+			attachment.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+			attachment.clearValue.depthStencil.depth = 1.0f;
+			rect.layerCount = 1;
+			rect.rect.extent.width = Textures->Scene->Width;
+			rect.rect.extent.height = Textures->Scene->Height;
+			Commands->GetDrawCommands()->clearAttachments(1, &attachment, 1, &rect);
+			break;
+		}
+		case RenderCommand::DrawFans:
+		{
+			auto cmd = static_cast<const DrawFansCommand*>(payload);
+			DrawFans(RenderPasses->GetScenePipeline(cmd->PipelineKey), cmd->Format, cmd->Vertices(), cmd->NumVertices, cmd->FanSizes(), cmd->NumFans);
+			break;
+		}
+		case RenderCommand::DrawLine:
+		{
+			auto cmd = static_cast<const DrawLineCommand*>(payload);
+			auto& lines = LineBatch.Lines[cmd->Occlude];
+			lines.insert(lines.end(), cmd->Vertices, cmd->Vertices + 2);
+			break;
+		}
+		case RenderCommand::DrawPoint:
+		{
+			auto cmd = static_cast<const DrawPointCommand*>(payload);
+			auto& points = LineBatch.Points[cmd->Occlude];
+			for (int i : { 0, 1, 2, 0, 2, 3 })
+				points.push_back(cmd->Vertices[i]);
+			break;
+		}
+		case RenderCommand::DrawTile:
+		{
+			auto cmd = static_cast<const DrawTileCommand*>(payload);
+			DrawTileInstance(RenderPasses->GetScenePipeline(cmd->PipelineKey), cmd->Z, cmd->Tile);
+			break;
+		}
+		}
+		pos += header->Size;
+	}
+}
+
+// submits what has been drawn so far and picks up in the next frame context
+void UVulkanRenderDevice::RestartScene()
+{
+	DrawLineBatch(Commands->GetDrawCommands());
+	RenderPasses->EndScene(Commands->GetDrawCommands());
+	SubmitFrame(false, 0, 0, false);
+
+	auto cmdbuffer = Commands->GetDrawCommands();
+	RenderPasses->BeginScene(cmdbuffer, 0.0f, 0.0f, 0.0f, 1.0f);
+	BindSceneBuffers(cmdbuffer);
+}
+
+void UVulkanRenderDevice::BindSceneBuffers(VulkanCommandBuffer* cmdbuffer)
+{
+	VkBuffer vertexBuffers[] = { Buffers->SceneVertexBuffer->buffer };
+	VkDeviceSize offsets[] = { 0 };
+	cmdbuffer->bindVertexBuffers(0, 1, vertexBuffers, offsets);
+	cmdbuffer->bindIndexBuffer(Buffers->SceneIndexBuffer->buffer, 0, VK_INDEX_TYPE_UINT32);
+}
+
+// Makes sure that a draw fits in what's left of the current scene page. If
+// it doesn't, the batch so far gets drawn from this page and the draw goes
+// into the next one. A heavy frame thus ends up on several pages rather
+// than writing past the end of one.
+void UVulkanRenderDevice::ReserveScene(SceneVertexFormat format, uint32_t numVertices, size_t numIndices)
+{
+	size_t stride = GetSceneVertexStride(format);
+	size_t vertexEnd = (SceneVertexPos + stride - 1) / stride * stride + numVertices * stride;
+	if (vertexEnd <= Buffers->SceneVertexPageSize && SceneIndexPos + numIndices <= Buffers->SceneIndexPageSize)
+		return;
+
+	auto cmdbuffer = Commands->GetDrawCommands();
+	DrawBatch(cmdbuffer);
+	Buffers->NextScenePage(SceneVertexPos, SceneIndexPos, numVertices * stride, numIndices);
+	SceneVertexPos = 0;
+	SceneIndexPos = 0;
+	Batch.SceneIndexStart = 0;
+	BindSceneBuffers(cmdbuffer);
+	Stats.ScenePageSwitches++;
+}
+
+// All formats share the vertex buffer, with the vertices of each draw
+// aligned to their own stride, so that the index of the first one is just
+// its byte offset divided by that. The mapped vertex buffer is write
+// combined memory that we never read back, hence the streaming stores.
+// Returns the index of the first vertex.
+uint32_t UVulkanRenderDevice::WriteSceneVertices(SceneVertexFormat format, const void* vertices, uint32_t numVertices)
+{
+	size_t stride = GetSceneVertexStride(format);
+	size_t start = (SceneVertexPos + stride - 1) / stride * stride;
+	size_t size = numVertices * stride;
+
+	uint8_t* dst = Buffers->SceneVertices + start;
+	const uint8_t* src = static_cast<const uint8_t*>(vertices);
+	size_t head = std::min<size_t>((16 - ((uintptr_t)dst & 15)) & 15, size);
+	memcpy(dst, src, head);
+	size_t pos = head;
+	for (; pos + 16 <= size; pos += 16)
+		_mm_stream_si128(reinterpret_cast<__m128i*>(dst + pos), _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + pos)));
+	memcpy(dst + pos, src + pos, size - pos);
+
+	SceneVertexPos = start + size;
+	return (uint32_t)(start / stride);
+}
+
+void UVulkanRenderDevice::DrawFans(VulkanPipeline* pipeline, SceneVertexFormat format, const void* vertices, uint32_t numVertices, const uint32_t* fanSizes, uint32_t numFans)
+{
+	// its pipeline failed to compile, which got logged
+	if (!pipeline)
+		return;
+
+	SetPipeline(pipeline);
+
+	size_t numIndices = 0;
+	for (uint32_t fan = 0; fan < numFans; fan++)
+		numIndices += fanSizes[fan] > 2 ? (fanSizes[fan] - 2) * 3 : 0;
+	ReserveScene(format, numVertices, numIndices);
+
+	uint32_t vpos = WriteSceneVertices(format, vertices, numVertices);
+	uint32_t* iptr = Buffers->SceneIndexes + SceneIndexPos;
+
+	for (uint32_t fan = 0; fan < numFans; fan++)
+	{
+		uint32_t vcount = fanSizes[fan];
+		for (uint32_t i = vpos + 2; i < vpos + vcount; i++)
+		{
+			*(iptr++) = vpos;
+			*(iptr++) = i - 1;
+			*(iptr++) = i;
+		}
+		vpos += vcount;
+	}
+
+	SceneIndexPos = iptr - Buffers->SceneIndexes;
+}
+
+// Draws Batch and then what LineBatch has collected since the last time.
+// This happens whenever the viewport, the transform or the depth buffer
+// changes, and at the end of the scene. Until then lines & points may get
+// drawn after draws that came after them. Lines & points don't write
+// depth, so all that changes is that they show where a later draw would
+// have covered them.
+void UVulkanRenderDevice::DrawLineBatch(VulkanCommandBuffer* cmdbuffer)
+{
+	DrawBatch(cmdbuffer);
+
+	auto layout = RenderPasses->Scene.BindlessPipelineLayout.get();
+	auto draw = [&](VulkanPipeline* pipeline, SceneVertexFormat format, const void* vertices, uint32_t count)
+	{
+		ReserveScene(format, count, 0);
+		uint32_t first = WriteSceneVertices(format, vertices, count);
+		cmdbuffer->bindPipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+		cmdbuffer->pushConstants(layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(ScenePushConstants), &pushconstants);
+		if (format == SceneVertexLineInstance)
+			cmdbuffer->draw(6, count, 0, first);
+		else
+			cmdbuffer->draw(count, 1, first, 0);
+		Stats.DrawCalls++;
+		Stats.LineDraws++;
+	};
+
+	for (int occlude = 0; occlude < 2; occlude++)
+	{
+		auto& lines = LineBatch.Lines[occlude];
+		if (!lines.empty() && LineBatch.Width > 1.0f)
+		{
+			auto& instances = LineBatch.Instances;
+			instances.clear();
+			for (size_t i = 0; i < lines.size(); i += 2)
+				instances.push_back({ lines[i].Position, lines[i + 1].Position, lines[i].Color });
+			draw(RenderPasses->GetThickLinePipeline(occlude), SceneVertexLineInstance, instances.data(), (uint32_t)instances.size());
+		}
+		else if (!lines.empty())
+		{
+			draw(RenderPasses->GetLinePipeline(occlude), SceneVertexTile, lines.data(), (uint32_t)lines.size());
+		}
+		lines.clear();
+
+		auto& points = LineBatch.Points[occlude];
+		if (!points.empty())
+			draw(RenderPasses->GetPointPipeline(occlude), SceneVertexTile, points.data(), (uint32_t)points.size());
+		points.clear();
+	}
+}
+
+// Consecutive tiles with the same pipeline and Z end up as one instanced
+// draw. Nothing else splits the batch: the instances have room for a
+// bindless texture index, but DrawTile writes 0 there for now and the
+// scene fragment shader doesn't sample with it.
+void UVulkanRenderDevice::DrawTileInstance(VulkanPipeline* pipeline, float z, const SceneTileInstance& tile)
+{
+	if (!pipeline)
+		return;
+
+	SetPipeline(pipeline);
+	if (Batch.TileInstances > 0 && z != pushconstants.tileZ)
+		DrawBatch(Commands->GetDrawCommands());
+	pushconstants.tileZ = z;
+
+	ReserveScene(SceneVertexTileInstance, 1, 0);
+	uint32_t index = WriteSceneVertices(SceneVertexTileInstance, &tile, 1);
+
+	if (Batch.TileInstances == 0)
+	{
+		Batch.TileInstanceStart = index;
+		Batch.TileHash = TileLayerCache::BeginRunHash(pipeline, pushconstants, SceneViewport);
+		Batch.TileBounds = vec4(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+	}
+	Batch.TileInstances++;
+
+	// for TileLayers, see DrawBatch
+	Batch.TileHash = TileLayerCache::HashTile(Batch.TileHash, tile);
+	Batch.TileBounds.x = std::min(Batch.TileBounds.x, std::min(tile.Rect.x, tile.Rect.z));
+	Batch.TileBounds.y = std::min(Batch.TileBounds.y, std::min(tile.Rect.y, tile.Rect.w));
+	Batch.TileBounds.z = std::max(Batch.TileBounds.z, std::max(tile.Rect.x, tile.Rect.z));
+	Batch.TileBounds.w = std::max(Batch.TileBounds.w, std::max(tile.Rect.y, tile.Rect.w));
 }
 
 void UVulkanRenderDevice::DrawComplexSurface(FSceneNode* Frame, FSurfaceInfo& Surface, FSurfaceFacet& Facet)
 {
 	guardSlow(UVulkanRenderDevice::DrawComplexSurface);
-	int numPolys = 0;
+	uint32_t numFans = 0;
+	uint32_t numVertices = 0;
 	for (FSavedPoly* Poly = Facet.Polys; Poly; Poly = Poly->Next) {
-		numPolys++;
+		if (Poly->NumPts < 3) continue;
+		numFans++;
+		numVertices += Poly->NumPts;
 	}
 
 #if defined(UNREALGOLD)
@@ -683,7 +1213,7 @@ void UVulkanRenderDevice::DrawComplexSurface(FSceneNode* Frame, FSurfaceInfo& Su
 	//	DetailVMult = GetVMult(*Surface.FogMap);
 	//}
 
-	SetPipeline(RenderPasses->GetPipeline(Surface.PolyFlags));
+	uint32_t pipelineKey = RenderPasses->GetPipelineKey(Surface.PolyFlags, SceneVertexFull, flags);
 
 	vec4 color(1.0f);
 
@@ -691,14 +1221,9 @@ void UVulkanRenderDevice::DrawComplexSurface(FSceneNode* Frame, FSurfaceInfo& Su
 	int drawcount = (Surface.PolyFlags & PF_Selected) && GIsEditor ? 2 : 1;
 	while (drawcount-- > 0)
 	{
-		uint32_t vpos = SceneVertexPos;
-		uint32_t ipos = SceneIndexPos;
-
-		SceneVertex* vptr = Buffers->SceneVertices + vpos;
-		uint32_t* iptr = Buffers->SceneIndexes + ipos;
-
-		uint32_t istart = ipos;
-		uint32_t icount = 0;
+		auto cmd = pushDrawFans<SceneVertex>(RenderCommands.get(), pipelineKey, numVertices, numFans);
+		SceneVertex* vptr = reinterpret_cast<SceneVertex*>(cmd->Vertices());
+		uint32_t* fanSizes = cmd->FanSizes();
 
 		for (FSavedPoly* Poly = Facet.Polys; Poly; Poly = Poly->Next)
 		{
@@ -729,23 +1254,12 @@ void UVulkanRenderDevice::DrawComplexSurface(FSceneNode* Frame, FSurfaceInfo& Su
 				vptr++;
 			}
 
-			for (uint32_t i = vpos + 2; i < vpos + vcount; i++)
-			{
-				*(iptr++) = vpos;
-				*(iptr++) = i - 1;
-				*(iptr++) = i;
-			}
-
-			vpos += vcount;
-			icount += (vcount - 2) * 3;
+			*(fanSizes++) = vcount;
 		}
 
-		SceneVertexPos = vpos;
-		SceneIndexPos = ipos + icount;
-
 		if (drawcount != 0)
 		{
-			SetPipeline(RenderPasses->GetPipeline(PF_Highlighted));
+			pipelineKey = RenderPasses->GetPipelineKey(PF_Highlighted, SceneVertexFull, flags);
 			color = vec4(0.0f, 0.0f, 0.05f, 0.20f);
 		}
 	}
@@ -761,17 +1275,17 @@ void UVulkanRenderDevice::DrawGouraudPolygon(FSceneNode* Frame, FTextureInfo& In
 
 	if (NumPts < 3) return; // This can apparently happen!!
 
-	SetPipeline(RenderPasses->GetPipeline(PolyFlags));
-
 	float UMult = GetUMult(Info);
 	float VMult = GetVMult(Info);
 	int flags = (PolyFlags & (PF_RenderFog | PF_Translucent | PF_Modulated)) == PF_RenderFog ? 16 : 0;
 
 	if ((PolyFlags & (PF_Translucent | PF_Modulated)) == 0 && LightMode == 2) flags |= 32;
 
+	SceneGouraudVertex* vertices = pushDrawFan<SceneGouraudVertex>(RenderCommands.get(), RenderPasses->GetPipelineKey(PolyFlags, SceneVertexGouraud, flags), NumPts);
+
 	if (PolyFlags & PF_Modulated)
 	{
-		SceneVertex* vertex = &Buffers->SceneVertices[SceneVertexPos];
+		SceneGouraudVertex* vertex = vertices;
 		for (INT i = 0; i < NumPts; i++)
 		{
 			FTransTexture* P = Pts[i];
@@ -781,23 +1295,14 @@ void UVulkanRenderDevice::DrawGouraudPolygon(FSceneNode* Frame, FTextureInfo& In
 			vertex->Position.z = P->Point.Z;
 			vertex->TexCoord.s = P->U * UMult;
 			vertex->TexCoord.t = P->V * VMult;
-			vertex->TexCoord2.s = P->Fog.X;
-			vertex->TexCoord2.t = P->Fog.Y;
-			vertex->TexCoord3.s = P->Fog.Z;
-			vertex->TexCoord3.t = P->Fog.W;
-			vertex->TexCoord4.s = 0.0f;
-			vertex->TexCoord4.t = 0.0f;
-			vertex->Color.r = 1.0f;
-			vertex->Color.g = 1.0f;
-			vertex->Color.b = 1.0f;
-			vertex->Color.a = 1.0f;
-			vertex->TextureBinds = ivec4{ 0, 0, 0, 0 };
+			vertex->Color = 0xffffffff;
+			vertex->Fog = packColor(P->Fog.X, P->Fog.Y, P->Fog.Z, P->Fog.W);
 			vertex++;
 		}
 	}
 	else
 	{
-		SceneVertex* vertex = &Buffers->SceneVertices[SceneVertexPos];
+		SceneGouraudVertex* vertex = vertices;
 		for (INT i = 0; i < NumPts; i++)
 		{
 			FTransTexture* P = Pts[i];
@@ -807,37 +1312,12 @@ void UVulkanRenderDevice::DrawGouraudPolygon(FSceneNode* Frame, FTextureInfo& In
 			vertex->Position.z = P->Point.Z;
 			vertex->TexCoord.s = P->U * UMult;
 			vertex->TexCoord.t = P->V * VMult;
-			vertex->TexCoord2.s = P->Fog.X;
-			vertex->TexCoord2.t = P->Fog.Y;
-			vertex->TexCoord3.s = P->Fog.Z;
-			vertex->TexCoord3.t = P->Fog.W;
-			vertex->TexCoord4.s = 0.0f;
-			vertex->TexCoord4.t = 0.0f;
-			vertex->Color.r = P->Light.X;
-			vertex->Color.g = P->Light.Y;
-			vertex->Color.b = P->Light.Z;
-			vertex->Color.a = 1.0f;
-			vertex->TextureBinds = ivec4{ 0, 0, 0, 0 };
+			vertex->Color = packColor(P->Light.X, P->Light.Y, P->Light.Z, 1.0f);
+			vertex->Fog = packColor(P->Fog.X, P->Fog.Y, P->Fog.Z, P->Fog.W);
 			vertex++;
 		}
 	}
 
-	size_t vstart = SceneVertexPos;
-	size_t vcount = NumPts;
-	size_t istart = SceneIndexPos;
-	size_t icount = (vcount - 2) * 3;
-
-	uint32_t* iptr = Buffers->SceneIndexes + istart;
-	for (uint32_t i = vstart + 2; i < vstart + vcount; i++)
-	{
-		*(iptr++) = vstart;
-		*(iptr++) = i - 1;
-		*(iptr++) = i;
-	}
-
-	SceneVertexPos += vcount;
-	SceneIndexPos += icount;
-
 	Stats.GouraudPolygons++;
 
 	unguardSlow;
@@ -858,13 +1338,13 @@ void UVulkanRenderDevice::DrawTile(FSceneNode* Frame, FTextureInfo& Info, FLOAT
 
 	//CachedTexture* tex = Textures->GetTexture(&Info, !!(PolyFlags & PF_Masked));
 
-	SetPipeline(RenderPasses->GetPipeline(PolyFlags));
+	auto cmd = pushCommand<DrawTileCommand>(RenderCommands.get(), RenderCommand::DrawTile);
+	cmd->PipelineKey = RenderPasses->GetPipelineKey(PolyFlags, SceneVertexTileInstance, 0);
+	cmd->Z = Z;
 
 	float UMult = /*tex ? GetUMult(Info) :*/ 0.0f;
 	float VMult = /*tex ? GetVMult(Info) :*/ 0.0f;
 
-	SceneVertex* v = &Buffers->SceneVertices[SceneVertexPos];
-
 	float r, g, b, a;
 	if (PolyFlags & PF_Modulated)
 	{
@@ -880,7 +1360,8 @@ void UVulkanRenderDevice::DrawTile(FSceneNode* Frame, FTextureInfo& Info, FLOAT
 	}
 	a = 1.0f;
 
-	if (Textures->Scene->Multisample > 1)
+	// the scene textures belong to the replay, but get recreated to match this
+	if (GetSettingsMultisample() > 1)
 	{
 		XL = std::floor(X + XL + 0.5f);
 		YL = std::floor(Y + YL + 0.5f);
@@ -890,26 +1371,14 @@ void UVulkanRenderDevice::DrawTile(FSceneNode* Frame, FTextureInfo& Info, FLOAT
 		YL = YL - Y;
 	}
 
-	v[0] = { 0, vec3(RFX2 * Z * (X - Frame->FX2),      RFY2 * Z * (Y - Frame->FY2),      Z), vec2(U * UMult,        V * VMult),        vec2(0.0f, 0.0f), vec2(0.0f, 0.0f), vec2(0.0f, 0.0f), vec4(r, g, b, a), ivec4(1,1,1,1) };
-	v[1] = { 0, vec3(RFX2 * Z * (X + XL - Frame->FX2), RFY2 * Z * (Y - Frame->FY2),      Z), vec2((U + UL) * UMult, V * VMult),        vec2(0.0f, 0.0f), vec2(0.0f, 0.0f), vec2(0.0f, 0.0f), vec4(r, g, b, a), ivec4(1,1,1,1) };
-	v[2] = { 0, vec3(RFX2 * Z * (X + XL - Frame->FX2), RFY2 * Z * (Y + YL - Frame->FY2), Z), vec2((U + UL) * UMult, (V + VL) * VMult), vec2(0.0f, 0.0f), vec2(0.0f, 0.0f), vec2(0.0f, 0.0f), vec4(r, g, b, a), ivec4(1,1,1,1) };
-	v[3] = { 0, vec3(RFX2 * Z * (X - Frame->FX2),      RFY2 * Z * (Y + YL - Frame->FY2), Z), vec2(U * UMult,        (V + VL) * VMult), vec2(0.0f, 0.0f), vec2(0.0f, 0.0f), vec2(0.0f, 0.0f), vec4(r, g, b, a), ivec4(1,1,1,1) };
-
-	size_t vstart = SceneVertexPos;
-	size_t vcount = 4;
-	size_t istart = SceneIndexPos;
-	size_t icount = (vcount - 2) * 3;
-
-	uint32_t* iptr = Buffers->SceneIndexes + istart;
-	for (uint32_t i = vstart + 2; i < vstart + vcount; i++)
-	{
-		*(iptr++) = vstart;
-		*(iptr++) = i - 1;
-		*(iptr++) = i;
-	}
-
-	SceneVertexPos += vcount;
-	SceneIndexPos += icount;
+	SceneTileInstance& tile = cmd->Tile;
+	tile.Rect = vec4(X, Y, X + XL, Y + YL);
+	tile.TexCoords[0] = floatToHalf(U * UMult);
+	tile.TexCoords[1] = floatToHalf(V * VMult);
+	tile.TexCoords[2] = floatToHalf((U + UL) * UMult);
+	tile.TexCoords[3] = floatToHalf((V + VL) * VMult);
+	tile.Color = packColor(r, g, b, a);
+	tile.TextureIndex = 0; // tex's bindless index, once there is a bindless texture set
 
 	Stats.Tiles++;
 
@@ -953,23 +1422,16 @@ void UVulkanRenderDevice::Draw3DLine(FSceneNode* Frame, FPlane Color, DWORD Line
 	}
 	else
 	{
-		SetPipeline(RenderPasses->GetLinePipeline(OccludeLines));
-
 		//ivec4 textureBinds = SetDescriptorSet(PF_Highlighted, nullptr);
 
-		SceneVertex* v = &Buffers->SceneVertices[SceneVertexPos];
-		uint32_t* iptr = Buffers->SceneIndexes + SceneIndexPos;
+		auto cmd = pushCommand<DrawLineCommand>(RenderCommands.get(), RenderCommand::DrawLine);
+		cmd->Occlude = OccludeLines;
 
-		vec4 color = ApplyInverseGamma(vec4(Color.X, Color.Y, Color.Z, 1.0f));
+		uint32_t color = packColor(ApplyInverseGamma(vec4(Color.X, Color.Y, Color.Z, 1.0f)));
 
-		v[0] = { 0, vec3(P1.X, P1.Y, P1.Z), vec2(0.0f), vec2(0.0f), vec2(0.0f), vec2(0.0f), color, ivec4{0,0,0,0} };
-		v[1] = { 0, vec3(P2.X, P2.Y, P2.Z), vec2(0.0f), vec2(0.0f), vec2(0.0f), vec2(0.0f), color, ivec4{0,0,0,0} };
-
-		iptr[0] = SceneVertexPos;
-		iptr[1] = SceneVertexPos + 1;
-
-		SceneVertexPos += 2;
-		SceneIndexPos += 2;
+		cmd->Vertices[0] = tileVertex(vec3(P1.X, P1.Y, P1.Z), 0.0f, 0.0f, color);
+		cmd->Vertices[1] = tileVertex(vec3(P2.X, P2.Y, P2.Z), 0.0f, 0.0f, color);
+		Stats.Lines++;
 	}
 
 	unguard;
@@ -986,23 +1448,16 @@ void UVulkanRenderDevice::Draw2DLine(FSceneNode* Frame, FPlane Color, DWORD Line
 {
 	guard(UVulkanRenderDevice::Draw2DLine);
 
-	SetPipeline(RenderPasses->GetLinePipeline(OccludeLines));
-
 	//ivec4 textureBinds = SetDescriptorSet(PF_Highlighted, nullptr);
 
-	SceneVertex* v = &Buffers->SceneVertices[SceneVertexPos];
-	uint32_t* iptr = Buffers->SceneIndexes + SceneIndexPos;
-
-	vec4 color = ApplyInverseGamma(vec4(Color.X, Color.Y, Color.Z, 1.0f));
+	auto cmd = pushCommand<DrawLineCommand>(RenderCommands.get(), RenderCommand::DrawLine);
+	cmd->Occlude = OccludeLines;
 
-	v[0] = { 0, vec3(RFX2 * P1.Z * (P1.X - Frame->FX2), RFY2 * P1.Z * (P1.Y - Frame->FY2), P1.Z), vec2(0.0f), vec2(0.0f), vec2(0.0f), vec2(0.0f), color, ivec4(1,1,1,1) };
-	v[1] = { 0, vec3(RFX2 * P2.Z * (P2.X - Frame->FX2), RFY2 * P2.Z * (P2.Y - Frame->FY2), P2.Z), vec2(0.0f), vec2(0.0f), vec2(0.0f), vec2(0.0f), color, ivec4(1,1,1,1) };
+	uint32_t color = packColor(ApplyInverseGamma(vec4(Color.X, Color.Y, Color.Z, 1.0f)));
 
-	iptr[0] = SceneVertexPos;
-	iptr[1] = SceneVertexPos + 1;
-
-	SceneVertexPos += 2;
-	SceneIndexPos += 2;
+	cmd->Vertices[0] = tileVertex(vec3(RFX2 * P1.Z * (P1.X - Frame->FX2), RFY2 * P1.Z * (P1.Y - Frame->FY2), P1.Z), 0.0f, 0.0f, color);
+	cmd->Vertices[1] = tileVertex(vec3(RFX2 * P2.Z * (P2.X - Frame->FX2), RFY2 * P2.Z * (P2.Y - Frame->FY2), P2.Z), 0.0f, 0.0f, color);
+	Stats.Lines++;
 
 	unguard;
 }
@@ -1014,52 +1469,47 @@ void UVulkanRenderDevice::Draw2DPoint(FSceneNode* Frame, FPlane Color, DWORD Lin
 	// Hack to fix UED selection problem with selection brush
 	if (GIsEditor) Z = 1.0f;
 
-	SetPipeline(RenderPasses->GetPointPipeline(OccludeLines));
-
 	//ivec4 textureBinds = SetDescriptorSet(PF_Highlighted, nullptr);
 
-	SceneVertex* v = &Buffers->SceneVertices[SceneVertexPos];
+	auto cmd = pushCommand<DrawPointCommand>(RenderCommands.get(), RenderCommand::DrawPoint);
+	cmd->Occlude = OccludeLines;
+	SceneTileVertex* v = cmd->Vertices;
 
-	vec4 color = ApplyInverseGamma(vec4(Color.X, Color.Y, Color.Z, 1.0f));
+	uint32_t color = packColor(ApplyInverseGamma(vec4(Color.X, Color.Y, Color.Z, 1.0f)));
 
-	v[0] = { 0, vec3(RFX2 * Z * (X1 - Frame->FX2 - 0.5f), RFY2 * Z * (Y1 - Frame->FY2 - 0.5f), Z), vec2(0.0f), vec2(0.0f), vec2(0.0f), vec2(0.0f), color, ivec4(1,1,1,1) };
-	v[1] = { 0, vec3(RFX2 * Z * (X2 - Frame->FX2 + 0.5f), RFY2 * Z * (Y1 - Frame->FY2 - 0.5f), Z), vec2(0.0f), vec2(0.0f), vec2(0.0f), vec2(0.0f), color, ivec4(1,1,1,1) };
-	v[2] = { 0, vec3(RFX2 * Z * (X2 - Frame->FX2 + 0.5f), RFY2 * Z * (Y2 - Frame->FY2 + 0.5f), Z), vec2(0.0f), vec2(0.0f), vec2(0.0f), vec2(0.0f), color, ivec4(1,1,1,1) };
-	v[3] = { 0, vec3(RFX2 * Z * (X1 - Frame->FX2 - 0.5f), RFY2 * Z * (Y2 - Frame->FY2 + 0.5f), Z), vec2(0.0f), vec2(0.0f), vec2(0.0f), vec2(0.0f), color, ivec4(1,1,1,1) };
+	v[0] = tileVertex(vec3(RFX2 * Z * (X1 - Frame->FX2 - 0.5f), RFY2 * Z * (Y1 - Frame->FY2 - 0.5f), Z), 0.0f, 0.0f, color);
+	v[1] = tileVertex(vec3(RFX2 * Z * (X2 - Frame->FX2 + 0.5f), RFY2 * Z * (Y1 - Frame->FY2 - 0.5f), Z), 0.0f, 0.0f, color);
+	v[2] = tileVertex(vec3(RFX2 * Z * (X2 - Frame->FX2 + 0.5f), RFY2 * Z * (Y2 - Frame->FY2 + 0.5f), Z), 0.0f, 0.0f, color);
+	v[3] = tileVertex(vec3(RFX2 * Z * (X1 - Frame->FX2 - 0.5f), RFY2 * Z * (Y2 - Frame->FY2 + 0.5f), Z), 0.0f, 0.0f, color);
+	Stats.Points++;
 
-	size_t vstart = SceneVertexPos;
-	size_t vcount = 4;
-	size_t istart = SceneIndexPos;
-	size_t icount = (vcount - 2) * 3;
+	unguard;
+}
 
-	uint32_t* iptr = Buffers->SceneIndexes + istart;
-	for (uint32_t i = vstart + 2; i < vstart + vcount; i++)
+// The same random lines all over the frame each time, to see what a busy
+// editor view or debug display costs. See VkLineStress.
+void UVulkanRenderDevice::DrawLineStress(FSceneNode* Frame)
+{
+	guard(UVulkanRenderDevice::DrawLineStress);
+
+	uint32_t seed = 12345;
+	auto random = [&]() { seed = seed * 1664525 + 1013904223; return (seed >> 8) / (float)(1 << 24); };
+
+	for (int i = 0; i < LineStress; i++)
 	{
-		*(iptr++) = vstart;
-		*(iptr++) = i - 1;
-		*(iptr++) = i;
+		FPlane color(random(), random(), random(), 1.0f);
+		FVector p1(random() * Frame->X, random() * Frame->Y, 1.0f);
+		FVector p2(random() * Frame->X, random() * Frame->Y, 1.0f);
+		Draw2DLine(Frame, color, LINE_None, p1, p2);
 	}
 
-	SceneVertexPos += vcount;
-	SceneIndexPos += icount;
-
 	unguard;
 }
 
 void UVulkanRenderDevice::ClearZ(FSceneNode* Frame)
 {
 	guard(UVulkanRenderDevice::ClearZ);
-
-	DrawBatch(Commands->GetDrawCommands());
-
-	VkClearAttachment attachment = {};
-	VkClearRect rect = {};
-	attachment.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-	attachment.clearValue.depthStencil.depth = 1.0f;
-	rect.layerCount = 1;
-	rect.rect.extent.width = Textures->Scene->Width;
-	rect.rect.extent.height = Textures->Scene->Height;
-	Commands->GetDrawCommands()->clearAttachments(1, &attachment, 1, &rect);
+	pushCommand(RenderCommands.get(), RenderCommand::ClearZ);
 	unguard;
 }
 
@@ -1080,7 +1530,7 @@ void UVulkanRenderDevice::PopHit(INT Count, UBOOL bForce)
 void UVulkanRenderDevice::GetStats(TCHAR* Result)
 {
 	guard(UVulkanRenderDevice::GetStats);
-	Result[0] = 0;
+	appSprintf(Result, TEXT("Vulkan: Draw calls: %d, Objects: %d, Dirty objects: %d, Actors: %d, Baked actors: %d, Object draws: %d for %d instances"), Stats.DrawCalls.load(), Stats.Objects, Stats.DirtyObjects, Stats.Actors, Stats.BakedActors, Stats.ObjectDraws, Stats.ObjectInstances);
 	unguard;
 }
 
@@ -1096,42 +1546,29 @@ void UVulkanRenderDevice::ReadPixels(FColor* Pixels)
 void UVulkanRenderDevice::EndFlash()
 {
 	guard(UVulkanRenderDevice::EndFlash);
+	if (LineStress > 0 && CurrentFrame)
+		DrawLineStress(CurrentFrame);
+
 	if (FlashScale != FPlane(0.5f, 0.5f, 0.5f, 0.0f) || FlashFog != FPlane(0.0f, 0.0f, 0.0f, 0.0f))
 	{
 		vec4 color(FlashFog.X, FlashFog.Y, FlashFog.Z, 1.0f - Min(FlashScale.X * 2.0f, 1.0f));
 		vec2 zero2(0.0f);
 		ivec4 zero4(0);
 
-		DrawBatch(Commands->GetDrawCommands());
-		pushconstants.objectToProjection = mat4::identity();
-		pushconstants.nearClip = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+		auto transform = pushCommand<SetTransformCommand>(RenderCommands.get(), RenderCommand::SetTransform);
+		transform->ObjectToProjection = mat4::identity();
+		transform->NearClip = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+		transform->TileTransform = vec4(0.0f);
 
-		SetPipeline(RenderPasses->GetEndFlashPipeline());
 		//SetDescriptorSet(DescriptorSets->GetTextureSet(0, nullptr));
 
-		SceneVertex* v = &Buffers->SceneVertices[SceneVertexPos];
+		SceneVertex* v = pushDrawFan<SceneVertex>(RenderCommands.get(), RenderPasses->GetEndFlashPipelineKey(), 4);
 
 		v[0] = { 0, vec3(-1.0f, -1.0f, 0.0f), zero2, zero2, zero2, zero2, color, zero4 };
 		v[1] = { 0, vec3(1.0f, -1.0f, 0.0f), zero2, zero2, zero2, zero2, color, zero4 };
 		v[2] = { 0, vec3(1.0f,  1.0f, 0.0f), zero2, zero2, zero2, zero2, color, zero4 };
 		v[3] = { 0, vec3(-1.0f,  1.0f, 0.0f), zero2, zero2, zero2, zero2, color, zero4 };
 
-		size_t vstart = SceneVertexPos;
-		size_t vcount = 4;
-		size_t istart = SceneIndexPos;
-		size_t icount = (vcount - 2) * 3;
-
-		uint32_t* iptr = Buffers->SceneIndexes + istart;
-		for (uint32_t i = vstart + 2; i < vstart + vcount; i++)
-		{
-			*(iptr++) = vstart;
-			*(iptr++) = i - 1;
-			*(iptr++) = i;
-		}
-
-		SceneVertexPos += vcount;
-		SceneIndexPos += icount;
-
 		if (CurrentFrame)
 			SetSceneNode(CurrentFrame);
 	}
@@ -1142,9 +1579,6 @@ void UVulkanRenderDevice::SetSceneNode(FSceneNode* Frame)
 {
 	guardSlow(UVulkanRenderDevice::SetSceneNode);
 
-	auto commands = Commands->GetDrawCommands();
-	DrawBatch(commands);
-
 	CurrentFrame = Frame;
 	Aspect = Frame->FY / Frame->FX;
 	RProjZ = (float)appTan(radians(Viewport->Actor->FovAngle) * 0.5);
@@ -1158,10 +1592,12 @@ void UVulkanRenderDevice::SetSceneNode(FSceneNode* Frame)
 	viewportdesc.height = Frame->Y;
 	viewportdesc.minDepth = 0.0f;
 	viewportdesc.maxDepth = 1.0f;
-	commands->setViewport(0, 1, &viewportdesc);
+	pushCommand<SetViewportCommand>(RenderCommands.get(), RenderCommand::SetViewport)->Viewport = viewportdesc;
 
-	pushconstants.objectToProjection = mat4::frustum(-RProjZ, RProjZ, -Aspect * RProjZ, Aspect * RProjZ, 1.0f, 32768.0f, handedness::left, clipzrange::zero_positive_w);
-	pushconstants.nearClip = vec4(Frame->NearClip.X, Frame->NearClip.Y, Frame->NearClip.Z, Frame->NearClip.W);
+	auto transform = pushCommand<SetTransformCommand>(RenderCommands.get(), RenderCommand::SetTransform);
+	transform->ObjectToProjection = mat4::frustum(-RProjZ, RProjZ, -Aspect * RProjZ, Aspect * RProjZ, 1.0f, 32768.0f, handedness::left, clipzrange::zero_positive_w);
+	transform->NearClip = vec4(Frame->NearClip.X, Frame->NearClip.Y, Frame->NearClip.Z, Frame->NearClip.W);
+	transform->TileTransform = vec4(RFX2, RFY2, Frame->FX2, Frame->FY2);
 
 	unguardSlow;
 }
@@ -1407,6 +1843,7 @@ struct ModelPusher {
 	std::vector<Vertex> verts;
 	std::vector<Wedge> wedges;
 	std::vector<Surf> surfs;
+	std::vector<DWORD> surf_poly_flags; // not uploaded, parallel to surfs
 	std::vector<UINT> surf_indices;
 	std::vector<UINT> wedge_indices;
 	//std::vector<LightMapIndex> lightMapIndices;
@@ -1415,10 +1852,21 @@ struct ModelPusher {
 	std::vector<MeshletVertex> meshlet_verts;
 	std::vector<UINT> meshlet_vert_indices;
 	std::vector<uint8_t> meshlet_local_indices;
-	std::vector<VkDrawIndirectCommand> meshlet_draw_commands;
-	std::map<UModel*, ModelBase> model_bases;
-	std::map<UMesh*, ModelBase> mesh_bases;
-
+	// one entry per meshlet triangle corner, packed as
+	// (meshlet index << 8) | local index, see push_replacement_mesh
+	std::vector<UINT> meshlet_triangle_indices;
+	std::vector<MeshletBounds> meshlet_bounds;
+	// whether all meshlets fit into scene-mesh.mesh's output limits
+	bool meshlets_fit_mesh_shaders = true;
+	MeshletModel meshlet_model_range{};
+	std::map<UMesh*, MeshletModel> meshlet_mesh_ranges;
+	std::map<UModel*, BucketedModel> model_bases;
+	std::map<UMesh*, BucketedModel> mesh_bases;
+
+	// static actors get baked in as pre-transformed triangles,
+	// see bake_actor & finish_baking
+	std::vector<StaticBucket> static_buckets;
+	std::vector<std::vector<ModelBase>> baked_actor_ranges;
 
 	ModelPusher(
 		UTexture* default_texture,
@@ -1434,6 +1882,7 @@ struct ModelPusher {
 		const auto wedge_index_base = wedge_indices.size();
 		//const auto lightMapIndexBase = lightMapIndices.size();
 		const auto light_base = lights.size();
+		BucketedTriangles triangles;
 
 		// push each light map index as a light map index
 		/*const auto lightMapTextureBaseIndex = lightMapTextureBaseIndices.at(model);
@@ -1497,6 +1946,7 @@ struct ModelPusher {
 				static_cast<i32>(found_texture_idx->second),
 				lights_index,
 				});
+			surf_poly_flags.push_back(surf.PolyFlags);
 		}
 
 		// now construct wedges from the vertices of each node
@@ -1514,6 +1964,7 @@ struct ModelPusher {
 			auto tex_base_u = (base | tex_u) - surf.PanU / static_cast<float>(texture->USize);
 			auto tex_base_v = (base | tex_v) - surf.PanV / static_cast<float>(texture->VSize);
 			auto node_wedge_base = wedges.size();
+			auto bucket = GetDrawBucket(surf.PolyFlags);
 
 			// wedges
 			for (int j = 0; j < node.NumVertices; j++) {
@@ -1528,18 +1979,15 @@ struct ModelPusher {
 
 			// push the triangle indices
 			for (int j = 2; j < node.NumVertices; j++) {
-				surf_indices.push_back(surf_base + node.iSurf);
-				wedge_indices.push_back(node_wedge_base + 0);
-				wedge_indices.push_back(node_wedge_base + j - 1);
-				wedge_indices.push_back(node_wedge_base + j);
+				triangles.push(bucket, surf_base + node.iSurf, node_wedge_base + 0, node_wedge_base + j - 1, node_wedge_base + j);
 			}
 		}
+		model_bases[model] = push_triangles(triangles);
 
 		auto numSurfs = surfs.size() - surf_base;
 		auto numWedges = wedges.size() - wedge_base;
 		auto numVerts = verts.size() - vert_base;
 		auto numWedgeIndices = wedge_indices.size() - wedge_index_base;
-		model_bases[model] = { wedge_index_base, numWedgeIndices };
 		debugf(L"Vulkan: %s@%p: Pushed %d surfs, %d wedges, %d verts and %d wedge indices, model starts at %d", model->GetFullName(), model, numSurfs, numWedges, numVerts, numWedgeIndices, wedge_index_base);
 	}
 
@@ -1548,6 +1996,7 @@ struct ModelPusher {
 		const auto wedge_base = wedges.size();
 		const auto vert_base = verts.size();
 		const auto wedge_index_base = wedge_indices.size();
+		BucketedTriangles triangles;
 
 		FCoords xform(FVector(0, 0, 0));
 		//xform *= lodMesh->RotOrigin;
@@ -1598,12 +2047,11 @@ struct ModelPusher {
 					resolve_texture_index_for_mesh(lod_mesh, material.TextureIndex),
 					~0u,
 					});
+				surf_poly_flags.push_back(material.PolyFlags);
 
 				// push each face as a triangle
-				surf_indices.push_back(surf_idx);
-				for (int j = 0; j < 3; j++) {
-					wedge_indices.push_back(wedge_base + face.iWedge[j]);
-				}
+				if (material.PolyFlags & PF_Invisible) continue;
+				triangles.push(GetDrawBucket(material.PolyFlags), surf_idx, wedge_base + face.iWedge[0], wedge_base + face.iWedge[1], wedge_base + face.iWedge[2]);
 			}
 		}
 		else {
@@ -1621,16 +2069,17 @@ struct ModelPusher {
 			// for each tri, push three wedges, a surf and appropriate indices
 			for (int i = 0; i < mesh->Tris.Num(); i++) {
 				auto& tri = mesh->Tris(i);
+				if (tri.PolyFlags & PF_Invisible) continue;
 
-				surf_indices.push_back(surfs.size());
+				triangles.push(GetDrawBucket(tri.PolyFlags), surfs.size(), wedges.size(), wedges.size() + 1, wedges.size() + 2);
 				surfs.push_back({
 					{ 1, 0, 0 },
 					resolve_texture_index_for_mesh(mesh, tri.TextureIndex),
 					~0u,
 					});
+				surf_poly_flags.push_back(tri.PolyFlags);
 
 				for (int j = 0; j < 3; j++) {
-					wedge_indices.push_back(wedges.size());
 					wedges.push_back({
 						tri.Tex[j].U / 255.0f,
 						tri.Tex[j].V / 255.0f,
@@ -1639,21 +2088,26 @@ struct ModelPusher {
 				}
 			}
 		}
+		mesh_bases[mesh] = push_triangles(triangles);
 
 		auto num_surfs = surfs.size() - surf_base;
 		auto num_wedges = wedges.size() - wedge_base;
 		auto num_verts = verts.size() - vert_base;
 		auto num_wedge_indices = wedge_indices.size() - wedge_index_base;
-		mesh_bases[mesh] = { wedge_index_base, num_wedge_indices };
 		debugf(L"Vulkan: %s@%p: Pushed %d surfs, %d wedges, %d verts and %d wedge indices, model starts at %d", mesh->GetFullName(), mesh, num_surfs, num_wedges, num_verts, num_wedge_indices, wedge_index_base);
 	}
 
-	void push_replacement_mesh(ModelReplacement& model) {
+	MeshletModel push_replacement_mesh(const ModelReplacement& model) {
 		const auto meshlet_base = meshlets.size();
 		const auto vert_base = meshlet_verts.size();
 		const auto vert_index_base = meshlet_vert_indices.size();
 		const auto local_index_base = meshlet_local_indices.size();
-		const auto draw_command_base = meshlet_draw_commands.size();
+		const auto triangle_index_base = meshlet_triangle_indices.size();
+
+		if (meshlet_base + model.meshlets.size() > (1u << 24)) {
+			debugf(L"Vulkan: %S: Too many meshlets to pack into the meshlet triangle buffer", model.name);
+			throw std::runtime_error("Too many meshlets");
+		}
 
 		// push all the verts
 		for (auto& vert : model.verts)
@@ -1679,27 +2133,196 @@ struct ModelPusher {
 				.tex_idx = meshlet.tex_idx,
 				});
 
-		// push a draw command for each meshlet
+		// expand the meshlets into one big list of triangle corners, so that
+		// the whole model can go out as a single non-indexed draw instead of
+		// one tiny draw per meshlet; the vertex shader unpacks the meshlet
+		// and the local index from gl_VertexIndex
 		for (u32 i = 0; i < model.meshlets.size(); i++) {
 			const auto& meshlet = model.meshlets[i];
-			meshlet_draw_commands.push_back({
-				.vertexCount = meshlet.tri_count * 3,
-				.instanceCount = 1,
-				.firstVertex = meshlet.local_offset + local_index_base,
-				.firstInstance = meshlet_base + i,
-				});
+			const auto packed_meshlet = static_cast<UINT>(meshlet_base + i) << 8;
+			for (u32 j = 0; j < meshlet.tri_count * 3; j++)
+				meshlet_triangle_indices.push_back(packed_meshlet | model.local_indices[meshlet.local_offset + j]);
 		}
 
-		assert(meshlet_draw_commands.size() == meshlets.size());
+		// bounding spheres for the task shader, centered on the meshlet's box
+		for (auto& meshlet : model.meshlets) {
+			glm::vec3 min{ std::numeric_limits<float>::max() };
+			glm::vec3 max{ std::numeric_limits<float>::lowest() };
+			for (u32 i = 0; i < meshlet.vert_count; i++) {
+				auto& pos = model.verts[model.indices[meshlet.vert_offset + i]].pos;
+				min = glm::min(min, pos);
+				max = glm::max(max, pos);
+			}
+			MeshletBounds bounds{ (min + max) * 0.5f, 0.f };
+			for (u32 i = 0; i < meshlet.vert_count; i++) {
+				auto& pos = model.verts[model.indices[meshlet.vert_offset + i]].pos;
+				bounds.radius = std::max(bounds.radius, glm::length(pos - bounds.center));
+			}
+			meshlet_bounds.push_back(bounds);
+
+			if (meshlet.vert_count > 64 || meshlet.tri_count > 124)
+				meshlets_fit_mesh_shaders = false;
+		}
+
+		assert(meshlet_bounds.size() == meshlets.size());
 		assert(meshlets.size() - meshlet_base == model.meshlets.size());
 		assert(meshlet_verts.size() - vert_base == model.verts.size());
 		assert(meshlet_vert_indices.size() - vert_index_base == model.indices.size());
 		assert(meshlet_local_indices.size() - local_index_base == model.local_indices.size());
 
-		debugf(L"Vulkan: %S: Pushed %d meshlets, %d verts, %d vert indices, %d local indices and %d draw commands",
-			model.name, model.meshlets.size(), model.verts.size(), model.indices.size(), model.local_indices.size(), model.meshlets.size());
+		debugf(L"Vulkan: %S: Pushed %d meshlets, %d verts, %d vert indices, %d local indices and %d triangle indices",
+			model.name, model.meshlets.size(), model.verts.size(), model.indices.size(), model.local_indices.size(), meshlet_triangle_indices.size() - triangle_index_base);
+
+		return {
+			{
+				static_cast<UINT>(triangle_index_base),
+				static_cast<UINT>(meshlet_triangle_indices.size() - triangle_index_base),
+			},
+			static_cast<UINT>(meshlet_base),
+			static_cast<UINT>(model.meshlets.size()),
+		};
+	}
+
+	// All replaced models draw in world space with the level model's
+	// object, so they're pushed back to back & drawn as a single range.
+	void push_model_replacement(const ModelReplacement& model) {
+		auto range = push_replacement_mesh(model);
+		auto& total = meshlet_model_range;
+		if (total.meshletCount == 0) {
+			total.triangles.wedgeIndexBase = range.triangles.wedgeIndexBase;
+			total.meshletBase = range.meshletBase;
+		}
+		assert(total.triangles.wedgeIndexBase + total.triangles.wedgeIndexCount == range.triangles.wedgeIndexBase);
+		assert(total.meshletBase + total.meshletCount == range.meshletBase);
+		total.triangles.wedgeIndexCount += range.triangles.wedgeIndexCount;
+		total.meshletCount += range.meshletCount;
+	}
+
+	void push_mesh_replacement(UMesh* mesh, const ModelReplacement& model) {
+		meshlet_mesh_ranges[mesh] = push_replacement_mesh(model);
+	}
+	// Collects the triangles of a mesh actor, transformed by the actor's
+	// object and with its skins resolved. Nothing gets pushed until
+	// finish_baking, so that the triangles of all baked actors can be
+	// sorted by material state and texture first.
+	void bake_actor(const BucketedModel& mesh, const Object& object, DWORD actor_poly_flags) {
+		const auto baked_actor_idx = static_cast<u32>(baked_actor_ranges.size());
+		baked_actor_ranges.emplace_back();
+
+		for (auto& mesh_base : mesh.buckets)
+		for (u32 i = 0; i < mesh_base.wedgeIndexCount; i += 3) {
+			auto surf_idx = surf_indices[(mesh_base.wedgeIndexBase + i) / 3];
+			auto& surf = surfs[surf_idx];
+			auto poly_flags = surf_poly_flags[surf_idx] | actor_poly_flags;
+			if (poly_flags & PF_Invisible) continue;
+
+			BakedTri tri{
+				baked_actor_idx,
+				poly_flags & BakedMaterialFlags,
+				surf.texIdx < 0 ? object.textures[-surf.texIdx - 1] : static_cast<u32>(surf.texIdx),
+				surf.normal,
+			};
+			for (int j = 0; j < 3; j++) {
+				auto& wedge = wedges[wedge_indices[mesh_base.wedgeIndexBase + i + j]];
+				auto& pos1 = verts[wedge.vertIndex + object.vertexOffset1].pos;
+				auto& pos2 = verts[wedge.vertIndex + object.vertexOffset2].pos;
+				auto pos = pos1 + (pos2 - pos1) * object.vertexLerp;
+				auto world = object.xform * vec4(pos.X, pos.Y, pos.Z, 1);
+				tri.pos[j] = FVector(world.x, world.y, world.z);
+				tri.uv[j][0] = wedge.u;
+				tri.uv[j][1] = wedge.v;
+			}
+			baked_tris.push_back(tri);
+		}
+	}
+
+	// Pushes all baked triangles, one bucket per material state, sorted by
+	// texture within each bucket. Also records which wedge index ranges
+	// belong to which baked actor, so that they can be un-baked later.
+	void finish_baking() {
+		std::stable_sort(baked_tris.begin(), baked_tris.end(), [](const BakedTri& a, const BakedTri& b) {
+			if (a.poly_flags != b.poly_flags) return a.poly_flags < b.poly_flags;
+			return a.tex_idx < b.tex_idx;
+		});
+
+		for (size_t i = 0; i < baked_tris.size(); i++) {
+			auto& tri = baked_tris[i];
+			const auto wedge_index_base = static_cast<UINT>(wedge_indices.size());
+			if (static_buckets.empty() || static_buckets.back().poly_flags != tri.poly_flags) {
+				static_buckets.push_back({ tri.poly_flags, { wedge_index_base, 0 } });
+			}
+			static_buckets.back().base.wedgeIndexCount += 3;
+
+			auto& ranges = baked_actor_ranges[tri.baked_actor_idx];
+			if (!ranges.empty() && ranges.back().wedgeIndexBase + ranges.back().wedgeIndexCount == wedge_index_base) {
+				ranges.back().wedgeIndexCount += 3;
+			}
+			else {
+				ranges.push_back({ wedge_index_base, 3 });
+			}
+
+			surf_indices.push_back(surfs.size());
+			surfs.push_back({
+				tri.normal,
+				static_cast<i32>(tri.tex_idx),
+				~0u,
+				});
+			surf_poly_flags.push_back(tri.poly_flags);
+			for (int j = 0; j < 3; j++) {
+				wedge_indices.push_back(wedges.size());
+				wedges.push_back({
+					tri.uv[j][0],
+					tri.uv[j][1],
+					static_cast<u32>(verts.size()),
+					});
+				verts.push_back({ tri.pos[j] });
+			}
+		}
+
+		debugf(L"Vulkan: Baked %d triangles of %d actors into %d static buckets", baked_tris.size(), baked_actor_ranges.size(), static_buckets.size());
+		baked_tris.clear();
 	}
 private:
+	// the flags that decide how a baked triangle has to be drawn
+	static constexpr DWORD BakedMaterialFlags = PF_Masked | PF_Translucent | PF_Modulated | PF_TwoSided;
+
+	struct BakedTri {
+		u32 baked_actor_idx;
+		DWORD poly_flags;
+		u32 tex_idx;
+		FVector normal;
+		FVector pos[3];
+		f32 uv[3][2];
+	};
+	std::vector<BakedTri> baked_tris;
+
+	// Triangles of a model or mesh, collected per draw bucket, so that each
+	// bucket can be pushed as one contiguous range.
+	struct BucketedTriangles {
+		std::vector<UINT> surf_indices[DrawBucketCount];
+		std::vector<UINT> wedge_indices[DrawBucketCount];
+
+		void push(DrawBucket bucket, UINT surf_index, UINT wedge_index0, UINT wedge_index1, UINT wedge_index2) {
+			surf_indices[bucket].push_back(surf_index);
+			wedge_indices[bucket].push_back(wedge_index0);
+			wedge_indices[bucket].push_back(wedge_index1);
+			wedge_indices[bucket].push_back(wedge_index2);
+		}
+	};
+
+	BucketedModel push_triangles(const BucketedTriangles& triangles) {
+		BucketedModel model{};
+		for (int bucket = 0; bucket < DrawBucketCount; bucket++) {
+			model.buckets[bucket] = {
+				static_cast<UINT>(wedge_indices.size()),
+				static_cast<UINT>(triangles.wedge_indices[bucket].size())
+			};
+			surf_indices.insert(surf_indices.end(), triangles.surf_indices[bucket].begin(), triangles.surf_indices[bucket].end());
+			wedge_indices.insert(wedge_indices.end(), triangles.wedge_indices[bucket].begin(), triangles.wedge_indices[bucket].end());
+		}
+		return model;
+	}
+
 	int resolve_texture_index_for_mesh(UMesh* mesh, int texture_index) {
 		if (texture_index < 0) {
 			debugf(L"Vulkan: %s@%p: Negative texture index %d", mesh->GetFullName(), mesh, texture_index);
@@ -1753,20 +2376,296 @@ static void getVertexOffsetFromActor(const UMesh* mesh, const AActor* actor, Obj
 	object.vertexLerp = frameLerp;
 }
 
+// FNV-1a over the raw bytes of whatever gets fed into it. Used to detect
+// whether an object has to be re-uploaded, so it only needs to be cheap.
+struct ObjectHasher {
+	u64 hash = 0xcbf29ce484222325ull;
+
+	template<typename T>
+	ObjectHasher& add(const T& value) {
+		auto bytes = reinterpret_cast<const u8*>(&value);
+		for (size_t i = 0; i < sizeof(T); i++) {
+			hash ^= bytes[i];
+			hash *= 0x100000001b3ull;
+		}
+		return *this;
+	}
+
+	// 0 is reserved for empty slots
+	u64 finish() const {
+		return hash ? hash : 1;
+	}
+};
+
+// Hashes everything that ends up in an actor's Object.
+static u64 hashActorState(AActor* actor) {
+	ObjectHasher hasher;
+	hasher
+		.add(actor)
+		.add(actor->Location)
+		.add(actor->Rotation)
+		.add(actor->DrawScale)
+		.add(actor->Style)
+		.add(actor->PrePivot)
+		.add(actor->Brush)
+		.add(actor->Mesh);
+	if (auto mesh = actor->Mesh) {
+		for (int i = 0; i < mesh->Textures.Num(); i++) {
+			hasher.add(mesh->GetTexture(i, actor));
+		}
+		auto animActor = (actor->Owner && actor->bAnimByOwner) ? actor->Owner : actor;
+		hasher
+			.add(animActor->AnimSequence)
+			.add(animActor->AnimFrame);
+	}
+	return hasher.finish();
+}
+
+static DWORD actorPolyFlags(const AActor* actor) {
+	switch (actor->Style) {
+	case STY_Masked: return PF_Masked;
+	case STY_Translucent: return PF_Translucent;
+	case STY_Modulated: return PF_Modulated;
+	default: return 0;
+	}
+}
+
+// Static mesh actors that aren't animating can be baked into the static
+// geometry. Whether they really stay put is checked every frame.
+static bool isBakeableActor(const AActor* actor) {
+	return actor
+		&& (actor->bStatic || actor->bNoDelete)
+		&& !actor->bHidden
+		&& actor->DrawType == DT_Mesh
+		&& actor->Mesh
+		&& !actor->Brush
+		&& !actor->bAnimByOwner
+		&& !actor->IsAnimating();
+}
+
+static Object buildActorObject(AActor* actor, const std::map<UTexture*, u32>& texture_to_idx, u32 defaultTextureIndex, bool logTextures) {
+	auto prePivot = mat4::translate(-actor->PrePivot.X, -actor->PrePivot.Y, -actor->PrePivot.Z);
+	auto translation = mat4::translate(actor->Location.X, actor->Location.Y, actor->Location.Z);
+	auto rotation = mat4::rotate(2 * PI * actor->Rotation.Yaw / 65536., 0, 0, 1)
+		* mat4::rotate(2 * PI * actor->Rotation.Pitch / 65536., 1, 0, 0)
+		* mat4::rotate(2 * PI * actor->Rotation.Roll / 65536., 0, 1, 0);
+	Object object{
+		translation * rotation * prePivot,
+		{},
+		0,
+		0,
+		0,
+		0,  // lightMapIndex
+	};
+	if (actor->Mesh) {
+		auto mesh = actor->Mesh;
+
+		for (int i = 0; i < mesh->Textures.Num(); i++) {
+			auto texture = mesh->GetTexture(i, actor);
+			if (texture) {
+				auto texture_idx = texture_to_idx.at(texture);
+				if (logTextures)
+					debugf(L"Vulkan: %s@%p: Has texture %s@%p, index %d, mapped to %d", actor->GetFullName(), actor, texture->GetFullName(), texture, i, texture_idx);
+				object.textures[i] = texture_idx;
+			}
+			else {
+				object.textures[i] = defaultTextureIndex;
+			}
+		}
+
+		getVertexOffsetFromActor(mesh, actor, object);
+	}
+	return object;
+}
+
+// Packs the objects that changed since the last frame into the staging
+// buffer and collects the copy regions that scatter them to their slots
+// in the persistent object buffer. With a directly mapped object buffer,
+// the objects get written straight into their slots instead and there's
+// nothing to copy. Also keeps track of what each slot draws, which is
+// what the instanced draws get built from.
+struct ObjectDeltaWriter {
+	std::vector<u64>& hashes;
+	std::vector<ObjectDraw>& draws;
+	Object* staging;
+	bool direct;
+	std::vector<VkBufferCopy> regions;
+	u32 num_dirty = 0;
+
+	bool is_dirty(u32 slot, u64 hash) const {
+		return hashes[slot] != hash;
+	}
+
+	void write(u32 slot, u64 hash, const ObjectDraw& draw, const Object& object) {
+		hashes[slot] = hash;
+		draws[slot] = draw;
+		if (direct) {
+			staging[slot] = object;
+			num_dirty++;
+			return;
+		}
+		staging[num_dirty] = object;
+
+		VkDeviceSize src = num_dirty * sizeof(Object);
+		VkDeviceSize dst = slot * sizeof(Object);
+		num_dirty++;
+
+		// neighbouring slots usually change together (e.g. a bunch of
+		// pawns walking around), so merge them into a single region
+		if (!regions.empty()) {
+			auto& last = regions.back();
+			if (last.srcOffset + last.size == src && last.dstOffset + last.size == dst) {
+				last.size += sizeof(Object);
+				return;
+			}
+		}
+		regions.push_back({ src, dst, sizeof(Object) });
+	}
+
+	// an empty slot draws nothing
+	void clear(u32 slot) {
+		if (is_dirty(slot, 0))
+			write(slot, 0, {}, {});
+	}
+};
+
+// A range of an object, as it ends up in one of the draw buckets. Meshlet
+// ranges index the meshlet triangle buffer and ignore the bucket.
+struct ObjectInstance {
+	DrawBucket bucket;
+	ModelBase range;
+	u32 slot;
+	float distance; // squared, from the viewer
+	bool meshlets = false;
+};
+
+// Consecutive draw commands that share a pipeline.
+struct ObjectDrawRun {
+	DrawBucket bucket;
+	bool meshlets;
+	u32 first_command;
+	u32 num_commands;
+};
+
+// Writes the instance buffer & the draw commands for it. Consecutive
+// instances that draw the same range end up in the same instanced draw.
+struct ObjectDrawWriter {
+	u32* instances;
+	VkDrawIndirectCommand* commands;
+	u32 num_instances = 0;
+	u32 num_commands = 0;
+	std::vector<ObjectDrawRun> runs;
+
+	void add(const ObjectInstance& instance) {
+		instances[num_instances] = instance.slot;
+
+		if (!runs.empty() && runs.back().bucket == instance.bucket && runs.back().meshlets == instance.meshlets) {
+			auto& last = commands[num_commands - 1];
+			if (last.firstVertex == instance.range.wedgeIndexBase && last.vertexCount == instance.range.wedgeIndexCount) {
+				last.instanceCount++;
+				num_instances++;
+				return;
+			}
+		}
+		else {
+			runs.push_back({ instance.bucket, instance.meshlets, num_commands, 0 });
+		}
+
+		commands[num_commands++] = {
+			instance.range.wedgeIndexCount,
+			1,
+			instance.range.wedgeIndexBase,
+			num_instances
+		};
+		runs.back().num_commands++;
+		num_instances++;
+	}
+};
+
+// Up to 32 meshlets of one replaced model or mesh instance, which is what
+// a single task shader workgroup culls.
+struct TaskChunk {
+	u32 slot;
+	u32 meshlet_base;
+	u32 meshlet_count;
+};
+
+static constexpr u32 MeshletsPerTaskChunk = 32;
+
+static u32 numTaskChunks(const MeshletModel& model) {
+	return (model.meshletCount + MeshletsPerTaskChunk - 1) / MeshletsPerTaskChunk;
+}
+
+// Small per-frame buffers that the CPU rewrites every frame and the GPU
+// reads directly, without a copy.
+static std::unique_ptr<VulkanBuffer> createInstanceBuffer(VulkanDevice* device, size_t size, VkBufferUsageFlags usageFlags, const char* debugName) {
+	return BufferBuilder()
+		.Usage(
+			usageFlags,
+			VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+			VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT)
+		.Size(size)
+		.MinAlignment(16)
+		.DebugName(debugName)
+		.Create(device);
+}
+
+static bool hasHostVisibleDeviceMemory(VulkanDevice* device) {
+	const VkMemoryPropertyFlags wanted = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	const auto& memory = device->PhysicalDevice.Properties.Memory;
+	for (uint32_t i = 0; i < memory.memoryTypeCount; i++) {
+		if ((memory.memoryTypes[i].propertyFlags & wanted) == wanted)
+			return true;
+	}
+	return false;
+}
+
+// Object buffer in host-visible device-local memory (i.e. resizable BAR),
+// mapped for as long as it lives. The shaders read it directly, so there's
+// no staging copy. Starts out zeroed, i.e. with all slots empty.
+static std::unique_ptr<VulkanBuffer> createMappedObjectBuffer(VulkanDevice* device, int max_num_objects, const char* debugName, Object*& mapped) {
+	auto buffer = BufferBuilder()
+		.Usage(
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+			VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT)
+		.MemoryType(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0)
+		.Size(max_num_objects * sizeof(Object))
+		.MinAlignment(16)
+		.DebugName(debugName)
+		.Create(device);
+
+	VmaAllocationInfo info = {};
+	vmaGetAllocationInfo(device->allocator, buffer->allocation, &info);
+	if (!info.pMappedData)
+		throw std::runtime_error("Mapped object buffer has no mapping");
+	mapped = static_cast<Object*>(info.pMappedData);
+	memset(mapped, 0, max_num_objects * sizeof(Object));
+	return buffer;
+}
+
 void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 {
 	guard(UVulkanRenderDevice::DrawWorld);
+	// This reads the level's actors as they are right now, so it can't be
+	// deferred to the render thread. Instead it waits for the render thread
+	// to catch up and then records on this one.
+	RenderCommands->Sync();
+
 	bool firstTime = false;
 	if (last_scene && last_scene->level != scene->Level)
 	{
 		debugf(TEXT("Vulkan: Scene changed, resetting"));
-		vkDeviceWaitIdle(Device->device);
+		Commands->WaitForAllFrames();
 		last_scene.reset();
 		firstTime = true;
 	}
 
 	if (!last_scene) try {
 		debugf(TEXT("Vulkan: Scene changed, gonna upload data to GPU"));
+
+		// a level load is a good time for that, the game is waiting anyway
+		RenderPasses->SavePipelineCache();
 		auto level = scene->Level;
 		//auto model = level->Model;
 		debugf(L"Vulkan: Scene %p, Level %s@%p, Model %s@%p", scene, scene->Level->GetFullName(), scene->Level, level->Model->GetFullName(), level->Model);
@@ -1806,8 +2705,16 @@ void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 		collectActorsAndModelsAndMeshes(actors, models, meshes, level);*/
 
 		std::set<UMesh*> meshes;
+		std::map<UMesh*, ModelReplacement> mesh_replacements;
 		for (TObjectIterator<UMesh> meshIt; meshIt; ++meshIt) {
-			meshes.insert(*meshIt);
+			// try loading replacement instead
+			if (auto replacement = load_replacement_for_mesh(*meshIt)) {
+				debugf(L"Vulkan: Found replacement for %s@%p", (*meshIt)->GetFullName(), *meshIt);
+				mesh_replacements.emplace(*meshIt, std::move(*replacement));
+			}
+			else {
+				meshes.insert(*meshIt);
+			}
 		}
 
 		std::set<UModel*> models;
@@ -1868,8 +2775,8 @@ void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 			}
 		}
 
-		// go through replacement models and prepare uploads for their textures
-		for (auto& [model, replacement] : model_replacements) {
+		// go through replacement models & meshes and prepare uploads for their textures
+		auto prepare_replacement_textures = [&](UObject* model, ModelReplacement& replacement) {
 			// replacement models are loaded with their texture indices
 			// pointing to their .texture_file_name, but we have to remap
 			// them to our global texture indices
@@ -1901,6 +2808,12 @@ void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 
 			// and now we don't need the file names anymore
 			replacement.texture_file_names.clear();
+		};
+		for (auto& [model, replacement] : model_replacements) {
+			prepare_replacement_textures(model, replacement);
+		}
+		for (auto& [mesh, replacement] : mesh_replacements) {
+			prepare_replacement_textures(mesh, replacement);
 		}
 
 		// prepare lightmap uploads
@@ -1919,7 +2832,10 @@ void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 		ModelPusher modelPusher(default_texture, texture_to_idx/*, lightMapIndices*/);
 
 		for (auto& [model, replacement] : model_replacements) {
-			modelPusher.push_replacement_mesh(replacement);
+			modelPusher.push_model_replacement(replacement);
+		}
+		for (auto& [mesh, replacement] : mesh_replacements) {
+			modelPusher.push_mesh_replacement(mesh, replacement);
 		}
 
 		// count all surfs & verts
@@ -1933,6 +2849,26 @@ void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 			modelPusher.pushMesh(mesh);
 		}
 
+		// bake static actors into the static geometry
+		std::vector<LastScene::BakedActor> baked_actors;
+		std::vector<bool> actor_is_baked(level->Actors.Num(), false);
+		auto default_texture_idx = texture_to_idx.at(default_texture);
+		for (int i = 0; i < level->Actors.Num(); i++) {
+			auto actor = level->Actors(i);
+			if (!isBakeableActor(actor)) continue;
+			auto mesh_base = modelPusher.mesh_bases.find(actor->Mesh);
+			if (mesh_base == modelPusher.mesh_bases.end()) continue;
+			auto object = buildActorObject(actor, texture_to_idx, default_texture_idx, false);
+			modelPusher.bake_actor(mesh_base->second, object, actorPolyFlags(actor));
+			baked_actors.push_back({ i, actor, hashActorState(actor), {} });
+			actor_is_baked[i] = true;
+		}
+		modelPusher.finish_baking();
+		for (size_t i = 0; i < baked_actors.size(); i++) {
+			baked_actors[i].wedge_index_ranges = std::move(modelPusher.baked_actor_ranges[i]);
+		}
+		debugf(L"Vulkan: Baked %d out of %d actors, %d actors left for the per-frame loop", baked_actors.size(), level->Actors.Num(), level->Actors.Num() - baked_actors.size());
+
 		if (modelPusher.wedge_indices.size() != modelPusher.surf_indices.size() * 3) {
 			debugf(L"Vulkan: We screwed up, we expected to have 3 wedge indices per surf index, but got %d vert indices and %d surf indices", modelPusher.wedge_indices.size(), modelPusher.surf_indices.size());
 			throw std::runtime_error("We screwed up, we expected to have 3 vert indices per surf index");
@@ -1976,8 +2912,13 @@ void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 		auto meshlet_vert_upload = StagedUpload<MeshletVertex>::create(Device.get(), modelPusher.meshlet_verts, "MeshletVertexBuffer");
 		auto meshlet_vert_idx_upload = StagedUpload<UINT>::create(Device.get(), modelPusher.meshlet_vert_indices, "MeshletVertexIndexBuffer");
 		auto meshlet_local_idx_upload = StagedUpload<uint8_t>::create(Device.get(), modelPusher.meshlet_local_indices, "MeshletLocalIndexBuffer");
-		auto num_meshlet_draw_commands = modelPusher.meshlet_draw_commands.size();
-		auto meshlet_draw_commands_upload = StagedUpload<VkDrawIndirectCommand>::create(Device.get(), modelPusher.meshlet_draw_commands, "MeshletDrawCommandsBuffer", VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+		auto meshlet_triangle_idx_upload = StagedUpload<UINT>::create(Device.get(), modelPusher.meshlet_triangle_indices, "MeshletTriangleIndexBuffer");
+		auto meshlet_bounds_upload = StagedUpload<MeshletBounds>::create(Device.get(), modelPusher.meshlet_bounds, "MeshletBoundsBuffer");
+		auto use_mesh_shaders = SupportsMeshShaders && modelPusher.meshlets_fit_mesh_shaders;
+		if (SupportsMeshShaders && !use_mesh_shaders)
+			debugf(L"Vulkan: Some meshlets are too big for the mesh shaders, drawing them with vertex shaders instead");
+		debugf(L"Vulkan: Pushed %d meshlets (%d triangles) for %d replaced models and %d replaced meshes",
+			modelPusher.meshlets.size(), modelPusher.meshlet_triangle_indices.size() / 3, model_replacements.size(), mesh_replacements.size());
 
 		debugf(L"Vulkan: Finished filling surf, wedge, vert, surf index, wedge index and light map index buffers");
 
@@ -2031,20 +2972,68 @@ void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 		meshlet_vert_upload.copy(*uploadCommands);
 		meshlet_vert_idx_upload.copy(*uploadCommands);
 		meshlet_local_idx_upload.copy(*uploadCommands);
-		meshlet_draw_commands_upload.copy(*uploadCommands);
-		uploadCommands->end();
+		meshlet_triangle_idx_upload.copy(*uploadCommands);
+		meshlet_bounds_upload.copy(*uploadCommands);
+
+		// The object buffers start out zeroed, which matches object_hashes
+		// being all zero, i.e. all slots being empty. If the device lets us
+		// map device-local memory, each frame gets its own object buffer
+		// that we write into directly. Otherwise there's a single one that
+		// the changed objects get copied into through the upload ring.
+		auto actor_slot_base = static_cast<u32>(1 + modelPusher.static_buckets.size());
+		auto max_num_objects = level->Actors.Num() * 4 + actor_slot_base;
+		auto num_frames = Commands->GetFramesInFlight();
+		std::vector<PerFrame> frames(num_frames);
+		bool direct_objects = hasHostVisibleDeviceMemory(Device.get());
+		if (direct_objects) {
+			try {
+				for (auto& frame : frames)
+					frame.object_buffer = createMappedObjectBuffer(Device.get(), max_num_objects, "FrameObjectBuffer", frame.mapped_objects);
+			}
+			catch (const std::exception& e) {
+				debugf(TEXT("Vulkan: Failed to create mapped object buffers, falling back to staging because: %S"), e.what());
+				frames = std::vector<PerFrame>(num_frames);
+				direct_objects = false;
+			}
+		}
 
-		VulkanFence fence(Device.get());
+		std::unique_ptr<VulkanBuffer> object_buffer;
+		if (direct_objects) {
+			debugf(TEXT("Vulkan: Writing objects directly into device-local memory"));
+			for (auto& frame : frames) {
+				frame.object_hashes.resize(max_num_objects, 0);
+				frame.object_draws.resize(max_num_objects, ObjectDraw{});
+			}
+		}
+		else {
+			debugf(TEXT("Vulkan: Uploading objects through a staging buffer"));
+			object_buffer = BufferBuilder()
+				.Usage(
+					VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+					VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE)
+				.Size(max_num_objects * sizeof(Object))
+				.MinAlignment(16)
+				.DebugName("ObjectBuffer")
+				.Create(Device.get());
+			uploadCommands->fillBuffer(object_buffer->buffer, 0, VK_WHOLE_SIZE, 0);
+			VkPipelineStageFlags readStages = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT;
+			if (use_mesh_shaders)
+				readStages |= VK_PIPELINE_STAGE_TASK_SHADER_BIT_NV | VK_PIPELINE_STAGE_MESH_SHADER_BIT_NV;
+			PipelineBarrier()
+				.AddBuffer(object_buffer.get(), VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT)
+				.Execute(uploadCommands.get(), VK_PIPELINE_STAGE_TRANSFER_BIT, readStages);
+		}
+		uploadCommands->end();
 
 		debugf(TEXT("Vulkan: Submitting upload commands"));
-		QueueSubmit()
-			.AddCommandBuffer(uploadCommands.get())
-			.Execute(Device.get(), Device->GraphicsQueue, &fence);
+		QueueSubmit uploadSubmit;
+		uploadSubmit.AddCommandBuffer(uploadCommands.get());
+		uint64_t uploadDone = Commands->Graphics.Submit(uploadSubmit);
 
 		debugf(TEXT("Vulkan: Waiting for upload to finish"));
 		// TODO: Waiting for the upload is a bit sketchy, but it happens only
 		//       when the level changes, so we're probably fine.
-		vkWaitForFences(Device->device, 1, &fence.fence, VK_TRUE, UINT64_MAX);
+		Commands->Graphics.Wait(uploadDone);
 		debugf(TEXT("Vulkan: Upload finished"));
 
 		std::vector<UploadedTexture> uploaded_textures;
@@ -2063,7 +3052,25 @@ void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 		//	uploadedLightMaps.push_back(upload.asUploaded());
 		//}
 
-		auto max_num_objects = level->Actors.Num() * 4;
+		// worst case, every actor draws the replaced mesh with the most meshlets
+		u32 max_task_chunks = 0;
+		if (use_mesh_shaders) {
+			u32 max_mesh_task_chunks = 0;
+			for (auto& [mesh, range] : modelPusher.meshlet_mesh_ranges)
+				max_mesh_task_chunks = std::max(max_mesh_task_chunks, numTaskChunks(range));
+			max_task_chunks = numTaskChunks(modelPusher.meshlet_model_range) + max_num_objects * max_mesh_task_chunks;
+		}
+		auto createTaskChunkBuffer = [&](const char* debugName) -> std::unique_ptr<VulkanBuffer> {
+			if (!use_mesh_shaders) return nullptr;
+			return createInstanceBuffer(Device.get(), std::max(max_task_chunks, 1u) * sizeof(TaskChunk), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, debugName);
+		};
+
+		for (auto& frame : frames) {
+			frame.instance_buffer = createInstanceBuffer(Device.get(), max_num_objects * (DrawBucketCount + 1) * sizeof(u32), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, "FrameInstanceBuffer");
+			frame.object_draw_commands_buffer = createInstanceBuffer(Device.get(), max_num_objects * (DrawBucketCount + 1) * sizeof(VkDrawIndirectCommand), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, "FrameObjectDrawCommandsBuffer");
+			frame.task_chunk_buffer = createTaskChunkBuffer("FrameTaskChunkBuffer");
+		}
+
 		last_scene = LastScene{
 			.level = scene->Level,
 			.surf_buffer = std::move(surf_upload.device_buffer),
@@ -2077,57 +3084,59 @@ void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 			.meshlet_vertex_buffer = std::move(meshlet_vert_upload.device_buffer),
 			.meshlet_vert_idx_buffer = std::move(meshlet_vert_idx_upload.device_buffer),
 			.meshlet_local_idx_buffer = std::move(meshlet_local_idx_upload.device_buffer),
-			.meshlet_draw_commands_buffer = std::move(meshlet_draw_commands_upload.device_buffer),
-			.num_meshlet_draw_commands = num_meshlet_draw_commands,
+			.meshlet_triangle_idx_buffer = std::move(meshlet_triangle_idx_upload.device_buffer),
+			.meshlet_model_range = modelPusher.meshlet_model_range,
+			.meshlet_mesh_ranges = std::move(modelPusher.meshlet_mesh_ranges),
+			.meshlet_bounds_buffer = std::move(meshlet_bounds_upload.device_buffer),
+			.use_mesh_shaders = use_mesh_shaders,
 			.model_bases = std::move(modelPusher.model_bases),
 			.mesh_bases = std::move(modelPusher.mesh_bases),
 			.texture_to_idx = std::move(texture_to_idx),
 			.uploaded_textures = std::move(uploaded_textures),
 			.max_num_objects = max_num_objects,
-			.per_frame = {
-				{
-					StagedUpload<Object>::create(Device.get(), max_num_objects, "OddObjectBuffer", VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT),
-					Commands->CreateCommandBuffer()
-				},
-				{
-					StagedUpload<Object>::create(Device.get(), max_num_objects, "EvenObjectBuffer", VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT),
-					Commands->CreateCommandBuffer()
-				}
-			},
-			.odd_even = false
+			.object_buffer = std::move(object_buffer),
+			.object_hashes = direct_objects ? std::vector<u64>() : std::vector<u64>(max_num_objects, 0),
+			.object_draws = direct_objects ? std::vector<ObjectDraw>() : std::vector<ObjectDraw>(max_num_objects, ObjectDraw{}),
+			.static_buckets = std::move(modelPusher.static_buckets),
+			.baked_actors = std::move(baked_actors),
+			.actor_is_baked = std::move(actor_is_baked),
+			.actor_slot_base = actor_slot_base,
+			.per_frame = std::move(frames)
 		};
 
 		WriteDescriptors writeDescriptors;
-		for (int i = 0; i < 2; i++) {
+		for (int i = 0; i < num_frames; i++) {
 			auto& per_frame = last_scene->per_frame[i];
-			auto descriptorSet = DescriptorSets->GetNewSet(!!i);
+			auto descriptorSet = DescriptorSets->GetNewSet(i);
 			writeDescriptors
 				.AddBuffer(descriptorSet, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->surf_buffer.get())
 				.AddBuffer(descriptorSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->wedge_buffer.get())
 				.AddBuffer(descriptorSet, 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->vert_buffer.get())
-				.AddBuffer(descriptorSet, 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, per_frame.object_upload.device_buffer.get())
+				.AddBuffer(descriptorSet, 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->object_buffer_for(per_frame))
 				.AddBuffer(descriptorSet, 4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->surf_idx_buffer.get())
 				.AddBuffer(descriptorSet, 5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->wedge_idx_buffer.get())
 				//.AddBuffer(descriptorSet, 6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lastScene->lightMapBuffer.get())
 				.AddBuffer(descriptorSet, 6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->lights_buffer.get())
 				.AddSampler(descriptorSet, 7, Samplers->Samplers[0].get())
-				.AddImageArray(descriptorSet, 8, all_texture_views, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+				.AddImageArray(descriptorSet, 8, all_texture_views, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
+				.AddBuffer(descriptorSet, 9, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, per_frame.instance_buffer.get());
 
-			auto meshletDescriptorSet = DescriptorSets->GetMeshletSet(!!i);
+			auto meshletDescriptorSet = DescriptorSets->GetMeshletSet(i);
 			writeDescriptors
 				.AddBuffer(meshletDescriptorSet, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->meshlet_buffer.get())
 				.AddBuffer(meshletDescriptorSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->meshlet_vertex_buffer.get())
 				.AddBuffer(meshletDescriptorSet, 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->meshlet_vert_idx_buffer.get())
 				.AddBuffer(meshletDescriptorSet, 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->meshlet_local_idx_buffer.get())
+				.AddBuffer(meshletDescriptorSet, 6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->meshlet_triangle_idx_buffer.get())
+				.AddBuffer(meshletDescriptorSet, 7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->object_buffer_for(per_frame))
+				.AddBuffer(meshletDescriptorSet, 8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, per_frame.instance_buffer.get())
 				.AddSampler(meshletDescriptorSet, 4, Samplers->Samplers[0].get())
 				.AddImageArray(meshletDescriptorSet, 5, all_texture_views, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
-			per_frame.objectUploadCommands->begin(0);
-			per_frame.object_upload.copy(*per_frame.objectUploadCommands);
-			PipelineBarrier()
-				.AddBuffer(per_frame.object_upload.device_buffer.get(), VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT)
-				.Execute(per_frame.objectUploadCommands.get(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT);
-			per_frame.objectUploadCommands->end();
+			if (last_scene->use_mesh_shaders) {
+				writeDescriptors
+					.AddBuffer(meshletDescriptorSet, 9, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, last_scene->meshlet_bounds_buffer.get())
+					.AddBuffer(meshletDescriptorSet, 10, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, per_frame.task_chunk_buffer.get());
+			}
 		}
 
 		writeDescriptors.Execute(Device.get());
@@ -2143,38 +3152,95 @@ void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 		throw;
 	}
 
-	auto odd_even = last_scene->odd_even;
+	auto frame_index = Commands->GetFrameIndex();
 	auto defaultTextureIndex = last_scene->texture_to_idx.at(scene->Viewport->Actor->Level->DefaultTexture);
-	auto& per_frame = last_scene->per_frame[odd_even];
-	UINT actorIdx = 0;
+	auto& per_frame = last_scene->per_frame[frame_index];
+	auto& actors = scene->Level->Actors;
+	// slot 0 is the level model, then the static buckets, then the actors
+	UINT numObjects = last_scene->actor_slot_base + actors.Num();
+	if (numObjects > static_cast<UINT>(last_scene->max_num_objects)) {
+		debugf(TEXT("Vulkan: Too many actors in scene, expected %d, got %d"), last_scene->max_num_objects - last_scene->actor_slot_base, actors.Num());
+		throw std::runtime_error("Too many actors in scene");
+	}
+
+	// un-bake whatever baked actors changed since the level was loaded
+	std::vector<ModelBase> unbaked_ranges;
+	auto& baked_actors = last_scene->baked_actors;
+	for (size_t i = 0; i < baked_actors.size();) {
+		auto& baked = baked_actors[i];
+		auto actor = baked.actor_index < actors.Num() ? actors(baked.actor_index) : nullptr;
+		if (actor == baked.actor && !actor->bHidden && hashActorState(actor) == baked.hash) {
+			i++;
+			continue;
+		}
+		debugf(TEXT("Vulkan: Baked actor %d changed, un-baking it"), baked.actor_index);
+		last_scene->actor_is_baked[baked.actor_index] = false;
+		unbaked_ranges.insert(unbaked_ranges.end(), baked.wedge_index_ranges.begin(), baked.wedge_index_ranges.end());
+		if (&baked != &baked_actors.back())
+			baked = std::move(baked_actors.back());
+		baked_actors.pop_back();
+	}
+
+	// Without a mapped object buffer, room for every slot gets allocated,
+	// and whatever the dirty objects don't use is given back afterwards.
+	bool direct_objects = per_frame.mapped_objects != nullptr;
+	UploadAllocation object_staging;
+	if (!direct_objects)
+		object_staging = Uploads->Allocate(last_scene->object_hashes.size() * sizeof(Object));
+	ObjectDeltaWriter delta{
+		direct_objects ? per_frame.object_hashes : last_scene->object_hashes,
+		direct_objects ? per_frame.object_draws : last_scene->object_draws,
+		direct_objects ? per_frame.mapped_objects : reinterpret_cast<Object*>(object_staging.Data),
+		direct_objects
+	};
 	{
-		auto objectBuffer = per_frame.object_upload.map();
+		// the level model's slot also draws all the replaced models
+		ObjectDraw levelDraw{ {}, 0, FVector(0, 0, 0), last_scene->meshlet_model_range };
 		auto levelModelBase = last_scene->model_bases.find(last_scene->level->Model);
 		if (levelModelBase != last_scene->model_bases.end()) {
-			objectBuffer[actorIdx++] = {
+			levelDraw.model = levelModelBase->second;
+		}
+		else {
+			// no model? Might be okay, was probably meshletized.
+		}
+		auto levelHash = ObjectHasher()
+			.add(last_scene->level->Model)
+			.add(levelDraw.model)
+			.add(levelDraw.meshlets)
+			.finish();
+		if (delta.is_dirty(0, levelHash)) {
+			delta.write(0, levelHash, levelDraw, {
 				mat4::identity(),
 				{}, // level has no texture remapping
 				0,  // level draws with no vertex offset
 				0,  // same here
 				0,  // same here
-				{}, // pad
-				VkDrawIndirectCommand{
-					levelModelBase->second.wedgeIndexCount,
-					1,
-					levelModelBase->second.wedgeIndexBase,
-					0
-				}
-			};
-		}
-		else {
-			// no model? Might be okay, was probably meshletized.
+				0,  // lightMapIndex
+			});
 		}
 
-		auto& actors = scene->Level->Actors;
-		if (actors.Num() > last_scene->max_num_objects) {
-			debugf(TEXT("Vulkan: Too many actors in scene, expected %d, got %d"), last_scene->max_num_objects, actors.Num());
-			throw std::runtime_error("Too many actors in scene");
+		// the static buckets are already in world space & have their textures resolved
+		for (u32 i = 0; i < last_scene->static_buckets.size(); i++) {
+			auto& bucket = last_scene->static_buckets[i];
+			auto slot = 1 + i;
+			auto hash = ObjectHasher()
+				.add(bucket.base.wedgeIndexBase)
+				.add(bucket.base.wedgeIndexCount)
+				.finish();
+			if (delta.is_dirty(slot, hash)) {
+				ObjectDraw draw{};
+				draw.model.buckets[GetDrawBucket(bucket.poly_flags)] = bucket.base;
+				delta.write(slot, hash, draw, {
+					mat4::identity(),
+					{},
+					0,
+					0,
+					0,
+					0,  // lightMapIndex
+				});
+			}
 		}
+
 		FName dxchars(L"DeusExCharacters", FNAME_Find);
 		// excluded actor (i.e. typically the player)
 		auto excludedActor = (Viewport->Actor->bBehindView || scene->Parent != nullptr) ? nullptr :
@@ -2184,64 +3250,173 @@ void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 			: scene->Viewport->Actor->bBehindView ? nullptr
 			: scene->Viewport->Actor;
 		for (int i = 0; i < actors.Num(); i++) {
-			// TODO: meshletized actor models & meshes
+			if (static_cast<size_t>(i) < last_scene->actor_is_baked.size() && last_scene->actor_is_baked[i]) continue;
+			auto slot = last_scene->actor_slot_base + i;
 			auto actor = actors(i);
-			if (!actor) continue;
+			if (!actor) {
+				delta.clear(slot);
+				continue;
+			}
+			Stats.Actors++;
 			if (playerActor && playerActor->Weapon == actor) {
 				// TODO: This is definitely wrong, but right now it shall serve as a good enough approximation.
 				// We should figure out how the game actually does this. AActor's RenderOverlays, perhaps?
 				auto playerActorRot = playerActor->GetViewRotation();
 				actor->Rotation = playerActorRot;
 			}
-			else if (actor->bHidden) continue;
-			if (actor == excludedActor) continue;
-			auto modelBase = last_scene->model_base_for_actor(actor);
-			if (!modelBase) continue;
-			auto prePivot = mat4::translate(-actor->PrePivot.X, -actor->PrePivot.Y, -actor->PrePivot.Z);
-			auto translation = mat4::translate(actor->Location.X, actor->Location.Y, actor->Location.Z);
-			auto rotation = mat4::rotate(2 * PI * actor->Rotation.Yaw / 65536., 0, 0, 1)
-				* mat4::rotate(2 * PI * actor->Rotation.Pitch / 65536., 1, 0, 0)
-				* mat4::rotate(2 * PI * actor->Rotation.Roll / 65536., 0, 1, 0);
-			Object object{
-				translation * rotation * prePivot,
-				{},
-				0,
-				0,
-				0,
-				{}, // pad
-				VkDrawIndirectCommand{
-						modelBase->wedgeIndexCount,
-						1,
-						modelBase->wedgeIndexBase,
-						actorIdx
-					},
-			};
-			if (actor->Mesh) {
-				auto mesh = actor->Mesh;
-
-				for (int i = 0; i < mesh->Textures.Num(); i++) {
-					auto texture = mesh->GetTexture(i, actor);
-					if (texture) {
-						auto texture_idx = last_scene->texture_to_idx.at(texture);
-						if (firstTime)
-							debugf(L"Vulkan: %s@%p: Has texture %s@%p, index %d, mapped to %d", actor->GetFullName(), actor, texture->GetFullName(), texture, i, texture_idx);
-						object.textures[i] = texture_idx;
-					}
-					else {
-						object.textures[i] = defaultTextureIndex;
+			else if (actor->bHidden) {
+				delta.clear(slot);
+				continue;
+			}
+			if (actor == excludedActor) {
+				delta.clear(slot);
+				continue;
+			}
+			ObjectDraw draw{ {}, actorPolyFlags(actor), actor->Location, {} };
+			auto meshletRange = actor->Mesh && !actor->Brush ? last_scene->meshlet_mesh_ranges.find(actor->Mesh) : last_scene->meshlet_mesh_ranges.end();
+			if (meshletRange != last_scene->meshlet_mesh_ranges.end()) {
+				draw.meshlets = meshletRange->second;
+			}
+			else if (auto modelBase = last_scene->model_base_for_actor(actor)) {
+				draw.model = *modelBase;
+			}
+			else {
+				delta.clear(slot);
+				continue;
+			}
+
+			auto hash = hashActorState(actor);
+			if (!delta.is_dirty(slot, hash)) continue;
+
+			delta.write(slot, hash, draw, buildActorObject(actor, last_scene->texture_to_idx, defaultTextureIndex, firstTime));
+		}
+	}
+	if (!direct_objects)
+		Uploads->Trim(object_staging, delta.num_dirty * sizeof(Object));
+
+	Stats.Objects += numObjects;
+	Stats.DirtyObjects += delta.num_dirty;
+	Stats.BakedActors += baked_actors.size();
+	if (!delta.regions.empty() || !unbaked_ranges.empty()) {
+		// The previous frame might still be reading the slots & indices
+		// we're about to overwrite, hence the barrier before the transfer.
+		// Objects written directly into a mapped buffer need neither, the
+		// submit makes the host writes visible. The upload commands get
+		// submitted along with this frame's draw commands.
+		auto uploadCommands = Commands->GetUploadCommands();
+		VkPipelineStageFlags readStages = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT;
+		if (last_scene->use_mesh_shaders)
+			readStages |= VK_PIPELINE_STAGE_TASK_SHADER_BIT_NV | VK_PIPELINE_STAGE_MESH_SHADER_BIT_NV;
+		PipelineBarrier before;
+		PipelineBarrier after;
+		before.AddBuffer(last_scene->wedge_idx_buffer.get(), VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+		after.AddBuffer(last_scene->wedge_idx_buffer.get(), VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+		if (!delta.regions.empty()) {
+			before.AddBuffer(last_scene->object_buffer.get(), VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+			after.AddBuffer(last_scene->object_buffer.get(), VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+		}
+		before.Execute(uploadCommands, readStages, VK_PIPELINE_STAGE_TRANSFER_BIT);
+		if (!delta.regions.empty()) {
+			for (auto& region : delta.regions)
+				region.srcOffset += object_staging.Offset;
+			uploadCommands->copyBuffer(object_staging.Buffer->buffer, last_scene->object_buffer->buffer, static_cast<uint32_t>(delta.regions.size()), delta.regions.data());
+		}
+		// triangles with three identical indices are degenerate and
+		// don't rasterize, which is how baked actors get removed
+		for (auto& range : unbaked_ranges) {
+			uploadCommands->fillBuffer(last_scene->wedge_idx_buffer->buffer, range.wedgeIndexBase * sizeof(UINT), range.wedgeIndexCount * sizeof(UINT), 0);
+		}
+		after.Execute(uploadCommands, VK_PIPELINE_STAGE_TRANSFER_BIT, readStages);
+	}
+
+	// Sort the visible objects into draw buckets. Opaque & masked ones get
+	// grouped by what they draw, so that e.g. all crates of the same mesh
+	// are drawn with a single instanced draw. Animation frames are per
+	// instance (see Object::vertexOffset1), so they don't split groups.
+	// Translucent & modulated ones get drawn back to front instead, with
+	// level geometry first, as that has no single position to sort by.
+	// Meshlet replacements go first, grouped the same way as solid ones,
+	// unless the mesh shaders draw them, which get a list of task chunks.
+	std::vector<ObjectDrawRun> objectDrawRuns;
+	u32 numDrawCommands = 0;
+	u32 taskChunkCount = 0;
+	{
+		auto taskChunks = last_scene->use_mesh_shaders
+			? static_cast<TaskChunk*>(per_frame.task_chunk_buffer->Map(0, per_frame.task_chunk_buffer->size))
+			: nullptr;
+		auto& draws = delta.draws;
+		auto& viewOrigin = scene->Coords.Origin;
+		std::vector<ObjectInstance> meshlets;
+		std::vector<ObjectInstance> solid;
+		std::vector<ObjectInstance> blended;
+		for (u32 slot = 0; slot < numObjects; slot++) {
+			auto& draw = draws[slot];
+			auto distance = slot < last_scene->actor_slot_base
+				? std::numeric_limits<float>::max()
+				: (draw.location - viewOrigin).SizeSquared();
+			if (draw.meshlets.meshletCount != 0) {
+				if (taskChunks) {
+					for (u32 first = 0; first < draw.meshlets.meshletCount; first += MeshletsPerTaskChunk) {
+						taskChunks[taskChunkCount++] = {
+							slot,
+							draw.meshlets.meshletBase + first,
+							std::min(MeshletsPerTaskChunk, draw.meshlets.meshletCount - first),
+						};
 					}
 				}
-
-				getVertexOffsetFromActor(mesh, actor, object);
+				else {
+					meshlets.push_back({ DrawBucketOpaque, draw.meshlets.triangles, slot, distance, true });
+				}
+			}
+			for (int i = 0; i < DrawBucketCount; i++) {
+				auto& range = draw.model.buckets[i];
+				if (range.wedgeIndexCount == 0) continue;
+
+				// the actor's Style overrides the materials of its mesh
+				auto bucket = static_cast<DrawBucket>(i);
+				if (draw.poly_flags & (PF_Translucent | PF_Modulated))
+					bucket = GetDrawBucket(draw.poly_flags);
+				else if ((draw.poly_flags & PF_Masked) && bucket == DrawBucketOpaque)
+					bucket = DrawBucketMasked;
+
+				if (bucket == DrawBucketOpaque || bucket == DrawBucketMasked)
+					solid.push_back({ bucket, range, slot, distance });
+				else
+					blended.push_back({ bucket, range, slot, distance });
 			}
-
-			objectBuffer[actorIdx++] = object;
 		}
+		auto byRange = [](const ObjectInstance& a, const ObjectInstance& b) {
+			if (a.bucket != b.bucket) return a.bucket < b.bucket;
+			if (a.range.wedgeIndexBase != b.range.wedgeIndexBase) return a.range.wedgeIndexBase < b.range.wedgeIndexBase;
+			if (a.range.wedgeIndexCount != b.range.wedgeIndexCount) return a.range.wedgeIndexCount < b.range.wedgeIndexCount;
+			return a.slot < b.slot;
+		};
+		std::sort(meshlets.begin(), meshlets.end(), byRange);
+		std::sort(solid.begin(), solid.end(), byRange);
+		std::stable_sort(blended.begin(), blended.end(), [](const ObjectInstance& a, const ObjectInstance& b) {
+			return a.distance > b.distance;
+		});
+
+		ObjectDrawWriter writer{
+			static_cast<u32*>(per_frame.instance_buffer->Map(0, per_frame.instance_buffer->size)),
+			static_cast<VkDrawIndirectCommand*>(per_frame.object_draw_commands_buffer->Map(0, per_frame.object_draw_commands_buffer->size))
+		};
+		for (auto& instance : meshlets)
+			writer.add(instance);
+		for (auto& instance : solid)
+			writer.add(instance);
+		for (auto& instance : blended)
+			writer.add(instance);
+		per_frame.object_draw_commands_buffer->Unmap();
+		per_frame.instance_buffer->Unmap();
+		if (taskChunks)
+			per_frame.task_chunk_buffer->Unmap();
+
+		Stats.ObjectInstances += writer.num_instances;
+		Stats.ObjectDraws += writer.num_commands;
+		numDrawCommands = writer.num_commands;
+		objectDrawRuns = std::move(writer.runs);
 	}
-	per_frame.object_upload.unmap();
-	QueueSubmit()
-		.AddCommandBuffer(per_frame.objectUploadCommands.get())
-		.Execute(Device.get(), Device->GraphicsQueue, nullptr);
 
 	auto coords = scene->Coords;
 	auto subtractOriginMatrix = mat4{
@@ -2260,34 +3435,103 @@ void UVulkanRenderDevice::DrawWorld(FSceneNode* scene)
 	auto push = NewScenePushConstants{
 		pushconstants.objectToProjection * axisMatrix * subtractOriginMatrix,
 	};
+	// Records the mesh shader draw and/or a range of the draw runs. Each
+	// call binds whatever it needs, so that the ranges can be recorded
+	// into separate command buffers.
+	auto recordDraws = [&](VulkanCommandBuffer* cmdBuf, bool taskDraw, size_t firstRun, size_t endRun) {
+		if (taskDraw) {
+			auto meshShaderLayout = RenderPasses->Scene.MeshShaderPipelineLayout.get();
+			cmdBuf->bindPipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, RenderPasses->Scene.MeshShaderPipeline.get());
+			cmdBuf->bindDescriptorSet(VK_PIPELINE_BIND_POINT_GRAPHICS, meshShaderLayout, 0, DescriptorSets->GetMeshletSet(frame_index));
+			cmdBuf->pushConstants(meshShaderLayout, VK_SHADER_STAGE_TASK_BIT_NV | VK_SHADER_STAGE_MESH_BIT_NV, 0, sizeof(NewScenePushConstants), &push);
+			// firstTask offsets gl_WorkGroupID, so the task shader still
+			// finds its chunk when the draw has to be split up
+			u32 maxTasks = Device->PhysicalDevice.Properties.MeshShader.maxDrawMeshTasksCount;
+			for (u32 firstTask = 0; firstTask < taskChunkCount; firstTask += maxTasks)
+				cmdBuf->drawMeshTasks(std::min(taskChunkCount - firstTask, maxTasks), firstTask);
+		}
+
+		auto meshletLayout = RenderPasses->Scene.MeshletPipelineLayout.get();
+		auto layout = RenderPasses->Scene.NewPipelineLayout.get();
+		bool meshletsBound = false;
+		bool newBound = false;
+		for (size_t i = firstRun; i < endRun; i++) {
+			auto& run = objectDrawRuns[i];
+			if (run.meshlets) {
+				if (!meshletsBound) {
+					cmdBuf->bindPipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, RenderPasses->Scene.MeshletPipeline.get());
+					cmdBuf->bindDescriptorSet(VK_PIPELINE_BIND_POINT_GRAPHICS, meshletLayout, 0, DescriptorSets->GetMeshletSet(frame_index));
+					cmdBuf->pushConstants(meshletLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(NewScenePushConstants), &push);
+					meshletsBound = true;
+				}
+			}
+			else {
+				if (!newBound) {
+					cmdBuf->bindDescriptorSet(VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, DescriptorSets->GetNewSet(frame_index));
+					cmdBuf->pushConstants(layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(NewScenePushConstants), &push);
+					newBound = true;
+				}
+				cmdBuf->bindPipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, RenderPasses->GetNewPipeline(run.bucket));
+			}
+			cmdBuf->drawIndirect(
+				per_frame.object_draw_commands_buffer->buffer,
+				run.first_command * sizeof(VkDrawIndirectCommand),
+				run.num_commands,
+				sizeof(VkDrawIndirectCommand)
+			);
+		}
+	};
+
 	auto cmdBuf = Commands->GetDrawCommands();
-	auto meshletLayout = RenderPasses->Scene.MeshletPipelineLayout.get();
-	cmdBuf->bindPipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, RenderPasses->Scene.MeshletPipeline.get());
-	cmdBuf->bindDescriptorSet(VK_PIPELINE_BIND_POINT_GRAPHICS, meshletLayout, 0, DescriptorSets->GetMeshletSet(odd_even));
-	cmdBuf->pushConstants(meshletLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(NewScenePushConstants), &push);
-	cmdBuf->drawIndirect(
-		last_scene->meshlet_draw_commands_buffer->buffer,
-		0,
-		last_scene->num_meshlet_draw_commands,
-		sizeof(VkDrawIndirectCommand)
-	);
-
-	auto layout = RenderPasses->Scene.NewPipelineLayout.get();
-	cmdBuf->bindPipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, RenderPasses->Scene.NewPipeline.get());
-	cmdBuf->bindDescriptorSet(VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, DescriptorSets->GetNewSet(odd_even));
-	cmdBuf->pushConstants(layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(NewScenePushConstants), &push);
-	cmdBuf->drawIndirect(
-		per_frame.object_upload.device_buffer->buffer,
-		offsetof(Object, command),
-		actorIdx,
-		sizeof(Object)
-	);
-
-	last_scene->odd_even = !last_scene->odd_even;
+	int numJobs = static_cast<int>(std::min<size_t>(objectDrawRuns.size(), Workers->GetNumThreads()));
+	if (!VkParallelRecording || numJobs < 2 || numDrawCommands < MinParallelDrawCommands) {
+		recordDraws(cmdBuf, taskChunkCount > 0, 0, objectDrawRuns.size());
+	}
+	else {
+		RecordDrawsInParallel(cmdBuf, numJobs, taskChunkCount > 0, objectDrawRuns.size(), recordDraws);
+	}
+	unguard;
+}
+
+// Records the draw runs on the worker threads, split into contiguous
+// ranges so that they still get drawn in order. Secondary command buffers
+// can't be mixed with inline draws within a render pass, so the scene pass
+// gets split around them. No state survives executing them, hence all the
+// rebinding afterwards.
+void UVulkanRenderDevice::RecordDrawsInParallel(VulkanCommandBuffer* cmdBuf, int numJobs, bool taskDraw, size_t numRuns, const std::function<void(VulkanCommandBuffer*, bool, size_t, size_t)>& recordDraws)
+{
+	guard(UVulkanRenderDevice::RecordDrawsInParallel);
+	std::vector<VulkanCommandBuffer*> secondaries(numJobs);
+	auto framebuffer = Framebuffers->GetSwapChainFramebuffer();
+	auto resumePass = RenderPasses->Scene.ResumeRenderPass.get();
+	Workers->Run(numJobs, [&](int job, int thread) {
+		auto secondary = Commands->BeginSecondaryCommands(thread, resumePass, framebuffer);
+		secondary->setViewport(0, 1, &SceneViewport);
+		recordDraws(
+			secondary,
+			job == 0 && taskDraw,
+			numRuns * job / numJobs,
+			numRuns * (job + 1) / numJobs);
+		secondary->end();
+		secondaries[job] = secondary;
+	});
+
+	std::vector<VkCommandBuffer> handles;
+	for (auto secondary : secondaries)
+		handles.push_back(secondary->buffer);
+
+	RenderPasses->EndScene(cmdBuf);
+	RenderPasses->ResumeScene(cmdBuf, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+	cmdBuf->executeCommands(static_cast<uint32_t>(handles.size()), handles.data());
+	RenderPasses->EndScene(cmdBuf);
+	RenderPasses->ResumeScene(cmdBuf, VK_SUBPASS_CONTENTS_INLINE);
+
+	BindSceneBuffers(cmdBuf);
+	cmdBuf->setViewport(0, 1, &SceneViewport);
 	unguard;
 }
 
-std::optional<ModelBase> UVulkanRenderDevice::LastScene::model_base_for_actor(const AActor* actor) {
+std::optional<BucketedModel> UVulkanRenderDevice::LastScene::model_base_for_actor(const AActor* actor) {
 	if (actor->Brush) {
 		auto found = model_bases.find(actor->Brush);
 		if (found != model_bases.end()) {
@@ -11,6 +11,9 @@
 #include "ShaderManager.h"
 #include "TextureManager.h"
 #include "UploadManager.h"
+#include "WorkerPool.h"
+#include "RenderThread.h"
+#include "TileLayerCache.h"
 #include "vec.h"
 #include "mat.h"
 #include "types.h"
@@ -22,6 +25,34 @@ struct ModelBase {
 	UINT wedgeIndexCount;
 };
 
+// A model or mesh, with its triangles split up by draw bucket. Each bucket
+// is a contiguous range of wedge indices, empty buckets have no indices.
+struct BucketedModel {
+	ModelBase buckets[DrawBucketCount];
+};
+
+// pre-transformed static geometry that shares its material state
+struct StaticBucket {
+	DWORD poly_flags;
+	ModelBase base;
+};
+
+// what an object slot draws
+// A replaced model or mesh. The vertex path draws its range of the meshlet
+// triangle index buffer, the mesh shader path its range of meshlets.
+struct MeshletModel {
+	ModelBase triangles;
+	UINT meshletBase;
+	UINT meshletCount;
+};
+
+struct ObjectDraw {
+	BucketedModel model;
+	DWORD poly_flags; // from the actor's Style
+	FVector location; // to sort translucent objects by
+	MeshletModel meshlets; // for replaced models & meshes
+};
+
 template<typename T>
 struct StagedUpload
 {
@@ -149,6 +180,15 @@ public:
 	std::unique_ptr<DescriptorSetManager> DescriptorSets;
 	std::unique_ptr<RenderPassManager> RenderPasses;
 	std::unique_ptr<FramebufferManager> Framebuffers;
+	std::unique_ptr<TileLayerCache> TileLayers;
+
+	// also records draws & creates pipelines, see VkParallelRecording and
+	// VkParallelPipelines
+	std::unique_ptr<WorkerPool> Workers;
+
+	// The draw calls get recorded into its command stream and replayed
+	// from there, on a thread of its own if VkRenderThread is set.
+	std::unique_ptr<RenderThread> RenderCommands;
 
 	// Configuration.
 	BITFIELD UseVSync;
@@ -165,22 +205,47 @@ public:
 	BITFIELD Bloom;
 	BYTE BloomAmount;
 	FLOAT LODBias;
+	FLOAT LineWidth;
 	BYTE AntialiasMode;
 	BYTE GammaMode;
 	BYTE LightMode;
 
 	INT VkDeviceIndex;
+	INT VkFramesInFlight;
 	BITFIELD VkDebug;
 	BITFIELD VkExclusiveFullscreen;
+	BITFIELD VkMeshShaders;
+	BITFIELD VkParallelRecording;
+	BITFIELD VkParallelPipelines;
+	BITFIELD VkSpecializedShaders;
+	BITFIELD VkRenderThread;
+
+	// Set when the device can run scene-mesh.task & scene-mesh.mesh and
+	// VkMeshShaders allows it. Otherwise meshlets go through scene-mesh.vert.
+	bool SupportsMeshShaders = false;
 
 	struct
 	{
 		int ComplexSurfaces = 0;
 		int GouraudPolygons = 0;
 		int Tiles = 0;
-		int DrawCalls = 0;
+		std::atomic<int> DrawCalls = 0; // counted by the replay
 		int Uploads = 0;
 		int RectUploads = 0;
+		int Objects = 0;
+		int DirtyObjects = 0;
+		int Actors = 0;
+		int BakedActors = 0;
+		int ObjectDraws = 0;
+		int ObjectInstances = 0;
+		std::atomic<int> ScenePageSwitches = 0; // counted by the replay
+		std::atomic<int> TileDraws = 0; // counted by the replay
+		std::atomic<int> TileLayerRuns = 0; // counted by the replay
+		std::atomic<int> TileLayerHits = 0; // counted by the replay
+		std::atomic<int> TileLayersCreated = 0; // counted by the replay
+		int Lines = 0;
+		int Points = 0;
+		std::atomic<int> LineDraws = 0; // counted by the replay
 	} Stats;
 
 	int GetSettingsMultisample()
@@ -207,26 +272,85 @@ private:
 
 	bool IsLocked = false;
 
+	// Lines that EndFlash adds to each frame, see the VkLineStress command
+	int LineStress = 0;
+	void DrawLineStress(FSceneNode* Frame);
+
 	void SetPipeline(VulkanPipeline* pipeline);
 	void DrawBatch(VulkanCommandBuffer* cmdbuffer);
-	void SubmitAndWait(bool present, int presentWidth, int presentHeight, bool presentFullscreen);
+	void SubmitFrame(bool present, int presentWidth, int presentHeight, bool presentFullscreen);
+
+	// The replay side of Lock, Unlock, Flush and the draw calls
+	void ReplayCommands(CommandStream& stream);
+	void LockScene(const FPlane& screenClear, int width, int height, bool fullscreen);
+	void UnlockScene(bool present, int width, int height, bool fullscreen);
+	void RestartScene();
+	void DrawFans(VulkanPipeline* pipeline, SceneVertexFormat format, const void* vertices, uint32_t numVertices, const uint32_t* fanSizes, uint32_t numFans);
+	void DrawLineBatch(VulkanCommandBuffer* cmdbuffer);
+	void DrawTileInstance(VulkanPipeline* pipeline, float z, const SceneTileInstance& tile);
+	uint32_t WriteSceneVertices(SceneVertexFormat format, const void* vertices, uint32_t numVertices);
+	void ReserveScene(SceneVertexFormat format, uint32_t numVertices, size_t numIndices);
+	void BindSceneBuffers(VulkanCommandBuffer* cmdbuffer);
+
+	void RecordDrawsInParallel(VulkanCommandBuffer* cmdBuf, int numJobs, bool taskDraw, size_t numRuns, const std::function<void(VulkanCommandBuffer*, bool, size_t, size_t)>& recordDraws);
+
+	// Fewer object draws than this get recorded inline, splitting the
+	// scene pass isn't worth it for them.
+	static constexpr u32 MinParallelDrawCommands = 256;
+
+	// as set by SetSceneNode's replay, for command buffers that start out without one
+	VkViewport SceneViewport = {};
 
 	vec4 ApplyInverseGamma(vec4 color);
 
+	// Everything from here to SceneIndexPos belongs to the replay. The game
+	// thread may only touch it after RenderCommands->Sync().
 	struct
 	{
 		size_t SceneIndexStart = 0;
 		VulkanPipeline* Pipeline = nullptr;
+		// Tiles are instanced rather than indexed, see DrawTileInstance.
+		// These are SceneTileInstance indexes into the vertex buffer.
+		uint32_t TileInstanceStart = 0;
+		uint32_t TileInstances = 0;
+		uint64_t TileHash = 0;
+		vec4 TileBounds;
 	} Batch;
 
+	// Lines & points don't go through Batch. They pile up in here, indexed
+	// by OccludeLines, until something changes how they would come out,
+	// and then DrawLineBatch draws them with one draw per pipeline.
+	struct
+	{
+		std::vector<SceneTileVertex> Lines[2];
+		std::vector<SceneTileVertex> Points[2]; // two triangles each
+		std::vector<SceneLineInstance> Instances; // for thick lines
+		float Width = 1.0f; // LineWidth as of Lock
+	} LineBatch;
+
 	ScenePushConstants pushconstants;
 
-	size_t SceneVertexPos = 0;
+	size_t SceneVertexPos = 0; // in bytes
 	size_t SceneIndexPos = 0;
 
 	struct PerFrame {
-		StagedUpload<Object> object_upload;
-		std::unique_ptr<VulkanCommandBuffer> objectUploadCommands;
+		// Host-visible device-local object buffer, persistently mapped, that
+		// the shaders read straight from. Each frame has its own copy, so
+		// object_hashes & object_draws track what sits in this one. Null if
+		// the device has no such memory, then the objects go through the
+		// upload ring.
+		std::unique_ptr<VulkanBuffer> object_buffer;
+		Object* mapped_objects = nullptr;
+		std::vector<u64> object_hashes;
+		std::vector<ObjectDraw> object_draws;
+		// object slot for each instance, grouped by what the objects draw
+		std::unique_ptr<VulkanBuffer> instance_buffer;
+		// one instanced draw per group, meshlet ones first, then opaque ones,
+		// then masked ones, then translucent & modulated ones back to front
+		std::unique_ptr<VulkanBuffer> object_draw_commands_buffer;
+		// with mesh shaders, one TaskChunk per task workgroup instead of
+		// the meshlet draws
+		std::unique_ptr<VulkanBuffer> task_chunk_buffer;
 	};
 
 	struct LastScene
@@ -244,22 +368,58 @@ private:
 		std::unique_ptr<VulkanBuffer> meshlet_vertex_buffer;
 		std::unique_ptr<VulkanBuffer> meshlet_vert_idx_buffer;
 		std::unique_ptr<VulkanBuffer> meshlet_local_idx_buffer;
-		std::unique_ptr<VulkanBuffer> meshlet_draw_commands_buffer;
-		u32 num_meshlet_draw_commands;
-
-		std::map<UModel*, ModelBase> model_bases;
-		std::map<UMesh*, ModelBase> mesh_bases;
+		std::unique_ptr<VulkanBuffer> meshlet_triangle_idx_buffer;
+		// all replaced models are drawn by the level model's slot, the
+		// replaced meshes by the slots of the actors that use them
+		MeshletModel meshlet_model_range;
+		std::map<UMesh*, MeshletModel> meshlet_mesh_ranges;
+		std::unique_ptr<VulkanBuffer> meshlet_bounds_buffer;
+		// off if some meshlet doesn't fit the mesh shader's output limits
+		bool use_mesh_shaders;
+
+		std::map<UModel*, BucketedModel> model_bases;
+		std::map<UMesh*, BucketedModel> mesh_bases;
 		std::map<UTexture*, u32> texture_to_idx;
 		std::vector<UploadedTexture> uploaded_textures;
 		int max_num_objects;
 
-		PerFrame per_frame[2];
-		bool odd_even;
+		// Persistent device-local object buffer. Slot 0 is the level model,
+		// followed by the static buckets and then level->Actors, see
+		// actor_slot_base. object_hashes holds the state hash of whatever
+		// currently sits in each slot (0 = empty), so that only the slots
+		// that changed have to be uploaded. object_draws holds what each
+		// slot draws, empty slots draw nothing. Only used if the frames
+		// don't have their own mapped object buffer, see PerFrame.
+		std::unique_ptr<VulkanBuffer> object_buffer;
+		std::vector<u64> object_hashes;
+		std::vector<ObjectDraw> object_draws;
+
+		// Static actors are baked into the static buckets at load time and
+		// skipped by the per-frame actor loop. If a baked actor changes
+		// anyway, its triangles are degenerated and it becomes dynamic again.
+		struct BakedActor {
+			int actor_index;
+			AActor* actor;
+			u64 hash;
+			std::vector<ModelBase> wedge_index_ranges;
+		};
+		std::vector<StaticBucket> static_buckets;
+		std::vector<BakedActor> baked_actors;
+		std::vector<bool> actor_is_baked;
+		// slots before this one belong to the level model & static buckets
+		u32 actor_slot_base;
+
+		// one per frame in flight, indexed by Commands->GetFrameIndex()
+		std::vector<PerFrame> per_frame;
 
 		std::set<UModel*> missing_models;
 		std::set<UMesh*> missing_meshes;
 
-		std::optional<ModelBase> model_base_for_actor(const AActor* actor);
+		std::optional<BucketedModel> model_base_for_actor(const AActor* actor);
+
+		VulkanBuffer* object_buffer_for(const PerFrame& frame) {
+			return frame.object_buffer ? frame.object_buffer.get() : object_buffer.get();
+		}
 	};
 	std::optional<LastScene> last_scene = std::nullopt;
 };
@@ -12,6 +12,73 @@ UploadManager::~UploadManager()
 {
 }
 
+UploadAllocation UploadManager::Allocate(VkDeviceSize size, VkDeviceSize alignment)
+{
+	auto& graphics = renderer->Commands->Graphics;
+	while (!RingFrames.empty() && graphics.IsDone(RingFrames.front().SubmitValue))
+	{
+		RingTail = RingFrames.front().End;
+		RingFrames.pop_front();
+	}
+
+	VkDeviceSize capacity = renderer->Buffers->UploadBufferSize;
+	while (true)
+	{
+		uint64_t start = (RingHead + alignment - 1) & ~(uint64_t)(alignment - 1);
+		VkDeviceSize offset = start % capacity;
+		if (offset + size > capacity)
+		{
+			// doesn't fit in before the end of the buffer, skip to its start
+			start += capacity - offset;
+			offset = 0;
+		}
+
+		if (start + size - RingTail <= capacity)
+		{
+			RingHead = start + size;
+
+			UploadAllocation allocation;
+			allocation.Buffer = renderer->Buffers->UploadBuffer.get();
+			allocation.Offset = offset;
+			allocation.Size = size;
+			allocation.Data = renderer->Buffers->UploadData + offset;
+			return allocation;
+		}
+
+		if (RingFrames.empty())
+			break;
+
+		// only wait for as much as we need
+		graphics.Wait(RingFrames.front().SubmitValue);
+		RingTail = RingFrames.front().End;
+		RingFrames.pop_front();
+	}
+
+	// What the current submit allocated stays in the old buffer, which
+	// lives on until the GPU is done with this frame. The submits in flight
+	// used the old buffer too, so their ends mean nothing in the new one.
+	renderer->Buffers->GrowUploadBuffer(std::max(capacity * 2, size + alignment));
+	debugf(TEXT("Vulkan: Upload buffer grown to %d MB"), (int)(renderer->Buffers->UploadBufferSize / (1024 * 1024)));
+	RingFrames.clear();
+	RingHead = 0;
+	RingTail = 0;
+	return Allocate(size, alignment);
+}
+
+void UploadManager::Trim(UploadAllocation& allocation, VkDeviceSize usedSize)
+{
+	assert(allocation.Buffer == renderer->Buffers->UploadBuffer.get() && (RingHead - allocation.Size) % renderer->Buffers->UploadBufferSize == allocation.Offset);
+	RingHead -= allocation.Size - usedSize;
+	allocation.Size = usedSize;
+}
+
+void UploadManager::SubmittedFrame(uint64_t submitValue)
+{
+	uint64_t lastEnd = RingFrames.empty() ? RingTail : RingFrames.back().End;
+	if (RingHead != lastEnd)
+		RingFrames.push_back({ submitValue, RingHead });
+}
+
 //bool UploadManager::SupportsTextureFormat(ETextureFormat Format) const
 //{
 //	return TextureUploader::GetUploader(Format);
@@ -1,11 +1,23 @@
 #pragma once
 
 #include "TextureUploader.h"
+#include <deque>
 #include <unordered_map>
 
 class UVulkanRenderDevice;
 class CachedTexture;
 struct FTextureInfo;
+class VulkanBuffer;
+
+// A piece of the upload buffer, good until the GPU is done with the
+// submit it got allocated for.
+struct UploadAllocation
+{
+	VulkanBuffer* Buffer = nullptr;
+	VkDeviceSize Offset = 0;
+	VkDeviceSize Size = 0;
+	uint8_t* Data = nullptr;
+};
 
 class UploadManager
 {
@@ -18,9 +30,34 @@ public:
 	void UploadTexture(CachedTexture* tex, const FTextureInfo& Info, bool masked);
 	void UploadTextureRect(CachedTexture* tex, const FTextureInfo& Info, int x, int y, int w, int h);
 
+	// Space for data the current submit copies from, e.g. with commands
+	// recorded into Commands->GetUploadCommands(). The upload buffer is
+	// used as a ring: if it's full, this waits for the oldest submit that
+	// still owns a part of it, and if the current submit alone fills it,
+	// the buffer grows. alignment has to be a power of two.
+	UploadAllocation Allocate(VkDeviceSize size, VkDeviceSize alignment = 16);
+
+	// Gives back what wasn't used of the most recent allocation.
+	void Trim(UploadAllocation& allocation, VkDeviceSize usedSize);
+
+	// Everything allocated so far belongs to the submit that just got
+	// this value on the graphics timeline.
+	void SubmittedFrame(uint64_t submitValue);
+
 private:
 	UVulkanRenderDevice* renderer = nullptr;
 
+	// Where each submit's allocations end. RingHead and RingTail keep
+	// counting up, their position in the buffer is modulo its size.
+	struct RingFrame
+	{
+		uint64_t SubmitValue;
+		uint64_t End;
+	};
+	std::deque<RingFrame> RingFrames;
+	uint64_t RingHead = 0;
+	uint64_t RingTail = 0;
+
 	int UploadBufferPos = 0;
 	std::vector<CachedTexture*> PendingUploads;
 };
@@ -0,0 +1,103 @@
+#include "Precomp.h"
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(int numThreads)
+{
+	for (int i = 1; i < numThreads; i++)
+		Threads.emplace_back([this, i]() { WorkerMain(i); });
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(Mutex);
+		StopFlag = true;
+	}
+	WorkAvailable.notify_all();
+	for (auto& thread : Threads)
+		thread.join();
+}
+
+void WorkerPool::Run(int count, const std::function<void(int index, int thread)>& job)
+{
+	if (count <= 0)
+		return;
+
+	if (Threads.empty() || count == 1)
+	{
+		for (int i = 0; i < count; i++)
+			job(i, 0);
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(Mutex);
+		Job = &job;
+		JobCount = count;
+		NextIndex = 0;
+		Finished = 0;
+		Generation++;
+	}
+	WorkAvailable.notify_all();
+
+	RunJobs(0);
+
+	std::unique_lock<std::mutex> lock(Mutex);
+	WorkDone.wait(lock, [&]() { return Finished == JobCount; });
+	Job = nullptr;
+
+	if (Error)
+	{
+		auto error = Error;
+		Error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+void WorkerPool::WorkerMain(int thread)
+{
+	int seenGeneration = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(Mutex);
+			WorkAvailable.wait(lock, [&]() { return StopFlag || Generation != seenGeneration; });
+			if (StopFlag)
+				return;
+			seenGeneration = Generation;
+		}
+		RunJobs(thread);
+	}
+}
+
+void WorkerPool::RunJobs(int thread)
+{
+	while (true)
+	{
+		const std::function<void(int, int)>* job;
+		int index;
+		{
+			std::unique_lock<std::mutex> lock(Mutex);
+			if (!Job || NextIndex == JobCount)
+				return;
+			job = Job;
+			index = NextIndex++;
+		}
+
+		std::exception_ptr error;
+		try
+		{
+			(*job)(index, thread);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		std::unique_lock<std::mutex> lock(Mutex);
+		if (error && !Error)
+			Error = error;
+		if (++Finished == JobCount)
+			WorkDone.notify_all();
+	}
+}
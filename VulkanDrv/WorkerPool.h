@@ -0,0 +1,45 @@
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A handful of threads that run the same job over a range of indices,
+// with the calling thread helping out. Meant for short bursts of work
+// within a frame, e.g. recording command buffers in parallel.
+class WorkerPool
+{
+public:
+	WorkerPool(int numThreads);
+	~WorkerPool();
+
+	// Including the calling thread.
+	int GetNumThreads() const { return (int)Threads.size() + 1; }
+
+	// Runs job(index, thread) for every index in [0, count) and returns
+	// once all of them are done. thread is in [0, GetNumThreads()) and no
+	// two jobs run on the same thread at the same time, so it can be used
+	// to pick per-thread resources. The calling thread is thread 0. If a
+	// job throws, the first exception gets rethrown once all are done.
+	void Run(int count, const std::function<void(int index, int thread)>& job);
+
+private:
+	void WorkerMain(int thread);
+	void RunJobs(int thread);
+
+	std::vector<std::thread> Threads;
+
+	std::mutex Mutex;
+	std::condition_variable WorkAvailable;
+	std::condition_variable WorkDone;
+	const std::function<void(int, int)>* Job = nullptr;
+	int JobCount = 0;
+	int NextIndex = 0;
+	int Finished = 0;
+	int Generation = 0;
+	std::exception_ptr Error;
+	bool StopFlag = false;
+};
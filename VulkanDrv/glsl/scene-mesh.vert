@@ -23,6 +23,15 @@ struct Meshlet {
 	uint texIdx;
 };
 
+struct Object {
+	mat4 xform;
+	uint textures[8];
+	uint vertOffset1;
+	uint vertOffset2;
+	float vertLerp;
+	uint pad[5];
+};
+
 layout(push_constant) uniform ScenePushConstants
 {
 	mat4 objectToProjection;
@@ -31,8 +40,11 @@ layout(push_constant) uniform ScenePushConstants
 layout(std430, binding = 0) readonly buffer MeshletBuffer{ Meshlet meshlets[]; };
 layout(std430, binding = 1) readonly buffer VertBuffer{ Vertex verts[]; };
 layout(std430, binding = 2) readonly buffer MeshletVertIndexBuffer{ uint meshletVertIndices[]; };
-layout(std430, binding = 3) readonly buffer MeshletLocalIndexBuffer{ uint8_t meshletLocalIndices[]; };
-// TODO: objects?
+// one entry per triangle corner, packed as (meshlet index << 8) | local index
+layout(std430, binding = 6) readonly buffer MeshletTriangleIndexBuffer{ uint meshletTriangleIndices[]; };
+layout(std430, binding = 7) readonly buffer ObjectBuffer{ Object objects[]; };
+// object slot for each instance
+layout(std430, binding = 8) readonly buffer InstanceBuffer{ uint instanceObjects[]; };
 
 layout(location = 0) out vec3 outNormal;
 layout(location = 1) flat out uint outTexIndex;
@@ -40,8 +52,10 @@ layout(location = 2) out vec2 outTexCoord;
 
 void main()
 {
-	Meshlet meshlet = meshlets[gl_InstanceIndex];
-	uint localIdx = uint(meshletLocalIndices[gl_VertexIndex]);
+	uint packedIdx = meshletTriangleIndices[gl_VertexIndex];
+	Meshlet meshlet = meshlets[packedIdx >> 8];
+	Object obj = objects[instanceObjects[gl_InstanceIndex]];
+	uint localIdx = packedIdx & 0xffu;
 	uint vertIdx = meshletVertIndices[meshlet.vertOffset + localIdx];
 	Vertex vert = verts[vertIdx];
 
@@ -49,9 +63,9 @@ void main()
 	vec3 normal = vec3(vert.nx, vert.ny, vert.nz);
 	vec2 uv = vec2(vert.u, vert.v);
 
-	outNormal = normal;
+	outNormal = mat3(obj.xform) * normal;
 	outTexIndex = meshlet.texIdx;
 	outTexCoord = uv;
 
-	gl_Position = objectToProjection * vec4(point, 1.0);
+	gl_Position = objectToProjection * obj.xform * vec4(point, 1.0);
 }
\ No newline at end of file
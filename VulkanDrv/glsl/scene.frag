@@ -23,9 +23,11 @@ layout(location = 0) out vec4 outColor;
 void main() {
 	vec3 N = normalize(inNormal);
 	vec4 color = texture(sampler2D(textures[inTexIndex], texSampler), inTexCoord);
+#ifdef ALPHATEST
 	if (color.a < 1) {
 		discard;
 	}
+#endif
 
 	vec3 lightMap = vec3(1,1,1);
 	if (inLightsIndex != ~0u) {
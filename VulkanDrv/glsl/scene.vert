@@ -50,6 +50,7 @@ layout(std430, binding = 2) readonly buffer VertBuffer{ Vertex verts[]; };
 layout(std430, binding = 3) readonly buffer ObjectBuffer{ Object objects[]; };
 layout(scalar, binding = 4) readonly buffer SurfIdxBuffer{ uint surfIndices[]; };
 layout(scalar, binding = 5) readonly buffer VertIdxBuffer{ uint wedgeIndices[]; };
+layout(std430, binding = 9) readonly buffer InstanceBuffer{ uint instanceObjects[]; };
 //layout(std430, binding = 6) readonly buffer LightMapIndexBuffer{ LightMapIndex lightMapIndices[]; };
 
 layout(location = 0) out vec3 outNormal;
@@ -60,7 +61,7 @@ layout(location = 4) flat out uint outLightsIndex;
 
 void main()
 {
-	Object obj = objects[gl_InstanceIndex];
+	Object obj = objects[instanceObjects[gl_InstanceIndex]];
 
 	uint surfIdx = surfIndices[gl_VertexIndex / 3];
 	uint wedgeIdx = wedgeIndices[gl_VertexIndex];
@@ -0,0 +1,17 @@
+#version 450
+
+layout(binding = 0) uniform sampler2D layer;
+
+layout(location = 0) in vec2 texCoord;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+	// Skips what no tile covered (the layer is cleared to 0), so that the
+	// layers of opaque tiles only write depth where the tiles did.
+	vec4 color = texture(layer, texCoord);
+	if (color == vec4(0.0))
+		discard;
+	outColor = color;
+}
@@ -0,0 +1,21 @@
+#version 450
+
+// Draws a cached tile layer, see TileLayerCache. The rect is in NDC of the
+// scene viewport and covers the layer image exactly.
+layout(push_constant) uniform TileLayerPushConstants
+{
+	vec4 rect;
+	float depth;
+	float padding1, padding2, padding3;
+};
+
+layout(location = 0) out vec2 texCoord;
+
+const vec2 corners[6] = vec2[](vec2(0.0, 0.0), vec2(1.0, 0.0), vec2(1.0, 1.0), vec2(0.0, 0.0), vec2(1.0, 1.0), vec2(0.0, 1.0));
+
+void main()
+{
+	vec2 corner = corners[gl_VertexIndex];
+	gl_Position = vec4(mix(rect.xy, rect.zw, corner), depth, 1.0);
+	texCoord = corner;
+}
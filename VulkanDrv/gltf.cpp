@@ -290,7 +290,7 @@ void save_model_to_gltf(const UModel* model) {
 	}
 }
 
-std::optional<ModelReplacement> load_replacement_for_model(const UModel* model) {
+static std::optional<ModelReplacement> load_replacement(const UObject* model) {
 	std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> string_converter;
 	auto filename = "gltf/" + string_converter.to_bytes(model->GetFullName()) + ".replacement.gltf";
 	tinygltf::TinyGLTF gltf_reader;
@@ -497,6 +497,14 @@ std::optional<ModelReplacement> load_replacement_for_model(const UModel* model)
 	};
 }
 
+std::optional<ModelReplacement> load_replacement_for_model(const UModel* model) {
+	return load_replacement(model);
+}
+
+std::optional<ModelReplacement> load_replacement_for_mesh(const UMesh* mesh) {
+	return load_replacement(mesh);
+}
+
 std::string replacement_file_name_for_texture(const UTexture* texture) {
 	std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> string_converter;
 	return "gltf/" + string_converter.to_bytes(texture->GetFullName()) + ".png";
@@ -20,6 +20,11 @@ struct ModelReplacement {
 
 std::optional<ModelReplacement> load_replacement_for_model(const UModel* model);
 
+// Mesh replacements are in the mesh's local space, i.e. after the mesh's
+// Scale, Origin & RotOrigin are applied. They get drawn per actor with the
+// actor's object transform on top, like the regular mesh triangles.
+std::optional<ModelReplacement> load_replacement_for_mesh(const UMesh* mesh);
+
 struct TextureReplacement {
 	u32 width;
 	u32 height;
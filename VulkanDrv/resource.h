@@ -6,6 +6,10 @@
 #define IDR_SCENE_FRAG                  2
 #define IDR_SCENE_MESH_VERT             3
 #define IDR_SCENE_MESH_FRAG             4
+#define IDR_SCENE_MESH_TASK             5
+#define IDR_SCENE_MESH_MESH             6
+#define IDR_TILE_LAYER_VERT             7
+#define IDR_TILE_LAYER_FRAG             8
 
 // Next default values for new objects
 // 
@@ -6,6 +6,8 @@
 #include "mat.h"
 
 // rust got these right
+using u64 = unsigned long long;
+using i64 = long long;
 using u32 = unsigned int;
 using i32 = int;
 using u16 = unsigned short;
@@ -56,7 +58,7 @@ struct alignas(16) Object {
 	u32 vertexOffset2;
 	f32 vertexLerp;
 	u32 lightMapIndex; // index of a LightMapIndex
-	VkDrawIndirectCommand command;
+	u32 pad[4];
 };
 
 static_assert(sizeof(Object) == 128, "Object size must be 128 bytes");
@@ -75,4 +77,10 @@ struct Meshlet {
 	u32 tex_idx;
 };
 
+// Bounding sphere of a meshlet, for culling in the task shader.
+struct MeshletBounds {
+	glm::vec3 center;
+	f32 radius;
+};
+
 #endif
\ No newline at end of file
@@ -52,6 +52,8 @@ public:
 	VulkanDeviceBuilder& OptionalExtension(const std::string& extensionName);
 	VulkanDeviceBuilder& OptionalRayQuery();
 	VulkanDeviceBuilder& OptionalDescriptorIndexing();
+	VulkanDeviceBuilder& OptionalMeshShader();
+	VulkanDeviceBuilder& OptionalTimelineSemaphore();
 	VulkanDeviceBuilder& Surface(std::shared_ptr<VulkanSurface> surface);
 	VulkanDeviceBuilder& SelectDevice(int index);
 
@@ -93,11 +95,16 @@ class SemaphoreBuilder
 public:
 	SemaphoreBuilder();
 
+	// A timeline semaphore instead of a binary one, starting out at initialValue.
+	// Needs VulkanDeviceBuilder::OptionalTimelineSemaphore.
+	SemaphoreBuilder& Timeline(uint64_t initialValue = 0);
 	SemaphoreBuilder& DebugName(const char* name) { debugName = name; return *this; }
 
 	std::unique_ptr<VulkanSemaphore> Create(VulkanDevice* device);
 
 private:
+	VkSemaphoreCreateInfo semaphoreInfo = {};
+	VkSemaphoreTypeCreateInfo typeInfo = {};
 	const char* debugName = nullptr;
 };
 
@@ -203,7 +210,9 @@ enum class ShaderType
 	TessEvaluation,
 	Geometry,
 	Fragment,
-	Compute
+	Compute,
+	Task,
+	Mesh
 };
 
 class ShaderIncludeResult
@@ -232,10 +241,17 @@ public:
 
 	ShaderBuilder& DebugName(const char* name) { debugName = name; return *this; }
 
+	// Already compiled code. Create then uses it as is instead of compiling the sources.
+	ShaderBuilder& Spirv(std::vector<uint32_t> code);
+
+	// Compiles the sources without creating a shader module
+	std::vector<uint32_t> Compile(VulkanDevice *device);
+
 	std::unique_ptr<VulkanShader> Create(const char *shadername, VulkanDevice *device);
 
 private:
 	std::vector<std::pair<std::string, std::string>> sources;
+	std::vector<uint32_t> spirv;
 	std::function<ShaderIncludeResult(std::string headerName, std::string includerName, size_t inclusionDepth)> onIncludeSystem;
 	std::function<ShaderIncludeResult(std::string headerName, std::string includerName, size_t inclusionDepth)> onIncludeLocal;
 	int stage = 0;
@@ -391,8 +407,13 @@ public:
 
 	GraphicsPipelineBuilder& AddVertexShader(VulkanShader *shader);
 	GraphicsPipelineBuilder& AddFragmentShader(VulkanShader *shader);
+	GraphicsPipelineBuilder& AddTaskShader(VulkanShader *shader);
+	GraphicsPipelineBuilder& AddMeshShader(VulkanShader *shader);
 
-	GraphicsPipelineBuilder& AddVertexBufferBinding(int index, size_t stride);
+	// Applies to all shader stages. Stages without the constant ignore it.
+	GraphicsPipelineBuilder& AddSpecializationConstant(uint32_t constantID, uint32_t value);
+
+	GraphicsPipelineBuilder& AddVertexBufferBinding(int index, size_t stride, VkVertexInputRate inputRate = VK_VERTEX_INPUT_RATE_VERTEX);
 	GraphicsPipelineBuilder& AddVertexAttribute(int location, int binding, VkFormat format, size_t offset);
 
 	GraphicsPipelineBuilder& AddDynamicState(VkDynamicState state);
@@ -420,6 +441,10 @@ private:
 	std::vector<VkVertexInputAttributeDescription> vertexInputAttributes;
 	std::vector<VkDynamicState> dynamicStates;
 
+	VkSpecializationInfo specializationInfo = {};
+	std::vector<VkSpecializationMapEntry> specializationEntries;
+	std::vector<uint32_t> specializationData;
+
 	VulkanPipelineCache* cache = nullptr;
 	const char* debugName = nullptr;
 };
@@ -524,14 +549,21 @@ public:
 	QueueSubmit& AddCommandBuffer(VulkanCommandBuffer *buffer);
 	QueueSubmit& AddWait(VkPipelineStageFlags waitStageMask, VulkanSemaphore *semaphore);
 	QueueSubmit& AddSignal(VulkanSemaphore *semaphore);
+	// for timeline semaphores
+	QueueSubmit& AddWait(VkPipelineStageFlags waitStageMask, VulkanSemaphore *semaphore, uint64_t value);
+	QueueSubmit& AddSignal(VulkanSemaphore *semaphore, uint64_t value);
 	void Execute(VulkanDevice *device, VkQueue queue, VulkanFence *fence = nullptr);
 
 private:
 	VkSubmitInfo submitInfo = {};
+	VkTimelineSemaphoreSubmitInfo timelineInfo = {};
 	std::vector<VkSemaphore> waitSemaphores;
 	std::vector<VkPipelineStageFlags> waitStages;
+	std::vector<uint64_t> waitValues;
 	std::vector<VkSemaphore> signalSemaphores;
+	std::vector<uint64_t> signalValues;
 	std::vector<VkCommandBuffer> commandBuffers;
+	bool usesTimelines = false;
 };
 
 class WriteDescriptors
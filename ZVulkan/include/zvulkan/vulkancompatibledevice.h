@@ -11,6 +11,8 @@ public:
 
 	int GraphicsFamily = -1;
 	int PresentFamily = -1;
+	int TransferFamily = -1;
+	int ComputeFamily = -1;
 
 	bool GraphicsTimeQueries = false;
 
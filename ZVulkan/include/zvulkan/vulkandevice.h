@@ -35,8 +35,16 @@ public:
 	VkQueue GraphicsQueue = VK_NULL_HANDLE;
 	VkQueue PresentQueue = VK_NULL_HANDLE;
 
+	// Dedicated transfer & async compute queues if the device has them.
+	// Otherwise the family is GraphicsFamily and the queue is GraphicsQueue,
+	// so submits to it must not happen at the same time as graphics ones.
+	VkQueue TransferQueue = VK_NULL_HANDLE;
+	VkQueue ComputeQueue = VK_NULL_HANDLE;
+
 	int GraphicsFamily = -1;
 	int PresentFamily = -1;
+	int TransferFamily = -1;
+	int ComputeFamily = -1;
 	bool GraphicsTimeQueries = false;
 
 	bool SupportsExtension(const char* ext) const;
@@ -10,14 +10,23 @@ class VulkanSemaphore
 {
 public:
 	VulkanSemaphore(VulkanDevice *device);
+	VulkanSemaphore(VulkanDevice *device, VkSemaphore semaphore, bool timeline);
 	~VulkanSemaphore();
 
 	void SetDebugName(const char *name) { device->SetObjectName(name, (uint64_t)semaphore, VK_OBJECT_TYPE_SEMAPHORE); }
 
+	bool IsTimeline() const { return timeline; }
+
+	// Timeline semaphores only
+	uint64_t GetValue();
+	bool Wait(uint64_t value, uint64_t timeout = std::numeric_limits<uint64_t>::max());
+
 	VulkanDevice *device = nullptr;
 	VkSemaphore semaphore = VK_NULL_HANDLE;
 
 private:
+	bool timeline = false;
+
 	VulkanSemaphore(const VulkanSemaphore &) = delete;
 	VulkanSemaphore &operator=(const VulkanSemaphore &) = delete;
 };
@@ -363,12 +372,12 @@ private:
 class VulkanCommandBuffer
 {
 public:
-	VulkanCommandBuffer(VulkanCommandPool *pool);
+	VulkanCommandBuffer(VulkanCommandPool *pool, VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
 	~VulkanCommandBuffer();
 
 	void SetDebugName(const char *name);
 
-	void begin(VkCommandBufferUsageFlags flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	void begin(VkCommandBufferUsageFlags flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, const VkCommandBufferInheritanceInfo *inheritance = nullptr);
 	void end();
 
 	void bindPipeline(VkPipelineBindPoint pipelineBindPoint, VulkanPipeline *pipeline);
@@ -390,6 +399,8 @@ public:
 	void drawIndexed(uint32_t indexCount, uint32_t instanceCount, uint32_t firstIndex, int32_t vertexOffset, uint32_t firstInstance);
 	void drawIndirect(VkBuffer buffer, VkDeviceSize offset, uint32_t drawCount, uint32_t stride);
 	void drawIndexedIndirect(VkBuffer buffer, VkDeviceSize offset, uint32_t drawCount, uint32_t stride);
+	void drawMeshTasks(uint32_t taskCount, uint32_t firstTask);
+	void drawMeshTasksIndirect(VkBuffer buffer, VkDeviceSize offset, uint32_t drawCount, uint32_t stride);
 	void dispatch(uint32_t x, uint32_t y, uint32_t z);
 	void dispatchIndirect(VkBuffer buffer, VkDeviceSize offset);
 	void copyBuffer(VulkanBuffer *srcBuffer, VulkanBuffer *dstBuffer, VkDeviceSize srcOffset = 0, VkDeviceSize dstOffset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
@@ -449,7 +460,8 @@ public:
 
 	void SetDebugName(const char *name) { device->SetObjectName(name, (uint64_t)pool, VK_OBJECT_TYPE_COMMAND_POOL); }
 
-	std::unique_ptr<VulkanCommandBuffer> createBuffer();
+	std::unique_ptr<VulkanCommandBuffer> createBuffer(VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+	void reset(VkCommandPoolResetFlags flags = 0);
 
 	VkCommandPool pool = VK_NULL_HANDLE;
 
@@ -472,11 +484,38 @@ inline VulkanSemaphore::VulkanSemaphore(VulkanDevice *device) : device(device)
 	CheckVulkanError(result, "Could not create semaphore");
 }
 
+inline VulkanSemaphore::VulkanSemaphore(VulkanDevice *device, VkSemaphore semaphore, bool timeline) : device(device), semaphore(semaphore), timeline(timeline)
+{
+}
+
 inline VulkanSemaphore::~VulkanSemaphore()
 {
 	vkDestroySemaphore(device->device, semaphore, nullptr);
 }
 
+inline uint64_t VulkanSemaphore::GetValue()
+{
+	uint64_t value = 0;
+	VkResult result = vkGetSemaphoreCounterValueKHR(device->device, semaphore, &value);
+	CheckVulkanError(result, "Could not get semaphore value");
+	return value;
+}
+
+// Returns false if it timed out
+inline bool VulkanSemaphore::Wait(uint64_t value, uint64_t timeout)
+{
+	VkSemaphoreWaitInfo waitInfo = {};
+	waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &semaphore;
+	waitInfo.pValues = &value;
+	VkResult result = vkWaitSemaphoresKHR(device->device, &waitInfo, timeout);
+	if (result == VK_TIMEOUT)
+		return false;
+	CheckVulkanError(result, "Could not wait for semaphore");
+	return true;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 
 inline VulkanFence::VulkanFence(VulkanDevice *device) : device(device)
@@ -533,9 +572,15 @@ inline VulkanCommandPool::~VulkanCommandPool()
 	vkDestroyCommandPool(device->device, pool, nullptr);
 }
 
-inline std::unique_ptr<VulkanCommandBuffer> VulkanCommandPool::createBuffer()
+inline std::unique_ptr<VulkanCommandBuffer> VulkanCommandPool::createBuffer(VkCommandBufferLevel level)
 {
-	return std::make_unique<VulkanCommandBuffer>(this);
+	return std::make_unique<VulkanCommandBuffer>(this, level);
+}
+
+inline void VulkanCommandPool::reset(VkCommandPoolResetFlags flags)
+{
+	VkResult result = vkResetCommandPool(device->device, pool, flags);
+	CheckVulkanError(result, "Could not reset command pool");
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -618,11 +663,11 @@ inline void RenderPassBegin::Execute(VulkanCommandBuffer* cmdbuffer, VkSubpassCo
 
 /////////////////////////////////////////////////////////////////////////////
 
-inline VulkanCommandBuffer::VulkanCommandBuffer(VulkanCommandPool *pool) : pool(pool)
+inline VulkanCommandBuffer::VulkanCommandBuffer(VulkanCommandPool *pool, VkCommandBufferLevel level) : pool(pool)
 {
 	VkCommandBufferAllocateInfo allocInfo = {};
 	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.level = level;
 	allocInfo.commandPool = pool->pool;
 	allocInfo.commandBufferCount = 1;
 
@@ -635,12 +680,12 @@ inline VulkanCommandBuffer::~VulkanCommandBuffer()
 	vkFreeCommandBuffers(pool->device->device, pool->pool, 1, &buffer);
 }
 
-inline void VulkanCommandBuffer::begin(VkCommandBufferUsageFlags flags)
+inline void VulkanCommandBuffer::begin(VkCommandBufferUsageFlags flags, const VkCommandBufferInheritanceInfo *inheritance)
 {
 	VkCommandBufferBeginInfo beginInfo = {};
 	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 	beginInfo.flags = flags;
-	beginInfo.pInheritanceInfo = nullptr;
+	beginInfo.pInheritanceInfo = inheritance;
 
 	VkResult result = vkBeginCommandBuffer(buffer, &beginInfo);
 	CheckVulkanError(result, "Could not begin recording command buffer");
@@ -787,6 +832,16 @@ inline void VulkanCommandBuffer::drawIndexedIndirect(VkBuffer buffer, VkDeviceSi
 	vkCmdDrawIndexedIndirect(this->buffer, buffer, offset, drawCount, stride);
 }
 
+inline void VulkanCommandBuffer::drawMeshTasks(uint32_t taskCount, uint32_t firstTask)
+{
+	vkCmdDrawMeshTasksNV(buffer, taskCount, firstTask);
+}
+
+inline void VulkanCommandBuffer::drawMeshTasksIndirect(VkBuffer buffer, VkDeviceSize offset, uint32_t drawCount, uint32_t stride)
+{
+	vkCmdDrawMeshTasksIndirectNV(this->buffer, buffer, offset, drawCount, stride);
+}
+
 inline void VulkanCommandBuffer::dispatch(uint32_t x, uint32_t y, uint32_t z)
 {
 	vkCmdDispatch(buffer, x, y, z);
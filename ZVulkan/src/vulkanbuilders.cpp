@@ -137,6 +137,8 @@ ShaderBuilder& ShaderBuilder::Type(ShaderType type)
 	case ShaderType::Geometry: stage = EShLanguage::EShLangGeometry; break;
 	case ShaderType::Fragment: stage = EShLanguage::EShLangFragment; break;
 	case ShaderType::Compute: stage = EShLanguage::EShLangCompute; break;
+	case ShaderType::Task: stage = EShLanguage::EShLangTaskNV; break;
+	case ShaderType::Mesh: stage = EShLanguage::EShLangMeshNV; break;
 	}
 	return *this;
 }
@@ -247,7 +249,13 @@ private:
 	ShaderBuilder* shaderBuilder = nullptr;
 };
 
-std::unique_ptr<VulkanShader> ShaderBuilder::Create(const char *shadername, VulkanDevice *device)
+ShaderBuilder& ShaderBuilder::Spirv(std::vector<uint32_t> code)
+{
+	spirv = std::move(code);
+	return *this;
+}
+
+std::vector<uint32_t> ShaderBuilder::Compile(VulkanDevice *device)
 {
 	EShLanguage stage = (EShLanguage)this->stage;
 
@@ -305,6 +313,13 @@ std::unique_ptr<VulkanShader> ShaderBuilder::Create(const char *shadername, Vulk
 	std::vector<unsigned int> spirv;
 	spv::SpvBuildLogger logger;
 	glslang::GlslangToSpv(*intermediate, spirv, &logger, &spvOptions);
+	return spirv;
+}
+
+std::unique_ptr<VulkanShader> ShaderBuilder::Create(const char *shadername, VulkanDevice *device)
+{
+	if (spirv.empty())
+		spirv = Compile(device);
 
 	VkShaderModuleCreateInfo createInfo = {};
 	createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
@@ -346,11 +361,24 @@ std::unique_ptr<VulkanCommandPool> CommandPoolBuilder::Create(VulkanDevice* devi
 
 SemaphoreBuilder::SemaphoreBuilder()
 {
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+}
+
+SemaphoreBuilder& SemaphoreBuilder::Timeline(uint64_t initialValue)
+{
+	typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	typeInfo.initialValue = initialValue;
+	semaphoreInfo.pNext = &typeInfo;
+	return *this;
 }
 
 std::unique_ptr<VulkanSemaphore> SemaphoreBuilder::Create(VulkanDevice* device)
 {
-	auto obj = std::make_unique<VulkanSemaphore>(device);
+	VkSemaphore semaphore;
+	VkResult result = vkCreateSemaphore(device->device, &semaphoreInfo, nullptr, &semaphore);
+	CheckVulkanError(result, "Could not create semaphore");
+	auto obj = std::make_unique<VulkanSemaphore>(device, semaphore, typeInfo.semaphoreType == VK_SEMAPHORE_TYPE_TIMELINE);
 	if (debugName)
 		obj->SetDebugName(debugName);
 	return obj;
@@ -1194,12 +1222,51 @@ GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddFragmentShader(VulkanShader
 	return *this;
 }
 
-GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddVertexBufferBinding(int index, size_t stride)
+GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddTaskShader(VulkanShader* shader)
+{
+	VkPipelineShaderStageCreateInfo taskShaderStageInfo = {};
+	taskShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	taskShaderStageInfo.stage = VK_SHADER_STAGE_TASK_BIT_NV;
+	taskShaderStageInfo.module = shader->module;
+	taskShaderStageInfo.pName = "main";
+	shaderStages.push_back(taskShaderStageInfo);
+
+	pipelineInfo.stageCount = (uint32_t)shaderStages.size();
+	pipelineInfo.pStages = shaderStages.data();
+	return *this;
+}
+
+GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddMeshShader(VulkanShader* shader)
+{
+	VkPipelineShaderStageCreateInfo meshShaderStageInfo = {};
+	meshShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	meshShaderStageInfo.stage = VK_SHADER_STAGE_MESH_BIT_NV;
+	meshShaderStageInfo.module = shader->module;
+	meshShaderStageInfo.pName = "main";
+	shaderStages.push_back(meshShaderStageInfo);
+
+	pipelineInfo.stageCount = (uint32_t)shaderStages.size();
+	pipelineInfo.pStages = shaderStages.data();
+	return *this;
+}
+
+GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddSpecializationConstant(uint32_t constantID, uint32_t value)
+{
+	VkSpecializationMapEntry entry = {};
+	entry.constantID = constantID;
+	entry.offset = (uint32_t)(specializationData.size() * sizeof(uint32_t));
+	entry.size = sizeof(uint32_t);
+	specializationEntries.push_back(entry);
+	specializationData.push_back(value);
+	return *this;
+}
+
+GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddVertexBufferBinding(int index, size_t stride, VkVertexInputRate inputRate)
 {
 	VkVertexInputBindingDescription desc = {};
 	desc.binding = index;
 	desc.stride = (uint32_t)stride;
-	desc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+	desc.inputRate = inputRate;
 	vertexInputBindings.push_back(desc);
 
 	vertexInputInfo.vertexBindingDescriptionCount = (uint32_t)vertexInputBindings.size();
@@ -1236,6 +1303,16 @@ std::unique_ptr<VulkanPipeline> GraphicsPipelineBuilder::Create(VulkanDevice* de
 	colorBlending.pAttachments = colorBlendAttachments.data();
 	colorBlending.attachmentCount = (uint32_t)colorBlendAttachments.size();
 
+	if (!specializationEntries.empty())
+	{
+		specializationInfo.mapEntryCount = (uint32_t)specializationEntries.size();
+		specializationInfo.pMapEntries = specializationEntries.data();
+		specializationInfo.dataSize = specializationData.size() * sizeof(uint32_t);
+		specializationInfo.pData = specializationData.data();
+		for (auto& stage : shaderStages)
+			stage.pSpecializationInfo = &specializationInfo;
+	}
+
 	VkPipeline pipeline = 0;
 	VkResult result = vkCreateGraphicsPipelines(device->device, cache ? cache->cache : VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline);
 	CheckVulkanError(result, "Could not create graphics pipeline");
@@ -1550,9 +1627,23 @@ QueueSubmit& QueueSubmit::AddCommandBuffer(VulkanCommandBuffer* buffer)
 }
 
 QueueSubmit& QueueSubmit::AddWait(VkPipelineStageFlags waitStageMask, VulkanSemaphore* semaphore)
+{
+	return AddWait(waitStageMask, semaphore, 0);
+}
+
+QueueSubmit& QueueSubmit::AddSignal(VulkanSemaphore* semaphore)
+{
+	return AddSignal(semaphore, 0);
+}
+
+// Binary semaphores ignore their value, but if any semaphore in the submit
+// is a timeline one, every semaphore needs an entry.
+QueueSubmit& QueueSubmit::AddWait(VkPipelineStageFlags waitStageMask, VulkanSemaphore* semaphore, uint64_t value)
 {
 	waitStages.push_back(waitStageMask);
 	waitSemaphores.push_back(semaphore->semaphore);
+	waitValues.push_back(value);
+	usesTimelines = usesTimelines || semaphore->IsTimeline();
 
 	submitInfo.pWaitDstStageMask = waitStages.data();
 	submitInfo.pWaitSemaphores = waitSemaphores.data();
@@ -1560,9 +1651,12 @@ QueueSubmit& QueueSubmit::AddWait(VkPipelineStageFlags waitStageMask, VulkanSema
 	return *this;
 }
 
-QueueSubmit& QueueSubmit::AddSignal(VulkanSemaphore* semaphore)
+QueueSubmit& QueueSubmit::AddSignal(VulkanSemaphore* semaphore, uint64_t value)
 {
 	signalSemaphores.push_back(semaphore->semaphore);
+	signalValues.push_back(value);
+	usesTimelines = usesTimelines || semaphore->IsTimeline();
+
 	submitInfo.pSignalSemaphores = signalSemaphores.data();
 	submitInfo.signalSemaphoreCount = (uint32_t)signalSemaphores.size();
 	return *this;
@@ -1570,7 +1664,17 @@ QueueSubmit& QueueSubmit::AddSignal(VulkanSemaphore* semaphore)
 
 void QueueSubmit::Execute(VulkanDevice* device, VkQueue queue, VulkanFence* fence)
 {
-	VkResult result = vkQueueSubmit(device->GraphicsQueue, 1, &submitInfo, fence ? fence->fence : VK_NULL_HANDLE);
+	if (usesTimelines)
+	{
+		timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+		timelineInfo.waitSemaphoreValueCount = (uint32_t)waitValues.size();
+		timelineInfo.pWaitSemaphoreValues = waitValues.data();
+		timelineInfo.signalSemaphoreValueCount = (uint32_t)signalValues.size();
+		timelineInfo.pSignalSemaphoreValues = signalValues.data();
+		submitInfo.pNext = &timelineInfo;
+	}
+
+	VkResult result = vkQueueSubmit(queue, 1, &submitInfo, fence ? fence->fence : VK_NULL_HANDLE);
 	CheckVulkanError(result, "Could not submit command buffer");
 }
 
@@ -1842,6 +1946,18 @@ VulkanDeviceBuilder& VulkanDeviceBuilder::OptionalDescriptorIndexing()
 	return *this;
 }
 
+VulkanDeviceBuilder& VulkanDeviceBuilder::OptionalMeshShader()
+{
+	OptionalExtension(VK_NV_MESH_SHADER_EXTENSION_NAME);
+	return *this;
+}
+
+VulkanDeviceBuilder& VulkanDeviceBuilder::OptionalTimelineSemaphore()
+{
+	OptionalExtension(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+	return *this;
+}
+
 VulkanDeviceBuilder& VulkanDeviceBuilder::Surface(std::shared_ptr<VulkanSurface> surface)
 {
 	if (surface)
@@ -1916,6 +2032,9 @@ std::vector<VulkanCompatibleDevice> VulkanDeviceBuilder::FindDevices(const std::
 		enabledFeatures._8BitStorage.storageBuffer8BitAccess = deviceFeatures._8BitStorage.storageBuffer8BitAccess;
 		enabledFeatures._8BitStorage.storagePushConstant8 = deviceFeatures._8BitStorage.storagePushConstant8;
 		enabledFeatures._8BitStorage.uniformAndStorageBuffer8BitAccess = deviceFeatures._8BitStorage.uniformAndStorageBuffer8BitAccess;
+		enabledFeatures.MeshShader.taskShader = deviceFeatures.MeshShader.taskShader;
+		enabledFeatures.MeshShader.meshShader = deviceFeatures.MeshShader.meshShader;
+		enabledFeatures.TimelineSemaphore.timelineSemaphore = deviceFeatures.TimelineSemaphore.timelineSemaphore;
 
 		// Figure out which queue can present
 		if (surface)
@@ -1948,6 +2067,32 @@ std::vector<VulkanCompatibleDevice> VulkanDeviceBuilder::FindDevices(const std::
 			}
 		}
 
+		// A transfer-only family is usually the copy engine, a compute family
+		// without graphics can run alongside it. Devices with just the one
+		// family (e.g. lavapipe) use the graphics queue for both.
+		for (int i = 0; i < (int)info.QueueFamilies.size(); i++)
+		{
+			const auto& queueFamily = info.QueueFamilies[i];
+			if (queueFamily.queueCount > 0 && (queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFamily.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+			{
+				dev.TransferFamily = i;
+				break;
+			}
+		}
+		for (int i = 0; i < (int)info.QueueFamilies.size(); i++)
+		{
+			const auto& queueFamily = info.QueueFamilies[i];
+			if (queueFamily.queueCount > 0 && (queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT))
+			{
+				dev.ComputeFamily = i;
+				break;
+			}
+		}
+		if (dev.TransferFamily == -1)
+			dev.TransferFamily = dev.GraphicsFamily;
+		if (dev.ComputeFamily == -1)
+			dev.ComputeFamily = dev.GraphicsFamily;
+
 		// Only use device if we found the required graphics and present queues
 		if (dev.GraphicsFamily != -1 && (!surface || dev.PresentFamily != -1))
 		{
@@ -14,6 +14,8 @@ VulkanDevice::VulkanDevice(std::shared_ptr<VulkanInstance> instance, std::shared
 
 	GraphicsFamily = selectedDevice.GraphicsFamily;
 	PresentFamily = selectedDevice.PresentFamily;
+	TransferFamily = selectedDevice.TransferFamily;
+	ComputeFamily = selectedDevice.ComputeFamily;
 	GraphicsTimeQueries = selectedDevice.GraphicsTimeQueries;
 
 	try
@@ -66,6 +68,10 @@ void VulkanDevice::CreateDevice()
 		neededFamilies.insert(GraphicsFamily);
 	if (PresentFamily != -1)
 		neededFamilies.insert(PresentFamily);
+	if (TransferFamily != -1)
+		neededFamilies.insert(TransferFamily);
+	if (ComputeFamily != -1)
+		neededFamilies.insert(ComputeFamily);
 
 	for (int index : neededFamilies)
 	{
@@ -128,6 +134,16 @@ void VulkanDevice::CreateDevice()
 		*next = &EnabledFeatures._8BitStorage;
 		next = &EnabledFeatures._8BitStorage.pNext;
 	}
+	if (SupportsExtension(VK_NV_MESH_SHADER_EXTENSION_NAME))
+	{
+		*next = &EnabledFeatures.MeshShader;
+		next = &EnabledFeatures.MeshShader.pNext;
+	}
+	if (SupportsExtension(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME))
+	{
+		*next = &EnabledFeatures.TimelineSemaphore;
+		next = &EnabledFeatures.TimelineSemaphore.pNext;
+	}
 
 	VkResult result = vkCreateDevice(PhysicalDevice.Device, &deviceCreateInfo, nullptr, &device);
 	CheckVulkanError(result, "Could not create vulkan device");
@@ -138,6 +154,10 @@ void VulkanDevice::CreateDevice()
 		vkGetDeviceQueue(device, GraphicsFamily, 0, &GraphicsQueue);
 	if (PresentFamily != -1)
 		vkGetDeviceQueue(device, PresentFamily, 0, &PresentQueue);
+	if (TransferFamily != -1)
+		vkGetDeviceQueue(device, TransferFamily, 0, &TransferQueue);
+	if (ComputeFamily != -1)
+		vkGetDeviceQueue(device, ComputeFamily, 0, &ComputeQueue);
 }
 
 void VulkanDevice::ReleaseResources()
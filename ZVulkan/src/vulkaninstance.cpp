@@ -200,11 +200,17 @@ std::vector<VulkanPhysicalDevice> VulkanInstance::GetPhysicalDevices(VkInstance
 				*next = &dev.Properties.DescriptorIndexing;
 				next = &dev.Properties.DescriptorIndexing.pNext;
 			}
+			if (checkForExtension(VK_NV_MESH_SHADER_EXTENSION_NAME))
+			{
+				*next = &dev.Properties.MeshShader;
+				next = &dev.Properties.MeshShader.pNext;
+			}
 
 			vkGetPhysicalDeviceProperties2(dev.Device, &deviceProperties2);
 			dev.Properties.Properties = deviceProperties2.properties;
 			dev.Properties.AccelerationStructure.pNext = nullptr;
 			dev.Properties.DescriptorIndexing.pNext = nullptr;
+			dev.Properties.MeshShader.pNext = nullptr;
 
 			VkPhysicalDeviceFeatures2 deviceFeatures2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
 
@@ -234,6 +240,16 @@ std::vector<VulkanPhysicalDevice> VulkanInstance::GetPhysicalDevices(VkInstance
 				*next = &dev.Features._8BitStorage;
 				next = &dev.Features._8BitStorage.pNext;
 			}
+			if (checkForExtension(VK_NV_MESH_SHADER_EXTENSION_NAME))
+			{
+				*next = &dev.Features.MeshShader;
+				next = &dev.Features.MeshShader.pNext;
+			}
+			if (checkForExtension(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME))
+			{
+				*next = &dev.Features.TimelineSemaphore;
+				next = &dev.Features.TimelineSemaphore.pNext;
+			}
 
 			vkGetPhysicalDeviceFeatures2(dev.Device, &deviceFeatures2);
 			dev.Features.Features = deviceFeatures2.features;
@@ -242,6 +258,8 @@ std::vector<VulkanPhysicalDevice> VulkanInstance::GetPhysicalDevices(VkInstance
 			dev.Features.RayQuery.pNext = nullptr;
 			dev.Features.DescriptorIndexing.pNext = nullptr;
 			dev.Features._8BitStorage.pNext = nullptr;
+			dev.Features.MeshShader.pNext = nullptr;
+			dev.Features.TimelineSemaphore.pNext = nullptr;
 		}
 		else
 		{